@@ -0,0 +1,581 @@
+#ifndef ASYNC_MYSQL_H
+#define ASYNC_MYSQL_H
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <mysql/mysql.h>
+#include "../lock/locker.h"
+#include "../lock/clock.h"
+#include "../log/log.h"
+#include "sql_connection_pool.h"
+
+/****************************************************************************************/
+/* 非阻塞的MySQL客户端，基于MariaDB Connector/C的非阻塞接口(mysql_xxx_start/mysql_xxx_cont)   */
+/*   工作线程用submit()提交查询后立即返回，不再阻塞在mysql_query上占着线程和连接              */
+/*   查询全部在主线程的epoll循环里推进：连接的socket注册到主线程的epollfd上，                  */
+/*   库函数要等socket可读/可写时返回等待的事件，事件到来后主线程调用handle()继续执行，          */
+/*   查询完成后在主线程中调用查询的done回调                                                   */
+/*   少量连接上可以排队很多查询，等待中的查询只占一个async_query结构，不占线程                   */
+/* 没有非阻塞接口的客户端库（MySQL官方的libmysqlclient）上init()返回false，调用者退回阻塞查询  */
+/* 执行connection_pool语句表里只有一个参数的语句，取第一行第一列，参数由这里转义后替换?         */
+/* 可以用add_replica()加上只读的从库：查询分给空闲连接最多（未完成查询最少）的从库，               */
+/*   从库上没查到（可能还没同步过来）或者出错时回主库再查；从库连接都不能用了就全部查主库          */
+/* 超时和重连由主线程的定时器每个TIMESLOT调用一次tick()推进：                                  */
+/*   查询从提交起（包括排队）超过QUERY_TIMEOUT_MS按出错结束，执行到一半的连接关掉重连；           */
+/*   库函数要求等待超时(MYSQL_WAIT_TIMEOUT)的，到时间后告诉它超时了，由它返回错误；               */
+/*   断开的连接在主线程里非阻塞地重连，连不上时重试间隔从1秒起加倍，最长32秒                      */
+/****************************************************************************************/
+
+// 一个异步查询，由提交者分配，done回调之前不能释放
+struct async_query
+{
+    STATEMENT stmt;     // 要执行的语句，语句中的?替换成转义后的param
+    char param[128];    // 参数
+    int status;         // 1表示查到了，0表示没有结果，-1表示出错或超时
+    char value[128];    // 查到的第一行第一列，NULL列为空串
+    void (*done)(async_query *q); // 在主线程中调用
+    void *arg;          // 提交者自己的数据
+    bool primary;       // 只在主库上执行，由async_mysql设置
+    long long deadline_ms; // 到这个时间还没完成就按出错结束，由async_mysql设置
+    async_query *next;
+};
+
+#ifdef MYSQL_WAIT_READ
+
+class async_mysql
+{
+private:
+    static const int MAX_CONN = 64;
+    static const int MAX_ENDPOINTS = 17;        // 主库加最多16个从库
+    static const int QUERY_TIMEOUT_MS = 3000;   // 查询从提交到完成最多多久
+    static const int CONNECT_TIMEOUT_MS = 3000; // 重连最多多久
+    static const int MIN_BACKOFF_MS = 1000;     // 连接断开后第一次重连前等多久
+    static const int MAX_BACKOFF_MS = 32000;    // 重连失败后间隔加倍，最多等多久
+
+    enum STAGE
+    {
+        STAGE_IDLE = 0, // 空闲
+        STAGE_QUERY,    // 正在执行mysql_real_query
+        STAGE_STORE,    // 正在读取结果集
+        STAGE_CONNECT,  // 正在重连
+        STAGE_BROKEN    // 已经断开，等到retry_at_ms再重连
+    };
+
+    // 一个库的连接参数，重连时用
+    struct endpoint
+    {
+        char host[64];
+        char user[32];
+        char passwd[32];
+        char db[32];
+        int port;
+    };
+
+    // 一个非阻塞连接，只在主线程中访问
+    struct conn
+    {
+        MYSQL *mysql;
+        int fd;         // 断开时为-1
+        int endpoint;   // 0是主库，之后是从库
+        STAGE stage;
+        bool added;     // fd是否已经加入epoll
+        async_query *q; // 正在执行的查询
+        long long expire_ms;   // 正在执行的查询或者重连到这个时间还没完成就放弃
+        long long wait_ms;     // 库要求等待超时(MYSQL_WAIT_TIMEOUT)时，超时的时间，0表示没有
+        long long retry_at_ms; // 断开后到这个时间再重连
+        int backoff_ms;        // 下次重连失败后等多久
+    };
+
+    conn m_conns[MAX_CONN];
+    int m_conn_count;
+    endpoint m_endpoints[MAX_ENDPOINTS];
+    int m_endpoint_count;
+    int m_busy[MAX_ENDPOINTS]; // 每个库正在执行的查询数
+    int m_replica_conns;       // 还能用的从库连接数
+    int m_epollfd;
+    int m_eventfd;        // 工作线程提交查询后通知主线程
+
+    locker m_lock;        // 保护等待队列，工作线程和主线程共用
+    async_query *m_head;  // 还没有分配到连接的查询，先进先出
+    async_query **m_tail;
+
+    // 把库要等待的事件注册到epoll上，EPOLLONESHOT保证事件只触发一次；要求等待超时的记下超时时间，由tick()检查
+    void wait_for(conn &c, int status)
+    {
+        c.wait_ms = (status & MYSQL_WAIT_TIMEOUT) ? now_ms() + mysql_get_timeout_value_ms(c.mysql) : 0;
+
+        epoll_event event;
+        event.data.fd = c.fd;
+        event.events = EPOLLONESHOT;
+        if (status & MYSQL_WAIT_READ)
+            event.events |= EPOLLIN;
+        if (status & MYSQL_WAIT_WRITE)
+            event.events |= EPOLLOUT;
+        if (status & MYSQL_WAIT_EXCEPT)
+            event.events |= EPOLLPRI;
+        epoll_ctl(m_epollfd, c.added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c.fd, &event);
+        c.added = true;
+    }
+
+    // 出错后连接还能不能用：客户端库的错误码(CR_xxx，2000～2999)说明连接断了或者状态不明，服务器返回的错误不影响连接
+    bool lost(conn &c)
+    {
+        unsigned int err = mysql_errno(c.mysql);
+        return err >= 2000 && err < 3000;
+    }
+
+    // 关掉断开、出错或者超时的连接，等一段时间后在tick()里重连，连续重连失败时间隔加倍
+    void drop(conn &c)
+    {
+        if (c.endpoint && c.stage != STAGE_CONNECT && c.stage != STAGE_BROKEN)
+            --m_replica_conns;
+        if (c.added)
+            epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c.fd, NULL);
+        if (c.fd >= 0)
+            shutdown(c.fd, SHUT_RDWR); // 查询可能停在一半，先断开socket，mysql_close发送QUIT时就不会阻塞主线程
+        if (c.mysql)
+            mysql_close(c.mysql);
+        c.mysql = NULL;
+        c.fd = -1;
+        c.added = false;
+        c.stage = STAGE_BROKEN;
+        c.wait_ms = 0;
+        c.retry_at_ms = now_ms() + c.backoff_ms;
+        LOG_WARN("async mysql: connection to endpoint %d dropped, reconnect in %dms", c.endpoint, c.backoff_ms);
+        c.backoff_ms = c.backoff_ms * 2 > MAX_BACKOFF_MS ? MAX_BACKOFF_MS : c.backoff_ms * 2;
+    }
+
+    // 非阻塞地重连，连接过程和查询一样在主线程的epoll里推进
+    void reconnect(conn &c)
+    {
+        const endpoint &e = m_endpoints[c.endpoint];
+        c.stage = STAGE_CONNECT;
+        c.expire_ms = now_ms() + CONNECT_TIMEOUT_MS;
+        c.mysql = mysql_init(NULL);
+        if (!c.mysql)
+        {
+            drop(c);
+            return;
+        }
+        unsigned int timeout = CONNECT_TIMEOUT_MS / 1000;
+        mysql_options(c.mysql, MYSQL_OPT_NONBLOCK, 0);
+        mysql_options(c.mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+
+        MYSQL *ret;
+        int status = mysql_real_connect_start(&ret, c.mysql, e.host, e.user, e.passwd, e.db, e.port, NULL, 0);
+        c.fd = mysql_get_socket(c.mysql);
+        connect_step(c, status, ret);
+    }
+
+    // mysql_real_connect这一步的start/cont返回之后调用
+    void connect_step(conn &c, int status, MYSQL *ret)
+    {
+        if (status)
+        {
+            wait_for(c, status);
+            return;
+        }
+        if (!ret)
+        {
+            drop(c);
+            return;
+        }
+        c.fd = mysql_get_socket(c.mysql);
+        c.stage = STAGE_IDLE;
+        c.wait_ms = 0;
+        c.backoff_ms = MIN_BACKOFF_MS;
+        if (c.endpoint)
+            ++m_replica_conns;
+        LOG_INFO("async mysql: connection to endpoint %d reconnected", c.endpoint);
+    }
+
+    // 查询结束，交还结果；status为-1时broken表示连接也不能用了，要关掉重连
+    void finish(conn &c, int status, bool broken)
+    {
+        async_query *q = c.q;
+        c.q = NULL;
+        c.stage = STAGE_IDLE;
+        c.wait_ms = 0;
+        --m_busy[c.endpoint];
+        if (broken)
+            drop(c);
+        complete(q, c.endpoint, status);
+    }
+
+    // 交还查询结果；从库上没查到或者出错时放回队头，回主库再查
+    void complete(async_query *q, int endpoint, int status)
+    {
+        if (endpoint && status <= 0)
+        {
+            q->primary = true;
+            m_lock.lock();
+            q->next = m_head;
+            m_head = q;
+            if (!q->next)
+                m_tail = &q->next;
+            m_lock.unlock();
+            return;
+        }
+        q->status = status;
+        q->done(q);
+    }
+
+    // 在连接上开始一个查询，语句中的?替换成加了引号的转义后的参数
+    void start(conn &c, async_query *q)
+    {
+        c.q = q;
+        c.stage = STAGE_QUERY;
+        c.expire_ms = q->deadline_ms;
+        ++m_busy[c.endpoint];
+        q->value[0] = '\0';
+
+        char escaped[2 * sizeof(q->param) + 1];
+        char sql[2 * sizeof(q->param) + 256];
+        mysql_real_escape_string(c.mysql, escaped, q->param, strnlen(q->param, sizeof(q->param)));
+        const char *format = connection_pool::statement(q->stmt);
+        const char *mark = strchr(format, '?');
+        int len = mark ? snprintf(sql, sizeof(sql), "%.*s'%s'%s", (int)(mark - format), format, escaped, mark + 1)
+                       : snprintf(sql, sizeof(sql), "%s", format);
+        if (len >= (int)sizeof(sql))
+        {
+            finish(c, -1, false);
+            return;
+        }
+
+        int ret;
+        int status = mysql_real_query_start(&ret, c.mysql, sql, len);
+        step(c, status, ret);
+    }
+
+    // mysql_real_query这一步的start/cont返回之后调用，status为库要等待的事件，为0时ret是它的返回值
+    void step(conn &c, int status, int ret)
+    {
+        if (status)
+        {
+            wait_for(c, status);
+            return;
+        }
+        if (ret)
+        {
+            finish(c, -1, lost(c));
+            return;
+        }
+
+        c.stage = STAGE_STORE;
+        MYSQL_RES *res;
+        status = mysql_store_result_start(&res, c.mysql);
+        if (status)
+            wait_for(c, status);
+        else
+            finish_store(c, res);
+    }
+
+    // 结果集已经全部读到内存里，取第一行第一列
+    void finish_store(conn &c, MYSQL_RES *res)
+    {
+        if (!res)
+        {
+            bool failed = mysql_errno(c.mysql) != 0;
+            finish(c, failed ? -1 : 0, failed && lost(c));
+            return;
+        }
+        MYSQL_ROW row = mysql_fetch_row(res);
+        if (row)
+            snprintf(c.q->value, sizeof(c.q->value), "%s", row[0] ? row[0] : "");
+        mysql_free_result(res);
+        finish(c, row ? 1 : 0, false);
+    }
+
+    // 库等待的事件到了（或者等待超时了），status为发生的事件，接着执行当前这一步
+    void resume(conn &c, int status)
+    {
+        if (c.stage == STAGE_CONNECT)
+        {
+            MYSQL *ret;
+            status = mysql_real_connect_cont(&ret, c.mysql, status);
+            connect_step(c, status, ret);
+        }
+        else if (c.stage == STAGE_QUERY)
+        {
+            int ret;
+            status = mysql_real_query_cont(&ret, c.mysql, status);
+            step(c, status, ret);
+        }
+        else
+        {
+            MYSQL_RES *res;
+            status = mysql_store_result_cont(&res, c.mysql, status);
+            if (status)
+                wait_for(c, status);
+            else
+                finish_store(c, res);
+        }
+    }
+
+    // 给查询选一个空闲连接：primary为true或者没有能用的从库时选主库的连接，
+    // 否则选正在执行的查询最少的从库上的连接；没有合适的空闲连接返回NULL
+    conn *pick(bool primary)
+    {
+        bool use_primary = primary || !m_replica_conns;
+        conn *best = NULL;
+        for (int i = 0; i < m_conn_count; ++i)
+        {
+            conn &c = m_conns[i];
+            if (c.stage != STAGE_IDLE || (c.endpoint == 0) != use_primary)
+                continue;
+            if (!best || m_busy[c.endpoint] < m_busy[best->endpoint])
+                best = &c;
+        }
+        return best;
+    }
+
+    // 把等待队列里的查询按顺序分配给空闲连接，队头的查询没有合适的连接时就停下
+    void dispatch()
+    {
+        for (;;)
+        {
+            m_lock.lock();
+            async_query *q = m_head;
+            conn *c = q ? pick(q->primary) : NULL;
+            if (c)
+            {
+                m_head = q->next;
+                if (!m_head)
+                    m_tail = &m_head;
+            }
+            m_lock.unlock();
+            if (!c)
+                return;
+            start(*c, q);
+        }
+    }
+
+    // 阻塞地建立conn_count个非阻塞连接，属于第endpoint个库，记下连接参数供重连使用
+    bool connect(const char *url, const char *user, const char *passwd, const char *db, int port, int conn_count, int endpoint)
+    {
+        struct endpoint &e = m_endpoints[endpoint];
+        snprintf(e.host, sizeof(e.host), "%s", url);
+        snprintf(e.user, sizeof(e.user), "%s", user);
+        snprintf(e.passwd, sizeof(e.passwd), "%s", passwd);
+        snprintf(e.db, sizeof(e.db), "%s", db);
+        e.port = port;
+
+        for (int i = 0; i < conn_count && m_conn_count < MAX_CONN; ++i)
+        {
+            MYSQL *mysql = mysql_init(NULL);
+            if (!mysql)
+                return false;
+            mysql_options(mysql, MYSQL_OPT_NONBLOCK, 0);
+            if (!mysql_real_connect(mysql, url, user, passwd, db, port, NULL, 0)) // 启动时阻塞地建立连接
+            {
+                mysql_close(mysql);
+                return false;
+            }
+
+            conn &c = m_conns[m_conn_count++];
+            c.mysql = mysql;
+            c.fd = mysql_get_socket(mysql);
+            c.endpoint = endpoint;
+            c.stage = STAGE_IDLE;
+            c.added = false;
+            c.q = NULL;
+            c.expire_ms = 0;
+            c.wait_ms = 0;
+            c.retry_at_ms = 0;
+            c.backoff_ms = MIN_BACKOFF_MS;
+            if (endpoint)
+                ++m_replica_conns;
+        }
+        return true;
+    }
+
+public:
+    async_mysql() : m_conn_count(0), m_endpoint_count(1), m_replica_conns(0), m_epollfd(-1), m_eventfd(-1), m_head(NULL), m_tail(&m_head)
+    {
+        memset(m_busy, 0, sizeof(m_busy));
+    }
+
+    ~async_mysql()
+    {
+        for (int i = 0; i < m_conn_count; ++i)
+            if (m_conns[i].mysql)
+                mysql_close(m_conns[i].mysql);
+        if (m_eventfd >= 0)
+            close(m_eventfd);
+    }
+
+    // 和主库建立conn_count个非阻塞连接，并把通知用的eventfd注册到主线程的epollfd上
+    bool init(const char *url, const char *user, const char *passwd, const char *db, int port, int conn_count, int epollfd)
+    {
+        m_epollfd = epollfd;
+        if (!connect(url, user, passwd, db, port, conn_count, 0))
+            return false;
+
+        m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_eventfd < 0)
+            return false;
+        epoll_event event;
+        event.data.fd = m_eventfd;
+        event.events = EPOLLIN;
+        return epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_eventfd, &event) == 0;
+    }
+
+    // 加一个只读的从库，和它建立conn_count个非阻塞连接；在init之后、提交查询之前调用
+    bool add_replica(const char *url, const char *user, const char *passwd, const char *db, int port, int conn_count)
+    {
+        if (m_endpoint_count == MAX_ENDPOINTS)
+            return false;
+        return connect(url, user, passwd, db, port, conn_count, m_endpoint_count++);
+    }
+
+    // 提交一个查询，可以在任何线程中调用；完成后在主线程中调用q->done
+    void submit(async_query *q)
+    {
+        q->primary = false;
+        q->deadline_ms = now_ms() + QUERY_TIMEOUT_MS;
+        q->next = NULL;
+        m_lock.lock();
+        *m_tail = q;
+        m_tail = &q->next;
+        m_lock.unlock();
+
+        uint64_t one = 1;
+        if (write(m_eventfd, &one, sizeof(one)) != sizeof(one))
+            ; // 计数器溢出才会失败，主线程反正会被唤醒
+    }
+
+    // fd是不是这里的连接或者eventfd
+    bool owns(int fd)
+    {
+        if (fd == m_eventfd)
+            return true;
+        for (int i = 0; i < m_conn_count; ++i)
+            if (m_conns[i].fd == fd)
+                return true;
+        return false;
+    }
+
+    // 主线程在owns(fd)的fd上收到事件时调用
+    void handle(int fd, uint32_t events)
+    {
+        if (fd == m_eventfd)
+        {
+            uint64_t n;
+            if (read(m_eventfd, &n, sizeof(n)) != sizeof(n))
+                ;
+            dispatch();
+            return;
+        }
+
+        for (int i = 0; i < m_conn_count; ++i)
+        {
+            conn &c = m_conns[i];
+            if (c.fd != fd || c.stage == STAGE_IDLE)
+                continue;
+
+            int status = 0;
+            if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) // 出错时也按可读交给库，由库返回错误
+                status |= MYSQL_WAIT_READ;
+            if (events & EPOLLOUT)
+                status |= MYSQL_WAIT_WRITE;
+            if (events & EPOLLPRI)
+                status |= MYSQL_WAIT_EXCEPT;
+            resume(c, status);
+            break;
+        }
+        dispatch(); // 连接空出来了，接着执行排队的查询
+    }
+
+    // 主线程的定时器每个TIMESLOT调用一次：重连断开的连接，结束超时的查询和重连
+    void tick()
+    {
+        long long now = now_ms();
+        for (int i = 0; i < m_conn_count; ++i)
+        {
+            conn &c = m_conns[i];
+            if (c.stage == STAGE_BROKEN)
+            {
+                if (now >= c.retry_at_ms)
+                    reconnect(c);
+            }
+            else if (c.stage == STAGE_IDLE)
+                continue;
+            else if (now >= c.expire_ms) // 连接停在一半，状态不明，只能关掉重连
+            {
+                LOG_WARN("async mysql: %s on endpoint %d timed out", c.q ? "query" : "connect", c.endpoint);
+                if (c.q)
+                    finish(c, -1, true);
+                else
+                    drop(c);
+            }
+            else if (c.wait_ms && now >= c.wait_ms) // 库要求的等待超时到了，由库返回超时错误
+                resume(c, MYSQL_WAIT_TIMEOUT);
+        }
+
+        // 排队太久的查询（比如主库的连接都断了）按出错结束
+        async_query *expired = NULL;
+        m_lock.lock();
+        async_query **p = &m_head;
+        while (*p)
+        {
+            async_query *q = *p;
+            if (now >= q->deadline_ms)
+            {
+                *p = q->next;
+                q->next = expired;
+                expired = q;
+            }
+            else
+                p = &q->next;
+        }
+        m_tail = p;
+        m_lock.unlock();
+        while (expired)
+        {
+            async_query *q = expired;
+            expired = q->next;
+            q->status = -1;
+            q->done(q);
+        }
+
+        dispatch();
+    }
+};
+
+#else
+
+// 客户端库没有非阻塞接口，init()返回false，调用者使用阻塞查询
+class async_mysql
+{
+public:
+    bool init(const char *, const char *, const char *, const char *, int, int, int)
+    {
+        return false;
+    }
+    bool add_replica(const char *, const char *, const char *, const char *, int, int)
+    {
+        return false;
+    }
+    void submit(async_query *)
+    {
+    }
+    bool owns(int)
+    {
+        return false;
+    }
+    void handle(int, uint32_t)
+    {
+    }
+    void tick()
+    {
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef DB_ROUTER_H
+#define DB_ROUTER_H
+
+#include <atomic>
+#include <time.h>
+#include <mysql/mysql.h>
+#include "sql_connection_pool.h"
+#include "../lock/thread_id.h"
+#include "../lock/clock.h"
+
+/****************************************************************************************/
+/* 主从路由：读语句分给从库，写语句直接用主库的连接池，每个库一个connection_pool              */
+/*   读的时候选未完成请求数最少的从库（从取连接开始到归还为止都算未完成），                        */
+/*   慢的或者连接不够的从库积压的请求多，新请求自然流向其他从库，加从库就能加读的容量              */
+/*   未完成请求数相同时从本线程编号对应的从库开始比较，不同线程不会一起挤到第一个从库上            */
+/*   从库取不到连接或者执行出错时标记为故障，DOWN_MS毫秒内不再选它；所有从库都故障时读主库         */
+/*   没有从库时读写都走主库                                                                     */
+/* 从库的数据可能比主库旧，要读到刚写入的数据的调用者自己回主库再查（见mysql_store.h）            */
+/****************************************************************************************/
+
+class db_router
+{
+public:
+    static const int MAX_REPLICAS = 16;
+
+private:
+    static const int DOWN_MS = 1000; // 从库出错后多久之内不再选它
+
+    // 一个数据库，计数器独占cache line，不同库之间不伪共享
+    struct alignas(64) endpoint
+    {
+        connection_pool *pool;
+        bool replica;
+        std::atomic<int> outstanding;          // 未完成的请求数
+        std::atomic<long long> reads;          // 读请求数，统计用
+        std::atomic<long long> down_until_us;  // 这个时间之前不选这个从库
+    };
+
+    endpoint m_primary;
+    endpoint m_replicas[MAX_REPLICAS];
+    int m_replica_count;
+
+    static void reset(endpoint &e, connection_pool *pool, bool replica)
+    {
+        e.pool = pool;
+        e.replica = replica;
+        e.outstanding.store(0, std::memory_order_relaxed);
+        e.reads.store(0, std::memory_order_relaxed);
+        e.down_until_us.store(0, std::memory_order_relaxed);
+    }
+
+    // 选一个读的库：没有故障的从库里未完成请求数最少的，都不能用时选主库
+    endpoint *pick_read()
+    {
+        if (!m_replica_count)
+            return &m_primary;
+
+        long long now = now_us(CLOCK_MONOTONIC_COARSE);
+        endpoint *best = NULL;
+        int best_load = 0;
+        int start = thread_id::get() % m_replica_count;
+        for (int i = 0; i < m_replica_count; ++i)
+        {
+            endpoint *e = &m_replicas[(start + i) % m_replica_count];
+            if (e->down_until_us.load(std::memory_order_relaxed) > now)
+                continue;
+            int load = e->outstanding.load(std::memory_order_relaxed);
+            if (!best || load < best_load)
+            {
+                best = e;
+                best_load = load;
+            }
+        }
+        return best ? best : &m_primary;
+    }
+
+public:
+    // 一次路由的结果：构造时选库并取连接，析构时归还连接，期间算作这个库的未完成请求
+    class lease
+    {
+    public:
+        // primary为true时用主库，比如从库上的结果可能太旧的时候
+        lease(db_router &router, bool primary) : m_endpoint(primary ? &router.m_primary : router.pick_read())
+        {
+            m_endpoint->outstanding.fetch_add(1, std::memory_order_relaxed);
+            m_endpoint->reads.fetch_add(1, std::memory_order_relaxed);
+            mysql = m_endpoint->pool->GetConnection();
+            if (!mysql)
+                fail();
+        }
+
+        ~lease()
+        {
+            if (mysql)
+                m_endpoint->pool->ReleaseConnection(mysql);
+            m_endpoint->outstanding.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        connection_pool *pool()
+        {
+            return m_endpoint->pool;
+        }
+
+        bool replica()
+        {
+            return m_endpoint->replica;
+        }
+
+        // 在这个库上出错了，是从库的话一段时间内不再选它
+        void fail()
+        {
+            if (m_endpoint->replica)
+                m_endpoint->down_until_us.store(now_us(CLOCK_MONOTONIC_COARSE) + DOWN_MS * 1000LL, std::memory_order_relaxed);
+        }
+
+        MYSQL *mysql; // 取不到连接时为NULL
+
+    private:
+        endpoint *m_endpoint;
+    };
+
+    db_router() : m_replica_count(0)
+    {
+        reset(m_primary, NULL, false);
+    }
+
+    // 在使用之前调用，设置主库的连接池，从库用add_replica逐个加入
+    void init(connection_pool *primary)
+    {
+        reset(m_primary, primary, false);
+    }
+
+    bool add_replica(connection_pool *pool)
+    {
+        if (m_replica_count == MAX_REPLICAS)
+            return false;
+        reset(m_replicas[m_replica_count++], pool, true);
+        return true;
+    }
+
+    int replica_count()
+    {
+        return m_replica_count;
+    }
+
+    // 读取并清零主库的读请求数和每个从库的读请求数，返回从库个数
+    int get_read_stats(long long &primary_reads, long long *replica_reads)
+    {
+        primary_reads = m_primary.reads.exchange(0, std::memory_order_relaxed);
+        for (int i = 0; i < m_replica_count; ++i)
+            replica_reads[i] = m_replicas[i].reads.exchange(0, std::memory_order_relaxed);
+        return m_replica_count;
+    }
+};
+
+#endif
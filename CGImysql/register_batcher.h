@@ -0,0 +1,227 @@
+#ifndef REGISTER_BATCHER_H
+#define REGISTER_BATCHER_H
+
+#include <string>
+#include <atomic>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <mysql/mysql.h>
+#include "sql_connection_pool.h"
+#include "../lock/locker.h"
+
+/****************************************************************************************/
+/* 注册请求的批量提交                                                                      */
+/*   处理请求的线程把要插入的用户交给submit()后等待结果，后台的提交线程把攒下的注册合并成        */
+/*   多行INSERT，在一个事务里提交，一批只付一次提交的往返和刷盘，注册的吞吐量随并发数增长         */
+/*   提交线程空闲时第一条注册最多再等m_window_ms毫秒，攒够MAX_BATCH条立即提交，                  */
+/*   提交期间到达的注册自然地攒成下一批，注册的等待时间不超过窗口期加上两批的提交时间              */
+/*   整批失败时（比如某个用户名在数据库里已经有了）回滚，再逐条插入，每个请求拿到自己的结果        */
+/****************************************************************************************/
+
+class register_batcher
+{
+private:
+    static const int MAX_BATCH = 256;      // 一批最多提交多少条注册
+    static const int ROWS_PER_INSERT = 64; // 一条INSERT最多插入多少行
+
+    // 一个等待提交的注册，放在等待它的线程的栈上
+    struct request
+    {
+        const char *name;
+        const char *passwd;
+        int result; // 0表示成功，否则为mysql错误码，-1表示拿不到连接
+        sem done;   // 提交完成后由提交线程post
+        request *next;
+    };
+
+    locker m_lock;       // 保护等待队列
+    cond m_cond;         // 有新的注册或者攒够一批时通知提交线程
+    request *m_head;     // 等待队列，先进先出
+    request **m_tail;
+    int m_pending;       // 等待队列的长度
+    connection_pool *m_pool;
+    int m_window_ms;     // 攒批的最长等待时间
+    pthread_t m_thread;  // 提交线程
+    bool m_started;
+    bool m_stop;         // 析构时通知提交线程提交完剩下的注册后退出
+    std::atomic<long long> m_batches;    // 提交了多少批
+    std::atomic<long long> m_registered; // 成功写入了多少个用户
+
+    static void *worker(void *arg)
+    {
+        ((register_batcher *)arg)->run();
+        return NULL;
+    }
+
+    // 提交线程：空闲时等到第一条注册后再等一个窗口期或者攒够一批，然后整批提交
+    // 上一批提交完时队列里已经有注册了，说明负载高，不再等窗口期，直接提交
+    void run()
+    {
+        request *batch[MAX_BATCH];
+        for (;;)
+        {
+            m_lock.lock();
+            bool idle = !m_head;
+            while (!m_head && !m_stop)
+                m_cond.wait(m_lock.get());
+            if (!m_head) // 要退出了，并且已经没有等待提交的注册
+            {
+                m_lock.unlock();
+                return;
+            }
+
+            if (idle)
+            {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += (long)m_window_ms * 1000000;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000;
+                deadline.tv_nsec %= 1000000000;
+                while (m_pending < MAX_BATCH && m_cond.timewait(m_lock.get(), deadline))
+                    ;
+            }
+
+            int n = 0;
+            while (m_head && n < MAX_BATCH)
+            {
+                batch[n++] = m_head;
+                m_head = m_head->next;
+                --m_pending;
+            }
+            if (!m_head)
+                m_tail = &m_head;
+            m_lock.unlock();
+
+            commit(batch, n);
+            for (int i = 0; i < n; ++i) // post之后request就可能已经出栈了，不能再访问
+                batch[i]->done.post();
+        }
+    }
+
+    // 把一批注册写入数据库，结果写到每个request的result中
+    void commit(request **batch, int n)
+    {
+        MYSQL *mysql = NULL;
+        connectionRAII mysqlcon(&mysql, m_pool);
+        if (!mysql)
+        {
+            for (int i = 0; i < n; ++i)
+                batch[i]->result = -1;
+            return;
+        }
+
+        m_batches.fetch_add(1, std::memory_order_relaxed);
+        if (insert_rows(mysql, batch, n))
+        {
+            for (int i = 0; i < n; ++i)
+                batch[i]->result = 0;
+            m_registered.fetch_add(n, std::memory_order_relaxed);
+            return;
+        }
+
+        // 整批失败，逐条插入找出是哪几条出的错
+        for (int i = 0; i < n; ++i)
+        {
+            const char *params[] = {batch[i]->name, batch[i]->passwd};
+            batch[i]->result = m_pool->Execute(mysql, STMT_INSERT_USER, params);
+            if (!batch[i]->result)
+                m_registered.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // 用多行INSERT在一个事务里插入整批，失败时回滚并返回false
+    bool insert_rows(MYSQL *mysql, request **batch, int n)
+    {
+        bool transaction = n > ROWS_PER_INSERT; // 只有一条INSERT时它本身就是一个事务
+        if (transaction && mysql_autocommit(mysql, 0))
+            return false;
+
+        bool ok = true;
+        std::string sql;
+        char escaped[2 * 256 + 1];
+        for (int begin = 0; ok && begin < n; begin += ROWS_PER_INSERT)
+        {
+            sql = "INSERT INTO user(username, passwd) VALUES";
+            int end = begin + ROWS_PER_INSERT < n ? begin + ROWS_PER_INSERT : n;
+            for (int i = begin; i < end; ++i)
+            {
+                sql += i == begin ? "('" : ",('";
+                size_t len = strlen(batch[i]->name);
+                sql.append(escaped, mysql_real_escape_string(mysql, escaped, batch[i]->name, len < 256 ? len : 255));
+                sql += "','";
+                len = strlen(batch[i]->passwd);
+                sql.append(escaped, mysql_real_escape_string(mysql, escaped, batch[i]->passwd, len < 256 ? len : 255));
+                sql += "')";
+            }
+            ok = mysql_real_query(mysql, sql.c_str(), sql.size()) == 0;
+        }
+
+        if (transaction)
+        {
+            if (ok)
+                ok = mysql_commit(mysql) == 0;
+            if (!ok)
+                mysql_rollback(mysql);
+            mysql_autocommit(mysql, 1);
+        }
+        return ok;
+    }
+
+public:
+    register_batcher() : m_head(NULL), m_tail(&m_head), m_pending(0), m_pool(NULL), m_window_ms(0),
+                         m_started(false), m_stop(false), m_batches(0), m_registered(0)
+    {
+    }
+
+    // 等提交线程把剩下的注册提交完再退出，否则销毁m_cond时会一直等它
+    ~register_batcher()
+    {
+        if (!m_started)
+            return;
+        m_lock.lock();
+        m_stop = true;
+        m_cond.signal();
+        m_lock.unlock();
+        pthread_join(m_thread, NULL);
+    }
+
+    // 启动提交线程，window_ms为攒批的最长等待时间
+    bool start(connection_pool *pool, int window_ms)
+    {
+        m_pool = pool;
+        m_window_ms = window_ms;
+        m_started = pthread_create(&m_thread, NULL, worker, this) == 0;
+        return m_started;
+    }
+
+    // 提交一个注册并等待写入数据库，返回0表示成功，否则为mysql错误码，-1表示拿不到连接
+    int submit(const char *name, const char *passwd)
+    {
+        request req;
+        req.name = name;
+        req.passwd = passwd;
+        req.result = -1;
+        req.next = NULL;
+
+        m_lock.lock();
+        *m_tail = &req;
+        m_tail = &req.next;
+        if (++m_pending == 1 || m_pending == MAX_BATCH) // 队列从空变为非空，或者攒够了一批
+            m_cond.signal();
+        m_lock.unlock();
+
+        while (!req.done.wait()) // 被信号打断时继续等，req在栈上，提交线程还会访问它
+            ;
+        return req.result;
+    }
+
+    // 读取并清零提交的批数和写入的用户数
+    void get_stats(long long &batches, long long &registered)
+    {
+        batches = m_batches.exchange(0, std::memory_order_relaxed);
+        registered = m_registered.exchange(0, std::memory_order_relaxed);
+    }
+};
+
+#endif
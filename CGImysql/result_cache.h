@@ -0,0 +1,184 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../lock/locker.h"
+#include "../lock/clock.h"
+
+/****************************************************************************************/
+/* 按键缓存查询结果的小缓存，带过期时间，挡住对同一个键的重复查询                              */
+/*   查到了和没查到都缓存：没查到的结果用更短的过期时间，不存在的用户名反复登录也不会每次都查库     */
+/*   容量固定，按哈希值的高位分成若干个分片，每个分片一把锁，分片内是4路组相联的数组，              */
+/*   一组满了替换最早过期的那一项，init之后不再分配内存                                         */
+/*   键或值太长的结果不缓存                                                                    */
+/* 写入数据库之后调用者要用put或erase更新对应的键，缓存里的结果最多比数据库旧一个过期时间          */
+/****************************************************************************************/
+
+class result_cache
+{
+private:
+    static const int SHARD_BITS = 4;
+    static const int SHARDS = 1 << SHARD_BITS;
+    static const int WAYS = 4;
+    static const size_t KEY_LEN = 64;   // 键的最大长度（含'\0'）
+    static const size_t VALUE_LEN = 64; // 值的最大长度（含'\0'）
+
+    struct entry
+    {
+        uint64_t hash;
+        long long expires_us; // 0表示空
+        int status;           // 1表示查到了，0表示没有
+        char key[KEY_LEN];
+        char value[VALUE_LEN];
+    };
+
+    struct alignas(64) shard
+    {
+        locker lock;
+        entry *entries; // 组数*WAYS项
+    };
+
+    shard m_shards[SHARDS];
+    size_t m_set_mask;     // 每个分片的组数-1，组数是2的幂
+    int m_ttl_ms;          // 查到的结果缓存多久
+    int m_negative_ttl_ms; // 没查到的结果缓存多久
+    std::atomic<long long> m_hits;
+    std::atomic<long long> m_misses;
+
+    static uint64_t hash_of(const char *key)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (; *key; ++key)
+        {
+            h ^= (unsigned char)*key;
+            h *= 1099511628211ULL;
+        }
+        h ^= h >> 29;
+        return h;
+    }
+
+    shard &shard_of(uint64_t hash)
+    {
+        return m_shards[hash >> (64 - SHARD_BITS)];
+    }
+
+    entry *set_of(shard &s, uint64_t hash)
+    {
+        return s.entries + (hash & m_set_mask) * WAYS;
+    }
+
+    // 在一组里找键，调用者持有分片的锁
+    static entry *find(entry *set, uint64_t hash, const char *key)
+    {
+        for (int i = 0; i < WAYS; ++i)
+            if (set[i].expires_us && set[i].hash == hash && strcmp(set[i].key, key) == 0)
+                return &set[i];
+        return NULL;
+    }
+
+public:
+    result_cache() : m_set_mask(0), m_ttl_ms(0), m_negative_ttl_ms(0), m_hits(0), m_misses(0)
+    {
+        for (int i = 0; i < SHARDS; ++i)
+            m_shards[i].entries = NULL;
+    }
+
+    ~result_cache()
+    {
+        for (int i = 0; i < SHARDS; ++i)
+            delete[] m_shards[i].entries;
+    }
+
+    // 最多缓存capacity个结果，为0时不缓存；在使用之前调用一次
+    void init(size_t capacity, int ttl_ms, int negative_ttl_ms)
+    {
+        m_ttl_ms = ttl_ms;
+        m_negative_ttl_ms = negative_ttl_ms;
+        if (!capacity)
+            return;
+
+        size_t sets = 1;
+        while (sets * WAYS * SHARDS < capacity)
+            sets <<= 1;
+        m_set_mask = sets - 1;
+        for (int i = 0; i < SHARDS; ++i)
+            m_shards[i].entries = new entry[sets * WAYS]();
+    }
+
+    // 返回缓存的结果：1表示查到了，值复制到value，0表示没有这个键；-1表示缓存里没有或者已经过期
+    int get(const char *key, char *value, size_t len)
+    {
+        if (!m_shards[0].entries)
+            return -1;
+        uint64_t hash = hash_of(key);
+        shard &s = shard_of(hash);
+
+        int status = -1;
+        s.lock.lock();
+        entry *e = find(set_of(s, hash), hash, key);
+        if (e && e->expires_us > now_us(CLOCK_MONOTONIC_COARSE))
+        {
+            status = e->status;
+            if (status > 0)
+                snprintf(value, len, "%s", e->value);
+        }
+        s.lock.unlock();
+
+        (status < 0 ? m_misses : m_hits).fetch_add(1, std::memory_order_relaxed);
+        return status;
+    }
+
+    // 缓存一个查询结果，status为1表示查到了，值为value，0表示没有
+    void put(const char *key, int status, const char *value)
+    {
+        if (!m_shards[0].entries || strlen(key) >= KEY_LEN || (status > 0 && strlen(value) >= VALUE_LEN))
+            return;
+        uint64_t hash = hash_of(key);
+        shard &s = shard_of(hash);
+        long long now = now_us(CLOCK_MONOTONIC_COARSE);
+
+        s.lock.lock();
+        entry *set = set_of(s, hash);
+        entry *e = find(set, hash, key);
+        if (!e) // 没有这个键时换掉最早过期的一项，空的和已经过期的最先换
+        {
+            e = &set[0];
+            for (int i = 1; i < WAYS; ++i)
+                if (set[i].expires_us < e->expires_us)
+                    e = &set[i];
+        }
+        e->hash = hash;
+        e->status = status > 0;
+        e->expires_us = now + (long long)(status > 0 ? m_ttl_ms : m_negative_ttl_ms) * 1000;
+        strcpy(e->key, key);
+        strcpy(e->value, status > 0 ? value : "");
+        s.lock.unlock();
+    }
+
+    void erase(const char *key)
+    {
+        if (!m_shards[0].entries)
+            return;
+        uint64_t hash = hash_of(key);
+        shard &s = shard_of(hash);
+
+        s.lock.lock();
+        entry *e = find(set_of(s, hash), hash, key);
+        if (e)
+            e->expires_us = 0;
+        s.lock.unlock();
+    }
+
+    // 读取并清零命中和没命中的次数
+    void get_stats(long long &hits, long long &misses)
+    {
+        hits = m_hits.exchange(0, std::memory_order_relaxed);
+        misses = m_misses.exchange(0, std::memory_order_relaxed);
+    }
+};
+
+#endif
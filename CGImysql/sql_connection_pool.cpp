@@ -6,15 +6,74 @@
 #include <list>
 #include <pthread.h>
 #include <iostream>
+#include <time.h>
+#include <type_traits>
+#include <algorithm>
 #include "sql_connection_pool.h"
+#include "../log/log.h"
+#include "../lock/clock.h"
 
 using namespace std;
 
 // 构造函数
 connection_pool::connection_pool()
 {
-	this->CurConn = 0;	// 当前已使用的连接数
-	this->FreeConn = 0; // 当前空闲的连接数
+	this->MaxConn = 0;
+	this->MinConn = 0;
+	m_wait_timeout_ms = 0;
+	m_retry_at_us = 0;
+	m_slots = NULL;
+	for (int i = 0; i < thread_id::MAX_THREADS; ++i)
+		m_cache[i].slot = NULL;
+	m_free_head = 0;
+	m_closed_count = 0;
+	m_waiters = 0;
+	m_maintaining = false;
+	m_stop = false;
+	m_waits = 0;
+	m_wait_us = 0;
+	m_max_wait_us = 0;
+	m_timeouts = 0;
+	m_created = 0;
+	m_closed = 0;
+	m_reconnects = 0;
+	m_connect_failures = 0;
+}
+
+// 每个预处理语句的SQL，下标是STATEMENT
+static const char *statement_sql[STMT_COUNT] = {
+	"SELECT passwd FROM user WHERE username=? LIMIT 1",
+	"INSERT INTO user(username, passwd) VALUES(?, ?)",
+	"SELECT username,passwd FROM user WHERE username > ? ORDER BY username LIMIT 1000",
+};
+
+// 语句执行到一半连接断了时能不能重做：只读的语句可以，写入的语句可能已经执行过了
+static const bool statement_retryable[STMT_COUNT] = {true, false, true};
+
+// 语句id的SQL
+const char *connection_pool::statement(STATEMENT id)
+{
+	return statement_sql[id];
+}
+
+static const unsigned int ERR_UNKNOWN_STMT = 1243;   // ER_UNKNOWN_STMT_HANDLER：服务器端的语句已经不存在了
+static const unsigned int ERR_NEED_REPREPARE = 1615; // ER_NEED_REPREPARE：表结构变了，语句需要重新预处理
+static const unsigned int ERR_SERVER_GONE = 2006;	 // CR_SERVER_GONE_ERROR：连接已经断了，语句没有发出去
+static const unsigned int ERR_SERVER_LOST = 2013;	 // CR_SERVER_LOST：执行过程中连接断了
+
+// MySQL 8.0中MYSQL_BIND::is_null是bool*，更早的版本和MariaDB是my_bool*
+typedef std::remove_pointer<decltype(((MYSQL_BIND *)0)->is_null)>::type sql_bool;
+
+// pthread_cond_timedwait用的绝对时间
+static struct timespec deadline_after_ms(long long ms)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_sec += ms / 1000;
+	t.tv_nsec += (ms % 1000) * 1000000;
+	t.tv_sec += t.tv_nsec / 1000000000;
+	t.tv_nsec %= 1000000000;
+	return t;
 }
 
 // 单例模式，获取数据库连接池对象
@@ -28,115 +87,629 @@ connection_pool *connection_pool::GetInstance()
 }
 
 // 构造初始化
-void connection_pool::init(string url, string User, string PassWord, string DBName, int Port, unsigned int MaxConn)
+void connection_pool::init(string url, string User, string PassWord, string DBName, int Port, unsigned int MaxConn, unsigned int MinConn, int WaitTimeoutMs)
 {
 	this->url = url;
-	this->Port = Port;
+	this->Port = to_string(Port);
 	this->User = User;
 	this->PassWord = PassWord;
 	this->DatabaseName = DBName;
+	this->MaxConn = MaxConn;
+	this->MinConn = MinConn < MaxConn ? MinConn : MaxConn;
+	m_wait_timeout_ms = WaitTimeoutMs;
 
-	lock.lock(); // 加锁。这里我觉得没必要加锁，因为这时候没有客户连接不是吗？但加了也无关紧要就是
+	// 槽位一次分配好，开始时都没有连接
+	m_slots = new conn_slot[MaxConn];
+	for (int i = MaxConn - 1; i >= 0; --i)
+	{
+		memset(m_slots[i].stmt, 0, sizeof(m_slots[i].stmt));
+		m_slots[i].broken = false;
+		m_slots[i].in_use = false;
+		m_slots[i].next_free = 0;
+		m_closed_slots.push_back(i);
+	}
+	m_closed_count = MaxConn;
 
-	for (int i = 0; i < MaxConn; i++)
+	// 先建立MinConn个连接，数据库暂时连不上时不退出，维护线程会继续补足，请求到来时也会按需新建
+	maintain();
+	if (MaxConn - m_closed_count < this->MinConn)
+		LOG_ERROR("mysql pool: only %d of %u connections opened", (int)(MaxConn - m_closed_count), this->MinConn);
+
+	m_maintaining = pthread_create(&m_maintainer, NULL, maintainer, this) == 0;
+}
+
+// 在槽位上新建一个连接，失败时槽位仍然没有连接
+// MYSQL结构在槽位里，mysql_close不会释放它，重连时可以在原地重新初始化，地址不变
+bool connection_pool::connect(conn_slot *s)
+{
+	MYSQL *con = &s->mysql;
+	if (!mysql_init(con))
 	{
-		MYSQL *con = NULL;	   // 指向一个数据库连接的指针
-		con = mysql_init(con); // 初始化数据库连接
+		m_connect_failures.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	unsigned int connect_timeout = CONNECT_TIMEOUT_S, io_timeout = IO_TIMEOUT_S;
+	mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &connect_timeout);
+	mysql_options(con, MYSQL_OPT_READ_TIMEOUT, &io_timeout);
+	mysql_options(con, MYSQL_OPT_WRITE_TIMEOUT, &io_timeout);
 
-		if (con == NULL) // 初始化失败
+	if (!mysql_real_connect(con, url.c_str(), User.c_str(), PassWord.c_str(), DatabaseName.c_str(), atoi(Port.c_str()), NULL, 0))
+	{
+		LOG_ERROR("mysql connect failed: %s", mysql_error(con));
+		mysql_close(con);
+		m_connect_failures.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	memset(s->stmt, 0, sizeof(s->stmt));
+	s->checked_us = now_us();
+	s->idle_since_us.store(s->checked_us, std::memory_order_relaxed);
+	s->broken = false;
+	m_created.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+// 关闭连接上的预处理语句，再在原来的MYSQL结构上重新建立连接，语句之后用到时重新预处理
+bool connection_pool::reconnect(conn_slot *s)
+{
+	for (int i = 0; i < STMT_COUNT; ++i)
+		if (s->stmt[i])
 		{
-			cout << "Error:" << mysql_error(con); // mysql_error()用于返回上一个函数调用的错误代码
-			exit(1);							  // 退出程序
+			mysql_stmt_close(s->stmt[i]);
+			s->stmt[i] = NULL;
 		}
-		con = mysql_real_connect(con, url.c_str(), User.c_str(), PassWord.c_str(), DBName.c_str(), Port, NULL, 0); // 连接数据库
+	mysql_close(&s->mysql);
 
-		if (con == NULL) // 连接失败
+	if (connect(s))
+	{
+		m_created.fetch_sub(1, std::memory_order_relaxed); // 算作重连，不算新建
+		m_reconnects.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+	s->broken = true; // 已经关闭了，不是一个可用的连接，归还时释放槽位
+	return false;
+}
+
+// 关闭槽位上的预处理语句和连接，把槽位放回没有连接的列表
+void connection_pool::close_slot(conn_slot *s)
+{
+	for (int i = 0; i < STMT_COUNT; ++i) // 先关闭这个连接上的预处理语句
+		if (s->stmt[i])
 		{
-			cout << "Error: " << mysql_error(con); // mysql_error()用于返回上一个函数调用的错误代码
-			exit(1);							   // 退出程序
+			mysql_stmt_close(s->stmt[i]);
+			s->stmt[i] = NULL;
 		}
-		connList.push_back(con); // 将创建好的数据库连接放入list容器中
-		++FreeConn;				 // 空闲连接数+1
+	if (!s->broken) // 重连失败的连接已经关闭过了
+		mysql_close(&s->mysql);
+	s->broken = false;
+	s->in_use.store(false, std::memory_order_relaxed);
+
+	lock.lock();
+	m_closed_slots.push_back(s - m_slots);
+	m_closed_count.fetch_add(1);
+	lock.unlock();
+}
+
+// 放到全局空闲栈上，每次修改栈顶都把版本号加一，
+// 这样即使栈顶的槽位被别的线程取走又放回来，拿着旧栈顶的CAS也会失败
+void connection_pool::push_free(conn_slot *s)
+{
+	unsigned long long index = s - m_slots + 1;
+	unsigned long long head = m_free_head.load(std::memory_order_relaxed);
+	do
+	{
+		s->next_free.store((unsigned int)head, std::memory_order_relaxed);
+	} while (!m_free_head.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | index));
+}
+
+// 从全局空闲栈上取一个，槽位从不释放，读到被别的线程取走的槽位的next_free也是安全的
+connection_pool::conn_slot *connection_pool::pop_free()
+{
+	unsigned long long head = m_free_head.load(std::memory_order_acquire);
+	for (;;)
+	{
+		unsigned int index = (unsigned int)head;
+		if (!index)
+			return NULL;
+		conn_slot *s = &m_slots[index - 1];
+		unsigned long long next = ((head >> 32) + 1) << 32 | s->next_free.load(std::memory_order_relaxed);
+		if (m_free_head.compare_exchange_weak(head, next))
+			return s;
 	}
+}
 
-	reserve = sem(FreeConn);  // 初始化信号量为可用连接个数
-	this->MaxConn = FreeConn; // 初始化最大连接个数
+// 连接数没到上限时新建一个连接，建立连接时不持有锁
+connection_pool::conn_slot *connection_pool::open_slot()
+{
+	if (!m_closed_count.load(std::memory_order_relaxed)) // 到上限了，不用加锁
+		return NULL;
 
-	lock.unlock(); // 解锁
+	lock.lock();
+	if (m_closed_slots.empty() || now_us() < m_retry_at_us)
+	{
+		lock.unlock();
+		return NULL;
+	}
+	conn_slot *s = &m_slots[m_closed_slots.back()];
+	m_closed_slots.pop_back();
+	m_closed_count.fetch_sub(1);
+	lock.unlock();
+
+	if (connect(s))
+		return s;
+
+	// 数据库连不上，一段时间内不再按需新建，免得每个请求都卡在建立连接上
+	lock.lock();
+	m_closed_slots.push_back(s - m_slots);
+	m_closed_count.fetch_add(1);
+	m_retry_at_us = now_us() + CONNECT_BACKOFF_MS * 1000LL;
+	lock.unlock();
+	return NULL;
 }
 
-// 当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数
-MYSQL *connection_pool::GetConnection()
+// 从其他线程的缓存里取一个，从自己后面的线程开始找，分散各线程偷的位置
+connection_pool::conn_slot *connection_pool::steal()
 {
-	MYSQL *con = NULL; // 指向一个数据库连接的指针
+	int self = thread_id::get();
+	int n = thread_id::limit();
+	for (int k = 1; k <= n; ++k)
+	{
+		thread_cache &c = m_cache[(self + k) % n];
+		if (c.slot.load(std::memory_order_relaxed))
+		{
+			conn_slot *s = c.slot.exchange(NULL, std::memory_order_acquire);
+			if (s)
+				return s;
+		}
+	}
+	return NULL;
+}
 
-	if (0 == connList.size()) // 连接池中没有连接（这个或许加锁更好？）
-		return NULL;		  // 返回空指针
+// 有线程在等连接时唤醒一个，在锁里signal，保证等待的线程检查完空闲栈之后不会错过
+void connection_pool::notify()
+{
+	if (m_waiters.load() > 0)
+	{
+		lock.lock();
+		m_released.signal();
+		lock.unlock();
+	}
+}
 
-	// 如果信号量的值为0，就阻塞等待，直到信号量的值大于0
-	// 如果信号量的值大于0，就将信号量的值减1，然后立即返回
-	reserve.wait();
+// 自己的缓存和空闲栈都没有连接时：没到上限就新建，否则从其他线程的缓存里偷一个，
+// 还是没有就等别的线程归还，最多等m_wait_timeout_ms
+// 等待前先登记m_waiters再检查一遍空闲栈，归还的线程先放回空闲栈再看m_waiters，两边至少有一边能看到对方
+connection_pool::conn_slot *connection_pool::wait_slot()
+{
+	conn_slot *s = NULL;
+	long long start = 0; // 开始等待的时间，0表示没有等过
+	struct timespec deadline;
 
-	lock.lock(); // 访问数据库连接时要先拿到互斥锁
+	for (;;)
+	{
+		if ((s = pop_free()) || (s = open_slot()) || (s = steal()))
+			break;
 
-	con = connList.front(); // 取出一个连接
-	connList.pop_front();	// list容器中删除一个连接
+		if (!start)
+		{
+			start = now_us();
+			deadline = deadline_after_ms(m_wait_timeout_ms);
+		}
 
-	--FreeConn; // 空闲连接数-1
-	++CurConn;	// 当前使用连接数+1
+		bool timeout = false;
+		lock.lock();
+		m_waiters.fetch_add(1);
+		if (!(s = pop_free()) && !(s = steal()))
+			timeout = !m_released.timewait(lock.get(), deadline) && now_us() - start >= (long long)m_wait_timeout_ms * 1000;
+		m_waiters.fetch_sub(1);
+		lock.unlock();
+
+		if (s)
+			break;
+		if (timeout)
+		{
+			m_timeouts.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+	}
 
-	lock.unlock(); // 解锁
+	// 记录等了多久
+	if (start)
+	{
+		long long wait = now_us() - start;
+		m_waits.fetch_add(1, std::memory_order_relaxed);
+		m_wait_us.fetch_add(wait, std::memory_order_relaxed);
+		long long max_wait = m_max_wait_us.load(std::memory_order_relaxed);
+		while (wait > max_wait && !m_max_wait_us.compare_exchange_weak(max_wait, wait, std::memory_order_relaxed))
+			;
+	}
+	return s;
+}
 
-	return con; // 返回一个可用连接
+// 当有请求时，从数据库连接池中返回一个可用连接，等待超时返回NULL
+// 先取自己线程缓存的连接，一次原子交换，只访问自己的cache line；再取全局空闲栈上的，最后才走慢路径
+MYSQL *connection_pool::GetConnection()
+{
+	if (!m_slots) // 连接池还没有初始化
+		return NULL;
+
+	conn_slot *s = m_cache[thread_id::get()].slot.exchange(NULL, std::memory_order_acquire);
+	if (!s)
+		s = pop_free();
+	if (!s)
+		s = wait_slot();
+	if (!s)
+		return NULL;
+
+	s->in_use.store(true, std::memory_order_relaxed);
+	return &s->mysql;
 }
 
 // 释放当前使用的连接
+// 自己的缓存空着就放进缓存，下次本线程直接用；放进去之后发现有线程在等连接，再拿出来放到空闲栈上通知它
 bool connection_pool::ReleaseConnection(MYSQL *con)
 {
 	if (NULL == con)  // 传入的参数为空指针
 		return false; // 返回false
 
-	lock.lock(); // 访问数据库连接池时要先拿到互斥锁
-
-	connList.push_back(con); // 放回list容器
-	++FreeConn;
-	--CurConn;
+	conn_slot *s = (conn_slot *)con;
+	if (s->broken) // 重连失败的连接不再放回去，连接数少了，等待的线程可以新建
+	{
+		close_slot(s);
+		notify();
+		return true;
+	}
 
-	lock.unlock(); // 解锁
+	s->idle_since_us.store(now_us(CLOCK_MONOTONIC_COARSE), std::memory_order_relaxed); // 只记录空闲时间，粗粒度的时钟更便宜
+	s->in_use.store(false, std::memory_order_relaxed);
 
-	reserve.post(); // 如果有线程阻塞在信号量上，就唤醒它；否则，信号量的值加1
+	thread_cache &mine = m_cache[thread_id::get()];
+	if (!mine.slot.load(std::memory_order_relaxed))
+	{
+		mine.slot.store(s);
+		if (!m_waiters.load())
+			return true;
+		s = mine.slot.exchange(NULL);
+		if (!s) // 已经被等待的线程偷走了
+			return true;
+	}
 
+	push_free(s);
+	notify(); // 如果有线程在等连接，就唤醒一个
 	return true;
 }
 
-// 销毁数据库连接池
+// 按空闲时间从新到旧排序
+static bool newer_first(const pair<long long, int> &a, const pair<long long, int> &b)
+{
+	return a.first > b.first;
+}
+
+// 维护线程每个检查周期做一次：
+//   把空闲栈上的连接和各线程缓存里空闲超过一个检查周期的连接取出来
+//   从最旧的开始关闭空闲超过IDLE_TIMEOUT_S的连接，保留MinConn个
+//   ping超过一个检查周期没用过也没检查过的连接，ping不通就重连
+//   剩下的按从旧到新放回空闲栈，最近用过的还在栈顶
+//   连接数不到MinConn时补足
+// 检查期间这些连接不在空闲栈上，请求取不到它们时会按需新建或者等待
+void connection_pool::maintain()
+{
+	long long now = now_us();
+	vector<pair<long long, int> > idle; // 空闲时间和槽位下标
+
+	conn_slot *s;
+	while ((s = pop_free()))
+		idle.push_back(make_pair(s->idle_since_us.load(std::memory_order_relaxed), (int)(s - m_slots)));
+	int n = thread_id::limit();
+	for (int i = 0; i < n; ++i)
+	{
+		s = m_cache[i].slot.load(std::memory_order_acquire);
+		if (s && now - s->idle_since_us.load(std::memory_order_relaxed) > (long long)CHECK_INTERVAL_S * 1000000 && (s = m_cache[i].slot.exchange(NULL)))
+			idle.push_back(make_pair(s->idle_since_us.load(std::memory_order_relaxed), (int)(s - m_slots)));
+	}
+	sort(idle.begin(), idle.end(), newer_first);
+
+	int open = MaxConn - m_closed_count.load();
+	int closed = 0;
+	while (!idle.empty() && open > (int)MinConn && now - idle.back().first > (long long)IDLE_TIMEOUT_S * 1000000)
+	{
+		close_slot(&m_slots[idle.back().second]);
+		idle.pop_back();
+		--open;
+		++closed;
+	}
+	m_closed.fetch_add(closed, std::memory_order_relaxed);
+
+	for (int i = idle.size() - 1; i >= 0; --i)
+	{
+		s = &m_slots[idle[i].second];
+		long long last = idle[i].first > s->checked_us ? idle[i].first : s->checked_us;
+		if (now - last > (long long)CHECK_INTERVAL_S * 1000000)
+		{
+			s->checked_us = now;
+			if (mysql_ping(&s->mysql) && !reconnect(s))
+			{
+				close_slot(s);
+				continue;
+			}
+		}
+		push_free(s);
+	}
+	if (closed || !idle.empty())
+		notify(); // 连接放回来了或者连接数少了，等待的线程可以取或者新建
+
+	while ((int)(MaxConn - m_closed_count.load()) < (int)MinConn)
+	{
+		lock.lock();
+		if (m_closed_slots.empty())
+		{
+			lock.unlock();
+			break;
+		}
+		s = &m_slots[m_closed_slots.back()];
+		m_closed_slots.pop_back();
+		m_closed_count.fetch_sub(1);
+		lock.unlock();
+
+		if (!connect(s)) // 数据库连不上，下个周期再试
+		{
+			lock.lock();
+			m_closed_slots.push_back(s - m_slots);
+			m_closed_count.fetch_add(1);
+			lock.unlock();
+			break;
+		}
+		lock.lock();
+		m_retry_at_us = 0; // 数据库恢复了，请求可以按需扩容了
+		lock.unlock();
+		push_free(s);
+		notify();
+	}
+}
+
+// 维护线程：每CHECK_INTERVAL_S秒维护一次，DestroyPool时退出
+void *connection_pool::maintainer(void *arg)
+{
+	connection_pool *pool = (connection_pool *)arg;
+	pool->lock.lock();
+	while (!pool->m_stop)
+	{
+		pool->m_stop_cond.timewait(pool->lock.get(), deadline_after_ms(CHECK_INTERVAL_S * 1000));
+		if (pool->m_stop)
+			break;
+		pool->lock.unlock();
+		pool->maintain();
+		pool->lock.lock();
+	}
+	pool->lock.unlock();
+	return NULL;
+}
+
+// 销毁数据库连接池，这时不应该还有线程在使用连接
 void connection_pool::DestroyPool()
 {
+	if (m_maintaining) // 先停掉维护线程，它会访问连接
+	{
+		lock.lock();
+		m_stop = true;
+		m_stop_cond.signal();
+		lock.unlock();
+		pthread_join(m_maintainer, NULL);
+		m_maintaining = false;
+	}
+	if (!m_slots)
+		return;
+
+	// 空闲栈和线程缓存里的连接，以及没有归还的连接，都是没有在没有连接的列表里的槽位
+	vector<bool> closed(MaxConn, false);
+	for (size_t i = 0; i < m_closed_slots.size(); ++i)
+		closed[m_closed_slots[i]] = true;
+	for (unsigned int i = 0; i < MaxConn; ++i)
+		if (!closed[i])
+			close_slot(&m_slots[i]);
+
+	for (int i = 0; i < thread_id::MAX_THREADS; ++i)
+		m_cache[i].slot = NULL;
+	m_free_head = 0;
+	m_closed_slots.clear();
+	m_closed_count = 0;
+	delete[] m_slots;
+	m_slots = NULL;
+}
 
-	lock.lock(); // 修改数据库连接时要先拿到互斥锁
+// 预处理con上的语句id，失败返回NULL，错误码存到err中
+MYSQL_STMT *connection_pool::prepare(MYSQL *con, STATEMENT id, unsigned int &err)
+{
+	MYSQL_STMT *stmt = mysql_stmt_init(con);
+	if (!stmt)
+	{
+		err = mysql_errno(con);
+		return NULL;
+	}
+	if (mysql_stmt_prepare(stmt, statement_sql[id], strlen(statement_sql[id])))
+	{
+		err = mysql_stmt_errno(stmt);
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+	return stmt;
+}
+
+// 绑定参数并执行con上的语句id，语句还没有预处理时先预处理；失败返回NULL，错误码存到err中
+// 语句在服务器端失效时重新预处理，连接断了时就地重连，然后重试一次
+MYSQL_STMT *connection_pool::run(MYSQL *con, STATEMENT id, const char *const *params, unsigned int &err)
+{
+	err = 0;
+	conn_slot *st = (conn_slot *)con; // MYSQL是槽位的第一个成员
+	if (!con || st->broken)
+		return NULL;
+	MYSQL_STMT *&stmt = st->stmt[id];
 
-	if (connList.size() > 0) // 连接池中有连接
+	for (int attempt = 0; attempt < 2; ++attempt)
 	{
-		list<MYSQL *>::iterator it; // 迭代器
-		for (it = connList.begin(); it != connList.end(); ++it)
+		if (!stmt)
+			stmt = prepare(con, id, err);
+		if (stmt)
 		{
-			MYSQL *con = *it; // 取出一个连接
-			mysql_close(con); // 关闭连接
+			// 参数都按字符串绑定，MySQL会按列的类型转换
+			MYSQL_BIND bind[MAX_PARAMS];
+			unsigned long lens[MAX_PARAMS];
+			unsigned long n = mysql_stmt_param_count(stmt);
+			if (n > MAX_PARAMS)
+				n = MAX_PARAMS;
+			memset(bind, 0, sizeof(bind));
+			for (unsigned long i = 0; i < n; ++i)
+			{
+				lens[i] = strlen(params[i]);
+				bind[i].buffer_type = MYSQL_TYPE_STRING;
+				bind[i].buffer = (void *)params[i];
+				bind[i].buffer_length = lens[i];
+				bind[i].length = &lens[i];
+			}
+
+			if (!mysql_stmt_bind_param(stmt, bind) && !mysql_stmt_execute(stmt))
+				return stmt;
+
+			err = mysql_stmt_errno(stmt);
+			if (err == ERR_UNKNOWN_STMT || err == ERR_NEED_REPREPARE)
+			{
+				mysql_stmt_close(stmt);
+				stmt = NULL;
+				continue;
+			}
 		}
-		CurConn = 0;	  // 当前使用的连接数
-		FreeConn = 0;	  // 空闲连接数
-		connList.clear(); // 清空list
 
-		lock.unlock(); // 连接池中有连接，解锁
+		if (err != ERR_SERVER_GONE && err != ERR_SERVER_LOST)
+			break;
+		if (!reconnect(st)) // 重连会关闭这个连接上的所有语句，stmt也变成NULL
+			break;
+		if (err == ERR_SERVER_LOST && !statement_retryable[id]) // 语句可能已经执行过了，不能重做
+			break;
+	}
+	return NULL;
+}
+
+// 执行没有结果集的语句，返回0表示成功，否则为mysql错误码（比如1062表示主键重复）
+int connection_pool::Execute(MYSQL *con, STATEMENT id, const char *const *params)
+{
+	unsigned int err;
+	if (!run(con, id, params, err))
+		return err ? err : -1;
+	return 0;
+}
+
+// 执行有结果集的语句，逐行交给on_row；行是一行一行从服务器读的，不会先把整个结果集存到内存里
+int connection_pool::QueryRows(MYSQL *con, STATEMENT id, const char *const *params, row_handler on_row, void *arg)
+{
+	unsigned int err;
+	MYSQL_STMT *stmt = run(con, id, params, err);
+	if (!stmt)
+		return -1;
+
+	unsigned int n = mysql_stmt_field_count(stmt);
+	if (n > MAX_COLUMNS)
+	{
+		mysql_stmt_free_result(stmt);
+		return -1;
+	}
+
+	MYSQL_BIND bind[MAX_COLUMNS];
+	char buf[MAX_COLUMNS][COLUMN_LEN];
+	unsigned long lens[MAX_COLUMNS];
+	sql_bool is_null[MAX_COLUMNS];
+	memset(bind, 0, sizeof(bind));
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		bind[i].buffer_type = MYSQL_TYPE_STRING;
+		bind[i].buffer = buf[i];
+		bind[i].buffer_length = COLUMN_LEN - 1;
+		bind[i].length = &lens[i];
+		bind[i].is_null = &is_null[i];
+	}
+	if (mysql_stmt_bind_result(stmt, bind))
+	{
+		mysql_stmt_free_result(stmt);
+		return -1;
+	}
+
+	int rows = 0, ret;
+	while ((ret = mysql_stmt_fetch(stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED) // 一定要读完，否则这个连接不能执行下一条语句
+	{
+		char *row[MAX_COLUMNS];
+		for (unsigned int i = 0; i < n; ++i)
+		{
+			buf[i][lens[i] < COLUMN_LEN - 1 ? lens[i] : COLUMN_LEN - 1] = '\0';
+			row[i] = is_null[i] ? NULL : buf[i];
+		}
+		if (on_row)
+			on_row(row, arg);
+		++rows;
 	}
+	mysql_stmt_free_result(stmt);
+	return ret == MYSQL_NO_DATA ? rows : -1;
+}
 
-	lock.unlock(); // 连接池中没有连接，解锁
+// QueryRow的回调：只保留第一行的第一列
+struct first_value
+{
+	char *value;
+	size_t len;
+	bool found;
+};
+
+static void keep_first_value(char **row, void *arg)
+{
+	first_value *v = (first_value *)arg;
+	if (v->found)
+		return;
+	v->found = true;
+	snprintf(v->value, v->len, "%s", row[0] ? row[0] : "");
+}
+
+// 取第一行第一列，返回1表示有，0表示没有，-1表示出错
+int connection_pool::QueryRow(MYSQL *con, STATEMENT id, const char *const *params, char *value, size_t len)
+{
+	first_value v = {value, len, false};
+	if (QueryRows(con, id, params, keep_first_value, &v) < 0)
+		return -1;
+	return v.found;
+}
+
+// 读取本统计周期的运行情况并开始新的周期
+void connection_pool::GetStats(conn_pool_stats &st)
+{
+	st.total = MaxConn - m_closed_count.load(std::memory_order_relaxed);
+	st.free = GetFreeConn();
+
+	st.waits = m_waits.exchange(0, std::memory_order_relaxed);
+	long long wait_us = m_wait_us.exchange(0, std::memory_order_relaxed);
+	st.avg_wait_us = st.waits ? wait_us / st.waits : 0;
+	st.max_wait_us = m_max_wait_us.exchange(0, std::memory_order_relaxed);
+	st.timeouts = m_timeouts.exchange(0, std::memory_order_relaxed);
+	st.created = m_created.exchange(0, std::memory_order_relaxed);
+	st.closed = m_closed.exchange(0, std::memory_order_relaxed);
+	st.reconnects = m_reconnects.exchange(0, std::memory_order_relaxed);
+	st.connect_failures = m_connect_failures.exchange(0, std::memory_order_relaxed);
 }
 
 // 获取当前空闲的连接数
 int connection_pool::GetFreeConn()
 {
-	return this->FreeConn;
+	if (!m_slots)
+		return 0;
+
+	lock.lock();
+	vector<bool> closed(MaxConn, false);
+	for (size_t i = 0; i < m_closed_slots.size(); ++i)
+		closed[m_closed_slots[i]] = true;
+	lock.unlock();
+
+	int free = 0;
+	for (unsigned int i = 0; i < MaxConn; ++i)
+		if (!closed[i] && !m_slots[i].in_use.load(std::memory_order_relaxed))
+			++free;
+	return free;
 }
 
 // 析构函数
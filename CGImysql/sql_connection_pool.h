@@ -8,20 +8,99 @@
 #include <string.h>
 #include <iostream>
 #include <string>
+#include <atomic>
+#include <map>
+#include <vector>
 #include "../lock/locker.h"
+#include "../lock/thread_id.h"
 
 using namespace std;
 
+// 连接池为每个连接缓存的预处理语句，语句的SQL在sql_connection_pool.cpp的statement_sql中
+enum STATEMENT
+{
+	STMT_FIND_USER = 0, // 按用户名查密码，参数：用户名
+	STMT_INSERT_USER,	// 插入一个用户，参数：用户名、密码
+	STMT_PAGE_USERS,	// 按用户名顺序读下一页用户，参数：上一页最后一个用户名
+	STMT_COUNT
+};
+
+// 查询结果每一行的回调，row和MYSQL_ROW一样，NULL列为NULL
+typedef void (*row_handler)(char **row, void *arg);
+
+// 连接池在一个统计周期内的运行情况
+struct conn_pool_stats
+{
+	int total;					// 当前的连接数，包括正在使用的
+	int free;					// 空闲的连接数
+	long long waits;			// 本周期因为没有空闲连接而阻塞等待的次数
+	long long avg_wait_us;		// 本周期阻塞等待的平均时长
+	long long max_wait_us;		// 本周期最长一次阻塞等待的时长
+	long long timeouts;			// 本周期等到超时也没拿到连接的次数
+	long long created;			// 本周期新建的连接数
+	long long closed;			// 本周期因为空闲太久关闭的连接数
+	long long reconnects;		// 本周期连接断开后重连成功的次数
+	long long connect_failures; // 本周期建立连接失败的次数
+};
+
+/****************************************************************************************/
+/* 连接数在MinConn和MaxConn之间伸缩：没有空闲连接时按需新建，空闲太久的连接由维护线程关闭        */
+/*   每个线程缓存一个连接，归还时放进自己的缓存，下次取连接时一次原子交换就拿到，线程之间不竞争   */
+/*   缓存已经有连接或者有线程在等连接时，归还到全局的无锁空闲栈上；栈是后进先出的，              */
+/*   总是取最近用过的，冷下来的连接沉在栈底被关闭                                                */
+/*   空闲栈和自己的缓存都没有连接时：没到上限就新建，否则从其他线程的缓存里偷一个，再不行才等待   */
+/*   维护线程定期ping一段时间没用过的空闲连接，断了就重连，并把连接数补足到MinConn               */
+/*   执行语句时发现连接断了（比如MySQL重启过）就地重连，调用者手里的MYSQL*仍然有效             */
+/*   获取连接最多等m_wait_timeout_ms，超时返回NULL，数据库出问题时请求不会无限堆积              */
+/****************************************************************************************/
 class connection_pool
 {
 private:
-	unsigned int MaxConn;  // 最大连接数
-	unsigned int CurConn;  // 当前已使用的连接数
-	unsigned int FreeConn; // 当前空闲的连接数
+	static const int CHECK_INTERVAL_S = 5; // 维护线程的检查周期，空闲超过一个周期的连接要ping一次
+	static const int IDLE_TIMEOUT_S = 60;  // 连接空闲多久之后关闭，保留MinConn个
+	static const int CONNECT_TIMEOUT_S = 3; // 建立连接的超时时间
+	static const int IO_TIMEOUT_S = 10;	   // 读写的超时时间，数据库没有响应时语句不会一直阻塞
+	static const int CONNECT_BACKOFF_MS = 1000; // 按需新建连接失败后，多久之内不再按需新建
+	static const int CACHELINE_SIZE = 64;
+
+	// 一个连接槽位，init时按MaxConn一次分配好，之后不释放，连接关闭后槽位留给下一次新建
+	// MYSQL是第一个成员，调用者拿到的MYSQL*就是槽位的地址，执行语句时不用查表
+	// 除了原子变量，其余成员只被持有这个连接的线程（请求线程或者维护线程）访问
+	struct alignas(CACHELINE_SIZE) conn_slot
+	{
+		MYSQL mysql;
+		MYSQL_STMT *stmt[STMT_COUNT]; // 预处理语句，第一次用到时才预处理，之后一直复用到连接关闭或重连
+		std::atomic<long long> idle_since_us; // 最后一次归还的时间，维护线程会看线程缓存里的连接空闲了多久
+		long long checked_us;		  // 最后一次ping的时间
+		bool broken;				  // 重连失败，连接已经关闭，归还时释放槽位
+		std::atomic<bool> in_use;	  // 是否被请求取走了，只用来统计空闲连接数
+		std::atomic<unsigned int> next_free; // 空闲栈中下一个槽位的下标加一，0表示栈底
+	};
+
+	// 每个线程缓存的一个空闲连接，按thread_id.h的线程编号索引
+	struct alignas(CACHELINE_SIZE) thread_cache
+	{
+		std::atomic<conn_slot *> slot;
+	};
+
+	unsigned int MaxConn;	 // 最大连接数
+	unsigned int MinConn;	 // 最小连接数，空闲再久也保留这么多
+	int m_wait_timeout_ms;	 // 获取连接最多等多久
+	long long m_retry_at_us; // 按需新建连接失败后，这个时间之前不再按需新建，由维护线程重试，由lock保护
 
-	locker lock;			// 多线程操作连接池会造成竞争，这里使用互斥锁进行同步
-	list<MYSQL *> connList; // 连接池
-	sem reserve;			// 使用信号量实现多线程争夺连接的同步机制
+	conn_slot *m_slots;									// MaxConn个连接槽位
+	thread_cache m_cache[thread_id::MAX_THREADS];		// 每个线程缓存的连接
+	std::atomic<unsigned long long> m_free_head;		// 全局空闲栈的栈顶：低32位是槽位下标加一，0表示空；高32位是版本号，防止ABA
+	std::atomic<int> m_closed_count;					// 没有连接的槽位数，不为0时才需要加锁去新建连接
+	std::atomic<int> m_waiters;							// 正在等连接的线程数，归还时不为0才需要加锁通知
+
+	locker lock;				// 保护没有连接的槽位列表，等待连接时配合m_released使用
+	vector<int> m_closed_slots; // 没有连接的槽位下标
+	cond m_released;			// 有连接归还或者连接数减少时通知等待连接的线程
+	cond m_stop_cond;			// 通知维护线程退出
+	pthread_t m_maintainer;		// 维护线程
+	bool m_maintaining;			// 维护线程是否已经启动
+	bool m_stop;				// 维护线程是否要退出
 
 	string url;			 // 主机地址
 	string Port;		 // 数据库端口号
@@ -29,19 +108,56 @@ private:
 	string PassWord;	 // 登陆数据库密码
 	string DatabaseName; // 使用数据库名
 
-private:
-	connection_pool();	// 构造数据库连接池
-	~connection_pool(); // 析构数据库连接池
+	std::atomic<long long> m_waits;		  // 因为没有空闲连接而阻塞等待的次数
+	std::atomic<long long> m_wait_us;	  // 阻塞等待的总时长，单位微秒
+	std::atomic<long long> m_max_wait_us; // 最长一次阻塞等待的时长
+	std::atomic<long long> m_timeouts;	  // 等到超时也没拿到连接的次数
+	std::atomic<long long> m_created;	  // 新建的连接数
+	std::atomic<long long> m_closed;	  // 因为空闲太久关闭的连接数
+	std::atomic<long long> m_reconnects;  // 重连成功的次数
+	std::atomic<long long> m_connect_failures; // 建立连接失败的次数
+
+	static const int MAX_PARAMS = 4;	// 语句最多几个参数
+	static const int MAX_COLUMNS = 4;	// 结果最多几列
+	static const int COLUMN_LEN = 256; // 结果每列的最大长度，超出的截断
+
+	MYSQL_STMT *run(MYSQL *con, STATEMENT id, const char *const *params, unsigned int &err); // 绑定参数并执行语句
+	MYSQL_STMT *prepare(MYSQL *con, STATEMENT id, unsigned int &err);					   // 预处理语句
+
+	bool connect(conn_slot *s);	   // 在槽位上新建一个连接
+	bool reconnect(conn_slot *s);  // 关闭连接上的语句后就地重连
+	void close_slot(conn_slot *s); // 关闭槽位上的语句和连接，槽位留给下一次新建
+	void push_free(conn_slot *s);  // 放到全局空闲栈上
+	conn_slot *pop_free();		   // 从全局空闲栈上取一个，没有返回NULL
+	conn_slot *open_slot();		   // 连接数没到上限时新建一个连接
+	conn_slot *steal();			   // 从其他线程的缓存里取一个
+	conn_slot *wait_slot();		   // 自己的缓存和空闲栈都没有连接时，新建、偷或者等待
+	void notify();				   // 有线程在等连接时唤醒一个
+	void maintain();			   // 关闭空闲太久的连接，ping空闲连接，补足最小连接数
+	static void *maintainer(void *arg); // 维护线程
 
 public:
+	connection_pool();	// 构造数据库连接池，主库用GetInstance()的单例，每个从库另外构造一个
+	~connection_pool(); // 析构数据库连接池
+
 	// 外部接口
-	static connection_pool *GetInstance(); // 单例模式，获取数据库连接池对象
-	MYSQL *GetConnection();				   // 获取数据库连接
+	static connection_pool *GetInstance(); // 单例模式，获取主库的连接池对象
+	MYSQL *GetConnection();				   // 获取数据库连接，等待超时返回NULL
 	bool ReleaseConnection(MYSQL *conn);   // 释放连接
 	int GetFreeConn();					   // 获取连接
 	void DestroyPool();					   // 销毁所有连接
 
-	void init(string url, string User, string PassWord, string DataBaseName, int Port, unsigned int MaxConn); // 初始化数据库连接池
+	// 在con上执行预处理语句id，参数都按字符串绑定，个数和语句中的?一致
+	int Execute(MYSQL *con, STATEMENT id, const char *const *params);	// 没有结果集的语句，返回0表示成功，否则为mysql错误码
+	int QueryRows(MYSQL *con, STATEMENT id, const char *const *params, row_handler on_row, void *arg); // 逐行回调，返回行数，出错返回-1
+	int QueryRow(MYSQL *con, STATEMENT id, const char *const *params, char *value, size_t len);		  // 取第一行第一列，返回1表示有，0表示没有，-1表示出错
+	static const char *statement(STATEMENT id);																  // 语句的SQL，参数处是?，非阻塞客户端也执行这里的语句
+
+	void GetStats(conn_pool_stats &st); // 读取本统计周期的运行情况并开始新的周期
+
+	// 初始化数据库连接池：先建立MinConn个连接，连不上数据库也不退出，之后按需重试
+	// WaitTimeoutMs为获取连接最多等多久
+	void init(string url, string User, string PassWord, string DataBaseName, int Port, unsigned int MaxConn, unsigned int MinConn, int WaitTimeoutMs);
 };
 
 // 将数据库连接的获取与释放通过RAII机制封装，避免手动释放。
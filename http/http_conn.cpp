@@ -1,7 +1,7 @@
 #include "http_conn.h"
 #include "../log/log.h"
-#include <map>
-#include <mysql/mysql.h>
+#include "user_table.h"
+#include "../lock/clock.h"
 #include <fstream>
 
 // 定义http响应的一些状态信息
@@ -18,8 +18,15 @@ const char *error_500_form = "There was an unusual problem serving the request f
 // 网站根目录，文件夹内存放请求的资源和跳转的html文件
 const char *doc_root = "/home/lfc/cpp_project/tiny_webserver/root";
 
-map<string, string> users; // 存放用户名和密码的map容器
-locker m_lock;             // 用来干啥的锁？
+user_table users;                       // 存放用户名和密码的分片哈希表，查找无锁
+static bool users_complete = true;      // users里是否有全部用户，缓存模式下为false，没命中时要查存储
+static std::atomic<long long> user_misses(0); // 缓存模式下没命中、去存储查询的次数
+static session_table sessions;          // 登录会话，按Cookie里的会话号查找，无锁
+static pthread_t warm_up_tid;           // 后台预热线程
+static bool warm_up_started = false;
+static std::atomic<bool> warm_up_stop(false); // 退出前让预热线程在当前这一页读完后停下
+
+static const int MAX_NAME_LEN = 100;    // 用户名的最大长度，和do_request中的缓冲区一致
 
 // 这里应该是重复了，connfdET和listenfdET有一个就够了
 // #define connfdET
@@ -28,32 +35,131 @@ locker m_lock;             // 用来干啥的锁？
 #define listenfdLT
 
 int http_conn::m_user_count = 0; // 初始化静态成员变量
+
+// 各阶段超时的默认值：请求头10秒，消息体30秒，长连接空闲15秒，发送响应宽限10秒后不低于4KB/s
+http_conn::timeout_config http_conn::m_timeout = {10000, 30000, 15000, 10000, 4096};
+
+async_mysql *http_conn::m_async_db = NULL;         // 默认阻塞查询，main中初始化成功后才设置
+void (*http_conn::m_resume)(http_conn *conn) = NULL;
+bool http_conn::m_require_session = false;         // 默认不检查登录，main中按配置设置
+
+// 请求方法的名字，下标就是METHOD
+static const char *method_name[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATH"};
 int http_conn::m_epollfd = -1;   // 初始化静态成员变量
+user_store *http_conn::m_store = NULL;   // 初始化静态成员变量
 
-// 该函数用来初始化存放用户名和密码的map容器: map<string, string> users;
-void http_conn::initmysql_result(connection_pool *connPool)
+// 按用户名从存储后端查一个用户，查到就放进users缓存
+// 返回1表示有这个用户，0表示没有，-1表示查询出错
+static int load_user(user_store *store, const char *name)
 {
+    if (strlen(name) >= MAX_NAME_LEN)
+        return 0;
+    user_misses.fetch_add(1, std::memory_order_relaxed);
+
+    char passwd[MAX_NAME_LEN];
+    int found = store->find(name, passwd, sizeof(passwd));
+    if (found < 0)
+        LOG_ERROR("find user %s failed", name);
+    else if (found)
+        users.insert(name, passwd);
+    return found;
+}
 
-    MYSQL *mysql = NULL;                       // 指向数据库连接的指针
-    connectionRAII mysqlcon(&mysql, connPool); // 从数据库连接池中取一个连接放到mysql指针变量中
+// 预热和全量读入时一页的读取进度
+struct warm_up_page
+{
+    char cursor[MAX_NAME_LEN]; // 存储后端记下的读取位置，下一页从这里开始
+    bool all;                  // 全量读入，不看缓存满没满
+    long long loaded;
+};
 
-    // 在user表中检索username，passwd数据（浏览器端输入）
-    if (mysql_query(mysql, "SELECT username,passwd FROM user"))
-    {
-        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
-    }
+static void warm_up_row(const char *name, const char *passwd, void *arg)
+{
+    warm_up_page *page = (warm_up_page *)arg;
+    if ((page->all || !users.full()) && users.insert(name, passwd))
+        ++page->loaded;
+}
 
-    MYSQL_RES *result = mysql_store_result(mysql);    // 从表中检索完整的结果集
-    int num_fields = mysql_num_fields(result);        // 返回结果集中的列数
-    MYSQL_FIELD *fields = mysql_fetch_fields(result); // 返回所有字段结构的数组
+// 按页把存储里的用户读进缓存，读完、出错或者（不是全量读入时）缓存满了就结束
+// 每页单独访问一次存储，MySQL后端页与页之间把连接还给连接池，不和请求长时间抢连接
+static void load_users(user_store *store, warm_up_page &page)
+{
+    int rows = 0;
+    while ((page.all || !users.full()) && !warm_up_stop.load(std::memory_order_relaxed) &&
+           (rows = store->scan(page.cursor, sizeof(page.cursor), warm_up_row, &page)) > 0)
+        ;
+    if (rows < 0)
+        LOG_ERROR("user warm-up failed at %s", page.cursor);
+}
+
+// 后台预热线程：缓存模式下按页把用户读进缓存，直到缓存满了或者读完了
+static void *warm_up_users(void *arg)
+{
+    warm_up_page page;
+    page.cursor[0] = '\0';
+    page.all = false;
+    page.loaded = 0;
+    load_users((user_store *)arg, page);
+
+    LOG_INFO("user warm-up done: loaded=%lld cached=%d", page.loaded, (int)users.size());
+    return NULL;
+}
 
-    // 从结果集中获取下一行，将对应的用户名和密码，存入map中
-    while (MYSQL_ROW row = mysql_fetch_row(result))
+// 初始化存放用户名和密码的哈希表: user_table users;
+// cache_size为0时把存储里的用户全部读进内存，否则只缓存cache_size个用户，没命中时按用户名查存储，
+// 不用等全表扫描，服务器可以立即开始监听；warm_up表示缓存模式下是否在后台分页预热
+void http_conn::initmysql_result(user_store *store, size_t cache_size, bool warm_up)
+{
+    m_store = store;
+
+    if (cache_size)
     {
-        string temp1(row[0]);
-        string temp2(row[1]);
-        users[temp1] = temp2;
+        users.set_capacity(cache_size);
+        users_complete = false;
+
+        if (warm_up && pthread_create(&warm_up_tid, NULL, warm_up_users, store) == 0)
+            warm_up_started = true;
+        return;
     }
+
+    warm_up_page page;
+    page.cursor[0] = '\0';
+    page.all = true;
+    page.loaded = 0;
+    load_users(store, page);
+}
+
+// 退出前调用，关闭存储之前等预热线程停下
+void http_conn::stop_warm_up()
+{
+    warm_up_stop.store(true, std::memory_order_relaxed);
+    if (warm_up_started)
+        pthread_join(warm_up_tid, NULL);
+    warm_up_started = false;
+}
+
+void http_conn::get_user_stats(int &cached, long long &misses, long long &evictions, long long &register_batches, long long &registered)
+{
+    cached = users.size();
+    misses = user_misses.exchange(0, std::memory_order_relaxed);
+    evictions = users.evictions();
+    m_store->get_write_stats(register_batches, registered);
+}
+
+void http_conn::init_sessions(size_t max_sessions, int ttl_s)
+{
+    sessions.init(max_sessions, ttl_s);
+}
+
+int http_conn::sweep_sessions(size_t budget)
+{
+    return sessions.sweep(budget);
+}
+
+void http_conn::get_session_stats(int &active, long long &created, long long &hits, long long &misses, long long &expired)
+{
+    active = sessions.size();
+    sessions.get_stats(created, hits, misses, expired);
 }
 
 // 对文件描述符设置非阻塞（直接放在main.cpp不好吗？）
@@ -143,6 +249,7 @@ void http_conn::init(int sockfd, const sockaddr_in &addr)
 
     addfd(m_epollfd, sockfd, true); // 将本连接加入监听表
     m_user_count++;                 // 客户总量加一
+    m_conn_id++;                    // 之前的连接提交的查询回来时不再交给这个连接
 
     init(); // 初始化一些私有成员变量
 }
@@ -150,7 +257,6 @@ void http_conn::init(int sockfd, const sockaddr_in &addr)
 // 初始化新接受的连接后，再对一些private成员进行初始化
 void http_conn::init()
 {
-    mysql = NULL;                                 // 指向数据库连接的指针初始化
     bytes_to_send = 0;                            // 待发送的字节数初始化
     bytes_have_send = 0;                          // 已发送的字节数初始化
     m_check_state = CHECK_STATE_REQUESTLINE;      // 主状态机的状态初始化为CHECK_STATE_REQUESTLINE
@@ -163,6 +269,18 @@ void http_conn::init()
     m_start_line = 0;                             // 读取的行在buffer中的起始位置初始化
     m_checked_idx = 0;                            // 当前正在分析的字符在buffer中的位置初始化
     m_read_idx = 0;                               // buffer中已经读取的字符初始化
+    m_request_start_ms = 0;                       // 请求第一个字节到达的时间初始化
+    m_body_start_ms = 0;                          // 请求头读完的时间初始化
+    m_write_start_ms = 0;                         // 响应开始发送的时间初始化
+    m_access_path[0] = '\0';                      // 访问日志的请求路径初始化
+    m_has_session = false;                        // 请求带的会话号初始化
+    m_set_cookie[0] = '\0';                       // 默认不下发会话号
+    m_status = 0;                                 // 响应状态码初始化
+    m_start_us = 0;                               // 访问日志的各个时间点初始化
+    m_dispatch_us = 0;
+    m_process_us = 0;
+    m_respond_us = 0;
+    m_phase.store(PHASE_IDLE);                    // 等待下一个请求
     m_write_idx = 0;                              // buffer中已经写入的字符初始化
     cgi = 0;                                      // 是否启用的POST初始化
     memset(m_read_buf, '\0', READ_BUFFER_SIZE);   // 读缓冲区初始化
@@ -239,6 +357,8 @@ bool http_conn::read_once()
         return false;
     }
 
+    start_request(); // 新请求的第一个字节到达，开始计算请求头的超时
+
     return true;
 
 #endif
@@ -259,10 +379,125 @@ bool http_conn::read_once()
         }
         m_read_idx += bytes_read;
     }
+    start_request(); // 新请求的第一个字节到达，开始计算请求头的超时
     return true;
 #endif
 }
 
+// 主线程读到数据后调用，连接空闲时说明这是新请求的第一个字节，进入读请求头阶段
+void http_conn::start_request()
+{
+    if (m_phase.load(std::memory_order_relaxed) != PHASE_IDLE)
+        return;
+    m_start_us = now_us();
+    m_request_start_ms = m_start_us / 1000;
+    m_phase.store(PHASE_HEADER, std::memory_order_release);
+}
+
+// 记下交给线程池的时间，访问日志据此算出读请求和排队的耗时
+void http_conn::on_dispatch()
+{
+    m_dispatch_us = now_us();
+    m_phase.store(PHASE_PROCESS, std::memory_order_relaxed);
+}
+
+// 每个请求只写这一条访问日志，字段用空格分隔，依次为：
+//   客户端地址 方法 路径 状态码 请求字节数 响应字节数 读请求 排队 处理 发送 总耗时（后五项单位微秒）
+// 路径最多ACCESS_PATH_LEN-1个字符，整条记录的长度有上限；二进制日志模式下只记录这些参数的原始值
+void http_conn::log_access()
+{
+    if (LOG_LEVEL_INFO < LOG_MIN_LEVEL || !Log::enabled(LOG_LEVEL_INFO)) // 不写访问日志时不用格式化地址和取时间
+        return;
+
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, addr, sizeof(addr));
+    long long end = now_us();
+    LOG_UNLIMITED(LOG_LEVEL_INFO, "access %s %s %s %d %d %d %lld %lld %lld %lld %lld", addr, method_name[m_method],
+             m_access_path[0] ? m_access_path : "-", m_status, m_read_idx, bytes_have_send,
+             m_dispatch_us - m_start_us, m_process_us - m_dispatch_us, m_respond_us - m_process_us,
+             end - m_respond_us, end - m_start_us);
+}
+
+// 主线程直接拒绝请求（线程池过载回复503）时调用，sent为已经发出的字节数
+// 请求一般还没交给工作线程解析，方法和路径从读缓冲区的请求行里取；异步查询回来后被拒绝的请求已经解析过了
+void http_conn::log_rejected(int status, int sent)
+{
+    if (!m_access_path[0])
+    {
+        const char *end = m_read_buf + m_read_idx;
+        const char *method = m_read_buf, *method_end = method;
+        while (method_end < end && *method_end != ' ' && *method_end != '\t' && *method_end != '\r')
+            ++method_end;
+        for (size_t i = 0; i < sizeof(method_name) / sizeof(method_name[0]); ++i)
+        {
+            if (strlen(method_name[i]) == (size_t)(method_end - method) && strncasecmp(method, method_name[i], method_end - method) == 0)
+                m_method = (METHOD)i;
+        }
+
+        const char *url = method_end;
+        while (url < end && (*url == ' ' || *url == '\t'))
+            ++url;
+        const char *url_end = url;
+        while (url_end < end && *url_end != ' ' && *url_end != '\t' && *url_end != '\r' && *url_end != '\n')
+            ++url_end;
+        snprintf(m_access_path, ACCESS_PATH_LEN, "%.*s", (int)(url_end - url), url);
+    }
+
+    m_status = status;
+    bytes_have_send = sent;
+    m_process_us = m_respond_us = now_us(); // 没有经过工作线程，处理和发送耗时都算0
+    log_access();
+}
+
+// 定时器到期时由主线程调用，按连接当前所处的阶段计算真正的超时时间，last_active为最后一次有数据收发的时间
+long long http_conn::deadline(long long last_active)
+{
+    switch (m_phase.load(std::memory_order_acquire))
+    {
+    case PHASE_HEADER: // 不管数据来得多勤，请求头都必须在期限内读完，防止一个字节一个字节地发请求头
+        return m_request_start_ms + m_timeout.header_ms;
+    case PHASE_BODY:
+        return m_body_start_ms + m_timeout.body_ms;
+    case PHASE_WRITE: // 宽限时间之后，已发送的字节数要跟得上最低发送速度，防止慢速读取一直占着连接
+        if (m_timeout.min_send_rate > 0)
+            return m_write_start_ms + m_timeout.send_grace_ms + (long long)bytes_have_send * 1000 / m_timeout.min_send_rate;
+        return last_active + m_timeout.idle_ms;
+    default: // 空闲或者请求还在线程池里，按最后活跃时间计算
+        return last_active + m_timeout.idle_ms;
+    }
+}
+
+// 主线程读完数据后调用，只解析请求行判断请求类别，不修改读缓冲区，也不改变主状态机的状态
+// 登录/注册(POST /2xxx、POST /3xxx)会阻塞在数据库上，归为DB_REQUEST，其余都是STATIC_REQUEST
+// 请求行还没读完整时先按STATIC_REQUEST处理，工作线程发现请求不完整会继续监听读事件
+http_conn::REQUEST_CLASS http_conn::classify()
+{
+    const char *begin = m_read_buf;
+    const char *end = m_read_buf + m_read_idx;
+
+    if (m_read_idx < 5 || strncasecmp(begin, "POST", 4) != 0 || (begin[4] != ' ' && begin[4] != '\t'))
+        return STATIC_REQUEST;
+
+    const char *url = begin + 4;
+    while (url < end && (*url == ' ' || *url == '\t'))
+        ++url;
+
+    // 找到url中最后一个'/'，规则和do_request中的strrchr(m_url, '/')保持一致
+    const char *slash = NULL;
+    const char *cur = url;
+    for (; cur < end && *cur != ' ' && *cur != '\t' && *cur != '\r' && *cur != '\n'; ++cur)
+    {
+        if (*cur == '/')
+            slash = cur;
+    }
+    if (cur == end || !slash || slash + 1 >= cur) // 请求行不完整或url不合法
+        return STATIC_REQUEST;
+
+    if (slash[1] == '2' || slash[1] == '3')
+        return DB_REQUEST;
+    return STATIC_REQUEST;
+}
+
 //  GET /562f25980001b1b106000338.jpg HTTP/1.1
 //  Host:img.mukewang.com
 //  User-Agent:Mozilla/5.0 (Windows NT 10.0; WOW64)
@@ -350,6 +585,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     if (!m_url || m_url[0] != '/')
         return BAD_REQUEST;
 
+    snprintf(m_access_path, ACCESS_PATH_LEN, "%s", m_url); // 访问日志记录客户端请求的原始路径
+
     // 当url为/时，显示欢迎界面
     if (strlen(m_url) == 1)
     {
@@ -376,6 +613,7 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         if (m_content_length != 0) // 消息体不为空，说明是POST请求，仅需读取更多信息
         {
             m_check_state = CHECK_STATE_CONTENT; // 转移到消息体处理状态
+            m_body_start_ms = now_ms();          // 开始计算消息体的超时
             return NO_REQUEST;                   // 返回NO_REQUEST，表示请求不完整，需要继续读取客户数据
         }
         return GET_REQUEST; // 否则说明是GET请求，则报文解析结束。
@@ -406,14 +644,27 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         m_host = text; // 解析请求头部HOST字段
     }
 
-    else
+    else if (strncasecmp(text, "Cookie:", 7) == 0)
     {
-        // 忽略其它头部字段
-        // printf("oop!unknow header: %s\n",text);
-        LOG_INFO("oop!unknow header: %s", text);
-        Log::get_instance()->flush();
+        text += 7;
+        // Cookie的格式是"名字=值; 名字=值"，找名字正好是sid、值是完整会话号的那一项
+        for (char *c = text; (c = strstr(c, "sid=")) != NULL; c += 4)
+        {
+            if (c != text && c[-1] != ' ' && c[-1] != ';')
+                continue;
+            if (!session_table::parse(c + 4, m_session_id)) // 遇到不是十六进制的字符（包括'\0'）就停下，不会读过字符串末尾
+                continue;
+            char end = c[4 + session_table::ID_LEN]; // 解析成功说明前面的ID_LEN个字符都不是'\0'
+            if (end == '\0' || end == ';' || end == ' ')
+            {
+                m_has_session = true;
+                break;
+            }
+        }
     }
 
+    // 忽略其它头部字段
+
     return NO_REQUEST;
 }
 
@@ -449,9 +700,6 @@ http_conn::HTTP_CODE http_conn::process_read()
         text = get_line();            // 因为parse_line()中把'\r'和'\n'替换成了'\0'，所以这里得到的text就是一行内容
         m_start_line = m_checked_idx; // 重置m_start_line的位置，下一次就是下一行的起点了
 
-        LOG_INFO("%s", text);         // 写日志
-        Log::get_instance()->flush(); // 刷新缓冲区
-
         switch (m_check_state)
         {
 
@@ -499,6 +747,40 @@ http_conn::HTTP_CODE http_conn::process_read()
     return NO_REQUEST;
 }
 
+// 把按用户名查密码的查询交给m_async_db，工作线程立即返回去处理别的请求
+http_conn::HTTP_CODE http_conn::find_user_async(const char *name)
+{
+    user_misses.fetch_add(1, std::memory_order_relaxed);
+
+    m_query.stmt = STMT_FIND_USER;
+    snprintf(m_query.param, sizeof(m_query.param), "%s", name);
+    m_query.done = query_done;
+    m_query.arg = this;
+    m_query_conn_id = m_conn_id;
+    m_db_state.store(DB_PENDING, std::memory_order_release); // submit之后结果随时可能回来，要先改状态
+    m_async_db->submit(&m_query);
+    return PENDING_REQUEST;
+}
+
+// 主线程中调用：连接还在就把请求重新交给线程池，已经关闭的连接丢掉结果
+void http_conn::query_done(async_query *q)
+{
+    http_conn *conn = (http_conn *)q->arg;
+    if (conn->m_query_conn_id != conn->m_conn_id || conn->m_sockfd == -1)
+    {
+        conn->m_db_state.store(DB_NONE, std::memory_order_release);
+        return;
+    }
+    conn->m_db_state.store(DB_DONE, std::memory_order_release);
+    m_resume(conn);
+}
+
+// Cookie里带了会话号并且会话表里有这个会话、还没过期，一次无锁查找
+bool http_conn::logged_in()
+{
+    return m_has_session && sessions.check(m_session_id);
+}
+
 // 回应客户端的请求
 http_conn::HTTP_CODE http_conn::do_request()
 {
@@ -543,31 +825,21 @@ http_conn::HTTP_CODE http_conn::do_request()
         // 用户注册
         if (*(p + 1) == '3')
         {
-            // 准备好mysql语句
-            char *sql_insert = (char *)malloc(sizeof(char) * 200);
-            strcpy(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-            strcat(sql_insert, "'");
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");
-
-            // 先检测数据库中是否有重名的
-            // 表中没有，进行注册，将数据写入到数据库中
-            if (users.find(name) == users.end())
+            // 缓存模式下users里没有的用户存储里也可能有，要先查一下
+            // 然后在users中占下这个用户名，重名的注册只有一个能成功
+            // 占到了再写入存储（MySQL后端和其他注册一起攒批），写失败就把用户名还回去
+            if (!users.contains(name) && (users_complete || load_user(m_store, name) == 0) && users.insert(name, password))
             {
-
-                m_lock.lock(); // 向数据库中插入数据时，需要通过锁来同步数据
-
-                int res = mysql_query(mysql, sql_insert);           // 执行sql语句，成功返回0
-                users.insert(pair<string, string>(name, password)); // 同时更新users那个map容器
-
-                m_lock.unlock();
+                int res = m_store->insert(name, password); // 写入完成后返回，成功返回0
 
                 if (!res)
                     strcpy(m_url, "/log.html"); // 注册成功跳转到登录界面
                 else
+                {
+                    LOG_WARN("register %s failed: %d", name, res);
+                    users.erase(name);
                     strcpy(m_url, "/registerError.html"); // 注册失败跳转到注册失败界面
+                }
             }
             else
                 strcpy(m_url, "/registerError.html"); // 注册失败跳转到注册失败界面
@@ -576,8 +848,46 @@ http_conn::HTTP_CODE http_conn::do_request()
         // 用户登录
         else if (*(p + 1) == '2')
         {
-            if (users.find(name) != users.end() && users[name] == password)
+            int ok = users.check(name, password);
+            if (ok < 0 && !users_complete) // 缓存没命中，按用户名查存储
+            {
+                if (m_db_state.load(std::memory_order_relaxed) == DB_DONE) // 异步查询的结果回来了
+                {
+                    m_store->remember(name, m_query.status, m_query.value);
+                    if (m_query.status > 0)
+                    {
+                        users.insert(name, m_query.value);
+                        ok = strcmp(m_query.value, password) == 0;
+                    }
+                    else if (m_query.status < 0)
+                        LOG_ERROR("find user %s failed", name);
+                }
+                else if (m_async_db && m_db_state.load(std::memory_order_acquire) == DB_NONE && strlen(name) < MAX_NAME_LEN)
+                {
+                    char passwd[MAX_NAME_LEN];
+                    int found = m_store->peek(name, passwd, sizeof(passwd)); // 存储的结果缓存里有结论就不用查库
+                    if (found < 0)
+                        return find_user_async(name); // 不占着工作线程等数据库，结果回来后重新处理这个请求
+                    if (found > 0)
+                    {
+                        users.insert(name, passwd);
+                        ok = strcmp(passwd, password) == 0;
+                    }
+                }
+                else if (load_user(m_store, name) > 0)
+                    ok = users.check(name, password);
+            }
+
+            if (ok > 0)
+            {
                 strcpy(m_url, "/welcome.html"); // 登录成功跳转到登录成功界面
+
+                session_table::session_id id; // 新建会话，之后的请求带着会话号就不用再登录
+                if (sessions.create(name, id))
+                    session_table::format(id, m_set_cookie);
+                else
+                    LOG_WARN("no session for %s, session table is full", name);
+            }
             else
                 strcpy(m_url, "/logError.html"); // 登录失败跳转到登录失败界面
         }
@@ -605,6 +915,10 @@ http_conn::HTTP_CODE http_conn::do_request()
         // m_read_file = "/home/lfc/cpp_project/tiny_webserver/root/log.html"
     }
 
+    // 图片、视频、关注页面要先登录，没有有效的会话号时跳转到登录页面
+    else if ((*(p + 1) == '5' || *(p + 1) == '6' || *(p + 1) == '7') && m_require_session && !logged_in())
+        strcpy(m_real_file + len, "/log.html");
+
     // 显示图片页面，POST
     else if (*(p + 1) == '5')
     {
@@ -704,6 +1018,7 @@ bool http_conn::write()
             }
 
             // 其它情况属于异常，取消内存映射，准备关闭连接
+            log_access();
             unmap();
             return false;
         }
@@ -734,7 +1049,8 @@ bool http_conn::write()
         // 判断条件，数据已全部发送完
         if (bytes_to_send <= 0)
         {
-            unmap(); // 取消内存映射
+            log_access(); // 响应发送完了，记一条访问日志
+            unmap();      // 取消内存映射
 
             modfd(m_epollfd, m_sockfd, EPOLLIN); // 重置浏览器连接描述符m_sockfd上的监听事件为EPOLLIN
 
@@ -775,15 +1091,13 @@ bool http_conn::add_response(const char *format, ...)
 
     va_end(arg_list); // 清空可变参列表
 
-    LOG_INFO("request:%s", m_write_buf);
-    Log::get_instance()->flush();
-
     return true;
 }
 
 // 添加状态行：http/1.1 状态码 状态消息
 bool http_conn::add_status_line(int status, const char *title)
 {
+    m_status = status; // 访问日志要用
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
@@ -794,7 +1108,8 @@ bool http_conn::add_headers(int content_len)
 {
     add_content_length(content_len);
     add_linger();
-    add_blank_line(); // 空在这边添加的哦
+    add_set_cookie();
+    return add_blank_line(); // 空在这边添加的哦
 }
 
 // 添加Content-Length，表示响应报文的长度
@@ -817,6 +1132,14 @@ bool http_conn::add_linger()
     //return add_response("Connection:%s\r\n", "close");
 }
 
+// 登录成功时下发会话号，HttpOnly不让页面脚本读到，不设过期时间，有效期由服务器端的会话表决定
+bool http_conn::add_set_cookie()
+{
+    if (!m_set_cookie[0])
+        return true;
+    return add_response("Set-Cookie:sid=%s; Path=/; HttpOnly\r\n", m_set_cookie);
+}
+
 // 添加空行
 bool http_conn::add_blank_line()
 {
@@ -922,11 +1245,26 @@ bool http_conn::process_write(HTTP_CODE ret)
 void http_conn::process()
 {
     // 接收请求数据
-    HTTP_CODE read_ret = process_read();
+    m_process_us = now_us();
+    HTTP_CODE read_ret;
+    if (m_db_state.load(std::memory_order_acquire) == DB_DONE) // 异步查询回来了，请求早已解析完，接着处理
+    {
+        read_ret = do_request();
+        m_db_state.store(DB_NONE, std::memory_order_relaxed);
+    }
+    else
+        read_ret = process_read();
+
+    // PENDING_REQUEST，表示在等异步查询，查询完成后主线程会把请求重新交给线程池，这期间不监听这个连接
+    if (read_ret == PENDING_REQUEST)
+        return;
 
     // NO_REQUEST，表示请求不完整，需要继续接收请求数据
     if (read_ret == NO_REQUEST)
     {
+        // 回到读请求头或读消息体阶段，超时时间仍从该阶段开始的时间算起
+        m_phase.store(m_check_state == CHECK_STATE_CONTENT ? PHASE_BODY : PHASE_HEADER, std::memory_order_release);
+
         // 注册并监听读事件
         modfd(m_epollfd, m_sockfd, EPOLLIN);
         return;
@@ -934,11 +1272,21 @@ void http_conn::process()
 
     // 调用process_write完成报文响应
     bool write_ret = process_write(read_ret);
-    if (!write_ret)
+    if (!write_ret) // 响应报文写不下，连接直接关闭，也要留一条访问日志
     {
+        if (!m_status)
+            m_status = 500;
+        m_respond_us = now_us();
+        log_access();
         close_conn();
+        return;
     }
 
+    // 进入发送响应阶段，开始按最低发送速度计算超时
+    m_respond_us = now_us();
+    m_write_start_ms = m_respond_us / 1000;
+    m_phase.store(PHASE_WRITE, std::memory_order_release);
+
     // 注册并监听写事件
     modfd(m_epollfd, m_sockfd, EPOLLOUT);
 }
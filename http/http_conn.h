@@ -19,8 +19,12 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#include <atomic>
 #include "../lock/locker.h"
 #include "../CGImysql/sql_connection_pool.h"
+#include "../CGImysql/async_mysql.h"
+#include "../store/user_store.h"
+#include "session_table.h"
 
 class http_conn
 {
@@ -28,6 +32,7 @@ public:
     static const int FILENAME_LEN = 200;       // 设置读取文件的名称m_real_file大小
     static const int READ_BUFFER_SIZE = 2048;  // 设置读缓冲区m_read_buf大小
     static const int WRITE_BUFFER_SIZE = 1024; // 设置写缓冲区m_write_buf大小
+    static const int ACCESS_PATH_LEN = 128;    // 访问日志中记录的请求路径的最大长度，超出的截断，保证每条访问日志不超过约300字节
 
     enum METHOD // 报文的请求方法，本项目只用到GET和POST
     {
@@ -51,7 +56,8 @@ public:
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR, // 服务器内部错误，该结果在主状态机逻辑switch的default下，一般不会触发
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        PENDING_REQUEST // 请求在等待异步数据库查询的结果，查询完成后再接着处理
     };
 
     enum CHECK_STATE // 主状态机的状态
@@ -68,10 +74,46 @@ public:
         LINE_OPEN    // 读取的行不完整
     };
 
+    enum REQUEST_CLASS // 请求类别，不同类别的请求交给不同的工作线程池处理
+    {
+        STATIC_REQUEST = 0, // 静态文件请求，只消耗CPU和磁盘
+        DB_REQUEST          // 登录/注册请求，需要访问数据库
+    };
+
+    enum CONN_PHASE // 连接当前所处的阶段，不同阶段使用不同的超时时间
+    {
+        PHASE_IDLE = 0, // 长连接空闲，等待下一个请求的第一个字节
+        PHASE_HEADER,   // 正在读取请求行和请求头
+        PHASE_BODY,     // 请求头已读完，正在读取消息体
+        PHASE_PROCESS,  // 请求在线程池中排队或正在处理
+        PHASE_WRITE     // 正在发送响应报文
+    };
+
+    enum DB_STATE // 异步数据库查询的状态
+    {
+        DB_NONE = 0, // 没有查询
+        DB_PENDING,  // 查询已提交，还没有结果
+        DB_DONE      // 结果已经回来，等待工作线程接着处理请求
+    };
+
+    // 各阶段的超时设置，单位毫秒
+    struct timeout_config
+    {
+        int header_ms;     // 从请求的第一个字节到达开始，读完请求头的期限
+        int body_ms;       // 从请求头读完开始，读完消息体的期限
+        int idle_ms;       // 长连接两个请求之间最多空闲多久
+        int send_grace_ms; // 开始发送响应后的宽限时间
+        int min_send_rate; // 宽限时间之后响应发送速度的下限，单位字节/秒，0表示不限制
+    };
+
 public:
     static int m_epollfd;    // 存放的就是主线程里的那个epollfd
     static int m_user_count; // 计算http连接用户数量
-    MYSQL *mysql;            // 存放分配给当前http_conn对象的mysql连接
+    static user_store *m_store;         // 用户名和密码的存储后端，缓存没命中和注册时访问
+    static timeout_config m_timeout;    // 各阶段的超时设置，所有连接共用
+    static async_mysql *m_async_db;     // 登录时按用户名查数据库用的非阻塞客户端，为NULL时阻塞查询
+    static void (*m_resume)(http_conn *conn); // 异步查询完成后在主线程中调用，把请求重新交给线程池
+    static bool m_require_session;      // 图片、视频、关注页面是否要先登录
 
 private:
     int m_sockfd;          // 存放当前连接的socket文件描述符
@@ -105,8 +147,35 @@ private:
     int bytes_to_send;       // 剩余发送字节数
     int bytes_have_send;     // 已发送字节数
 
+    // 以下为按阶段计算超时时间用到的变量，时间都是CLOCK_MONOTONIC的毫秒数
+    // m_phase由主线程和工作线程交替修改，其余时间戳在修改m_phase之前写好，读的一方先读m_phase再读时间戳
+    std::atomic<int> m_phase;     // 连接当前所处的阶段
+    long long m_request_start_ms; // 当前请求第一个字节到达的时间
+    long long m_body_start_ms;    // 当前请求的请求头读完的时间
+    long long m_write_start_ms;   // 当前响应开始发送的时间
+
+    // 以下为访问日志用到的变量，时间都是CLOCK_MONOTONIC的微秒数
+    char m_access_path[ACCESS_PATH_LEN]; // 请求路径，do_request会改写m_url，所以解析请求行时先复制一份
+    int m_status;                        // 响应状态码
+    long long m_start_us;                // 请求第一个字节到达的时间
+    long long m_dispatch_us;             // 主线程最后一次把请求交给线程池的时间
+    long long m_process_us;              // 工作线程开始处理的时间
+    long long m_respond_us;              // 响应报文准备好、开始发送的时间
+
+    // 以下为异步数据库查询用到的变量
+    // 连接在查询期间可能被关闭，fd还可能被新连接复用，用m_conn_id区分查询结果是不是当前连接的
+    async_query m_query;          // 正在进行的查询，结果回来之前不能复用
+    std::atomic<int> m_db_state;  // 查询的状态，工作线程提交查询，主线程写入结果
+    unsigned m_conn_id;           // 每次接受新连接时加一，只在主线程中修改
+    unsigned m_query_conn_id;     // 提交查询时的m_conn_id
+
+    // 以下为登录会话用到的变量
+    session_table::session_id m_session_id;      // 请求的Cookie里带的会话号
+    bool m_has_session;                          // 请求的Cookie里是否带了会话号
+    char m_set_cookie[session_table::ID_LEN + 1]; // 登录成功时新建的会话号，响应时用Set-Cookie交给浏览器，为空表示不下发
+
 public:
-    http_conn() {}
+    http_conn() : m_db_state(DB_NONE), m_conn_id(0), m_query_conn_id(0) {}
     ~http_conn() {}
 
     void init(int sockfd, const sockaddr_in &addr);   // 初始化新接受的连接
@@ -117,10 +186,28 @@ public:
     bool read_once(); // 非阻塞读操作
     bool write();     // 非阻塞写操作
 
-    void initmysql_result(connection_pool *connPool); // 初始化数据库读取表
+    REQUEST_CLASS classify(); // 解析已读到的请求行，判断请求类别
+
+    void on_dispatch(); // 主线程把请求交给线程池前调用
+    long long deadline(long long last_active);                                      // 按连接当前所处的阶段计算超时时间
+    void log_rejected(int status, int sent);                                        // 主线程直接拒绝请求时写访问日志
+
+    void initmysql_result(user_store *store, size_t cache_size, bool warm_up); // 初始化用户表，cache_size为0时全部读入内存
+    static void stop_warm_up();                                                // 等后台预热线程停下，关闭存储之前调用
+
+    // 读取用户表的统计：缓存的用户数、上次读取以来没命中去查存储的次数、累计淘汰数、注册写入存储的批数和写入的用户数
+    static void get_user_stats(int &cached, long long &misses, long long &evictions, long long &register_batches, long long &registered);
+
+    static void init_sessions(size_t max_sessions, int ttl_s); // 初始化会话表，最多同时max_sessions个会话，ttl_s秒不访问就过期
+    static int sweep_sessions(size_t budget);                  // 清理最多budget个桶里过期的会话，由定时器调用，返回清理掉的个数
+
+    // 读取会话表的统计：当前会话数，上次读取以来新建、校验通过、校验不通过和过期清理的会话数
+    static void get_session_stats(int &active, long long &created, long long &hits, long long &misses, long long &expired);
 
 private:
-    void init(); // 初始化新接受的连接后，再对一些private成员进行初始化
+    void init();          // 初始化新接受的连接后，再对一些private成员进行初始化
+    void start_request(); // 读到新请求的第一个字节时进入读请求头阶段
+    void log_access();    // 响应发送完（或者发送失败）时写一条访问日志
 
     HTTP_CODE process_read();          // 解析HTTP请求
     bool process_write(HTTP_CODE ret); // 填充HTTP应答
@@ -129,6 +216,10 @@ private:
     HTTP_CODE parse_headers(char *text);      // 解析请求头
     HTTP_CODE parse_content(char *text);      // 解析消息体
     HTTP_CODE do_request();                   // 处理请求
+    HTTP_CODE find_user_async(const char *name); // 提交按用户名查密码的异步查询
+    bool logged_in();                            // 请求是否带着有效的会话号
+
+    static void query_done(async_query *q); // 异步查询完成后在主线程中调用
 
     // 获取一行数据
     char *get_line()
@@ -147,6 +238,7 @@ private:
     bool add_content_type();                             // 向m_write_buf中写入响应报文的Content-Type
     bool add_content_length(int content_length);         // 向m_write_buf中写入响应报文的Content-Length
     bool add_linger();                                   // 向m_write_buf中写入响应报文的Connection
+    bool add_set_cookie();                               // 登录成功时向m_write_buf中写入Set-Cookie
     bool add_blank_line();                               // 向m_write_buf中写入空行
 };
 
@@ -0,0 +1,376 @@
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "../lock/locker.h"
+#include "../lock/epoch.h"
+#include "../lock/clock.h"
+
+/****************************************************************************************/
+/* 登录会话表：登录成功时生成一个随机的会话号，通过Cookie交给浏览器，之后的请求带着它就不用再登录 */
+/*   会话号是128位的随机数，本身就是均匀分布的，直接用高位选分片、低位选桶，不用再算哈希值          */
+/*   按会话号的高位分成若干个分片，每个分片一把写锁；分片内是拉链的哈希表，桶数在init时定好不变     */
+/* 查找完全无锁（RCU风格），一次查找就是一次桶定位加上链表上的几次比较：                           */
+/*   写者把新会话挂到桶头时用release语义发布，读者用acquire语义读指针                              */
+/*   过期的会话从链表上摘下来之后交给epoch_domain，等没有读者之后再释放                            */
+/* 会话在有效期内被访问时续期（滑动过期），剩余时间不到一半时才改写过期时间，避免每次都写          */
+/* 过期的会话由sweep分批清理，定时器每次只扫一部分桶，不会因为会话多而卡住主线程                    */
+/****************************************************************************************/
+
+class session_table
+{
+public:
+    static const int ID_LEN = 32; // 会话号的十六进制长度，不含'\0'
+
+    // 会话号，128位随机数
+    struct session_id
+    {
+        uint64_t hi;
+        uint64_t lo;
+    };
+
+private:
+    static const int SHARD_BITS = 6;
+    static const int SHARDS = 1 << SHARD_BITS;
+    static const size_t COLLECT_BATCH = 64; // 每攒够这么多待释放的会话回收一次
+
+    // 一个会话，用户名紧跟在结构体后面，一次分配
+    struct session
+    {
+        session_id id;
+        std::atomic<long long> expires_ms; // 过期时间，续期时由读者改写
+        std::atomic<session *> next;       // 同一个桶里的下一个会话
+        char name[1];                      // 登录的用户名
+    };
+
+    // 一个分片，独占cache line，避免不同分片的写锁之间伪共享
+    struct alignas(64) shard
+    {
+        std::atomic<session *> *buckets; // 桶数组，读者无锁读取
+        size_t count;                    // 会话数，由lock保护
+        locker lock;                     // 写锁
+    };
+
+    // 查找的统计，每个分片一份，独占cache line，读者之间不争抢同一个计数器
+    struct alignas(64) counters
+    {
+        std::atomic<long long> hits;
+        std::atomic<long long> misses;
+    };
+
+    shard m_shards[SHARDS];
+    counters m_counters[SHARDS];
+    size_t m_bucket_mask;      // 每个分片的桶数-1，桶数是2的幂
+    size_t m_shard_capacity;   // 每个分片最多存多少个会话
+    long long m_ttl_ms;        // 会话多久不访问就过期
+    size_t m_sweep_pos;        // 下一次清理从哪个桶开始，按分片*桶数+桶编号计，只由调用sweep的线程访问
+    std::atomic<size_t> m_size;
+    std::atomic<long long> m_created;
+    std::atomic<long long> m_expired;
+    epoch_domain m_epoch;      // 回收过期的会话
+
+    static void free_session(void *p)
+    {
+        delete[] (char *)p;
+    }
+
+    // 把摘下来的会话交给m_epoch，攒够一批就回收一次
+    void retire(session *s)
+    {
+        m_epoch.retire(s, free_session);
+        if (m_epoch.retired_count() >= COLLECT_BATCH)
+            m_epoch.collect();
+    }
+
+    shard &shard_of(const session_id &id)
+    {
+        return m_shards[id.hi >> (64 - SHARD_BITS)];
+    }
+
+    std::atomic<session *> &bucket_of(shard &s, const session_id &id)
+    {
+        return s.buckets[id.hi & m_bucket_mask];
+    }
+
+    // 从内核取随机数生成会话号，会话号不能被猜到，不能用rand
+    static bool random_id(session_id &id)
+    {
+        size_t got = 0;
+        while (got < sizeof(id))
+        {
+            ssize_t n = getrandom((char *)&id + got, sizeof(id) - got, 0);
+            if (n > 0)
+                got += n;
+            else if (n < 0 && errno == ENOSYS) // 内核太旧时读/dev/urandom
+                break;
+            else if (n < 0 && errno != EINTR)
+                return false;
+        }
+        if (got == sizeof(id))
+            return true;
+
+        int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        bool ok = read(fd, &id, sizeof(id)) == (ssize_t)sizeof(id);
+        close(fd);
+        return ok;
+    }
+
+    static int hex_value(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    // 在一个桶里查找会话号，写者和读者共用
+    static session *probe(std::atomic<session *> &bucket, const session_id &id)
+    {
+        for (session *s = bucket.load(std::memory_order_acquire); s; s = s->next.load(std::memory_order_acquire))
+            if (s->id.hi == id.hi && s->id.lo == id.lo)
+                return s;
+        return NULL;
+    }
+
+public:
+    session_table() : m_bucket_mask(0), m_shard_capacity(0), m_ttl_ms(0), m_sweep_pos(0), m_size(0), m_created(0), m_expired(0)
+    {
+        for (int i = 0; i < SHARDS; ++i)
+        {
+            m_shards[i].buckets = NULL;
+            m_shards[i].count = 0;
+            m_counters[i].hits.store(0, std::memory_order_relaxed);
+            m_counters[i].misses.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // 析构时不能再有读者
+    ~session_table()
+    {
+        for (int i = 0; i < SHARDS; ++i)
+        {
+            if (!m_shards[i].buckets)
+                continue;
+            for (size_t j = 0; j <= m_bucket_mask; ++j)
+            {
+                session *s = m_shards[i].buckets[j].load(std::memory_order_relaxed);
+                while (s)
+                {
+                    session *next = s->next.load(std::memory_order_relaxed);
+                    free_session(s);
+                    s = next;
+                }
+            }
+            delete[] m_shards[i].buckets;
+        }
+    }
+
+    // 最多同时存max_sessions个会话，ttl_s秒不访问就过期；在使用之前调用一次
+    // 桶数不少于会话数，平均每个桶不到一个会话
+    void init(size_t max_sessions, int ttl_s)
+    {
+        m_ttl_ms = (long long)ttl_s * 1000;
+        m_shard_capacity = (max_sessions + SHARDS - 1) / SHARDS;
+
+        size_t buckets = 1;
+        while (buckets < m_shard_capacity)
+            buckets <<= 1;
+        m_bucket_mask = buckets - 1;
+        for (int i = 0; i < SHARDS; ++i)
+        {
+            m_shards[i].buckets = new std::atomic<session *>[buckets];
+            for (size_t j = 0; j < buckets; ++j)
+                m_shards[i].buckets[j].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    // 为name新建一个会话，会话号存到id中；会话表满了或者取不到随机数时返回false
+    bool create(const char *name, session_id &id)
+    {
+        if (!m_shards[0].buckets || !random_id(id))
+            return false;
+
+        size_t name_len = strlen(name);
+        session *s = (session *)new char[sizeof(session) + name_len];
+        s->id = id;
+        s->expires_ms.store(now_ms(CLOCK_MONOTONIC_COARSE) + m_ttl_ms, std::memory_order_relaxed);
+        memcpy(s->name, name, name_len + 1);
+
+        shard &sh = shard_of(id);
+        sh.lock.lock();
+        if (sh.count >= m_shard_capacity)
+        {
+            sh.lock.unlock();
+            free_session(s);
+            return false;
+        }
+        std::atomic<session *> &bucket = bucket_of(sh, id);
+        s->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        bucket.store(s, std::memory_order_release); // 会话写好之后再挂到桶头，读者才能看到
+        ++sh.count;
+        sh.lock.unlock();
+
+        m_size.fetch_add(1, std::memory_order_relaxed);
+        m_created.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 无锁检查会话是否有效，有效时顺便续期
+    bool check(const session_id &id)
+    {
+        shard &sh = shard_of(id);
+        counters &c = m_counters[&sh - m_shards];
+        if (!sh.buckets)
+            return false;
+
+        epoch_guard guard(m_epoch);
+        session *s = probe(bucket_of(sh, id), id);
+        bool valid = false;
+        if (s)
+        {
+            long long now = now_ms(CLOCK_MONOTONIC_COARSE);
+            long long expires = s->expires_ms.load(std::memory_order_relaxed);
+            valid = expires > now;
+            if (valid && expires - now < m_ttl_ms / 2) // 剩余时间不到一半才续期，避免读者之间争抢cache line
+                s->expires_ms.store(now + m_ttl_ms, std::memory_order_relaxed);
+        }
+        (valid ? c.hits : c.misses).fetch_add(1, std::memory_order_relaxed);
+        return valid;
+    }
+
+    // 删除一个会话（比如退出登录），不存在时返回false
+    bool erase(const session_id &id)
+    {
+        shard &sh = shard_of(id);
+        if (!sh.buckets)
+            return false;
+
+        sh.lock.lock();
+        std::atomic<session *> *link = &bucket_of(sh, id);
+        session *s;
+        while ((s = link->load(std::memory_order_relaxed)) && (s->id.hi != id.hi || s->id.lo != id.lo))
+            link = &s->next;
+        if (s)
+        {
+            link->store(s->next.load(std::memory_order_relaxed), std::memory_order_release);
+            --sh.count;
+            m_size.fetch_sub(1, std::memory_order_relaxed);
+            retire(s);
+        }
+        sh.lock.unlock();
+        return s != NULL;
+    }
+
+    // 清理最多budget个桶里过期的会话，从上次停下的地方接着扫，返回清理掉的会话数
+    // 只能在一个线程里调用（定时器）；正在读被摘下的会话的读者不受影响
+    int sweep(size_t budget)
+    {
+        if (!m_shards[0].buckets)
+            return 0;
+
+        size_t buckets = m_bucket_mask + 1;
+        size_t total = buckets * SHARDS;
+        if (budget > total)
+            budget = total;
+        long long now = now_ms(CLOCK_MONOTONIC_COARSE);
+        int removed = 0;
+
+        while (budget)
+        {
+            shard &sh = m_shards[m_sweep_pos / buckets];
+            size_t first = m_sweep_pos % buckets;
+            size_t n = buckets - first < budget ? buckets - first : budget; // 每次持锁只扫一个分片里的桶
+
+            sh.lock.lock();
+            for (size_t i = first; i < first + n; ++i)
+            {
+                std::atomic<session *> *link = &sh.buckets[i];
+                session *s;
+                while ((s = link->load(std::memory_order_relaxed)))
+                {
+                    if (s->expires_ms.load(std::memory_order_relaxed) > now)
+                    {
+                        link = &s->next;
+                        continue;
+                    }
+                    link->store(s->next.load(std::memory_order_relaxed), std::memory_order_release); // 摘下来之后它的next不变，正在读它的读者还能往后走
+                    --sh.count;
+                    retire(s);
+                    ++removed;
+                }
+            }
+            sh.lock.unlock();
+
+            budget -= n;
+            m_sweep_pos = (m_sweep_pos + n) % total;
+        }
+
+        if (removed)
+        {
+            m_size.fetch_sub(removed, std::memory_order_relaxed);
+            m_expired.fetch_add(removed, std::memory_order_relaxed);
+        }
+        return removed;
+    }
+
+    // 当前的会话数（含已过期还没清理的）
+    size_t size()
+    {
+        return m_size.load(std::memory_order_relaxed);
+    }
+
+    // 读取并清零新建、命中、没命中和过期清理的会话数
+    void get_stats(long long &created, long long &hits, long long &misses, long long &expired)
+    {
+        created = m_created.exchange(0, std::memory_order_relaxed);
+        expired = m_expired.exchange(0, std::memory_order_relaxed);
+        hits = misses = 0;
+        for (int i = 0; i < SHARDS; ++i)
+        {
+            hits += m_counters[i].hits.exchange(0, std::memory_order_relaxed);
+            misses += m_counters[i].misses.exchange(0, std::memory_order_relaxed);
+        }
+    }
+
+    // 会话号和Cookie里的十六进制字符串互转，text至少ID_LEN+1字节
+    static void format(const session_id &id, char *text)
+    {
+        static const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < 16; ++i)
+        {
+            text[i] = digits[(id.hi >> (60 - 4 * i)) & 0xf];
+            text[16 + i] = digits[(id.lo >> (60 - 4 * i)) & 0xf];
+        }
+        text[ID_LEN] = '\0';
+    }
+
+    // 从text开头解析ID_LEN个十六进制字符，格式不对时返回false
+    static bool parse(const char *text, session_id &id)
+    {
+        id.hi = id.lo = 0;
+        for (int i = 0; i < ID_LEN; ++i)
+        {
+            int v = hex_value(text[i]);
+            if (v < 0)
+                return false;
+            uint64_t &part = i < 16 ? id.hi : id.lo;
+            part = part << 4 | v;
+        }
+        return true;
+    }
+};
+
+#endif
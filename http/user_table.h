@@ -0,0 +1,364 @@
+#ifndef USER_TABLE_H
+#define USER_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../lock/locker.h"
+#include "../lock/epoch.h"
+
+/****************************************************************************************/
+/* 分片的开放寻址哈希表，存放用户名和密码，代替全局的map<string, string>                        */
+/*   按哈希值的高位分成若干个分片，每个分片一把写锁，注册只和同一分片的注册竞争                      */
+/*   分片内是线性探测的开放寻址表，槽位里直接存哈希值和记录指针，16字节一个，一个cache line放4个，   */
+/*   查找时先比哈希值，基本只有命中的那一次才会去读记录里的字符串                                  */
+/* 查找完全无锁（RCU风格）：                                                                 */
+/*   写者先写好记录和槽位里的哈希值，再用release语义发布记录指针，读者用acquire语义读指针          */
+/*   表扩容时写者复制出一张两倍大的新表再整体发布，正在读旧表的读者不受影响                         */
+/*   被替换下来的旧表和被删除、淘汰的记录交给epoch_domain，等没有读者之后再释放                    */
+/* 删除用墓碑标记，查找时跳过，插入时复用，扩容时丢弃                                             */
+/* 可以设置容量上限当作缓存用：分片满了之后按CLOCK算法淘汰，命中过的记录会多留一轮                  */
+/****************************************************************************************/
+
+class user_table
+{
+private:
+    static const size_t CACHELINE_SIZE = 64;
+    static const size_t MIN_CAPACITY = 16; // 每个分片最少的槽位数
+    static const int MAX_LOAD = 70;        // 装载率超过70%（含墓碑）就扩容
+    static const size_t COLLECT_BATCH = 64; // 每攒够这么多待释放的对象回收一次
+
+    // 一个用户的记录，写入后不再修改；用户名和密码紧跟在结构体后面，一次分配
+    struct record
+    {
+        uint64_t hash;                // 用户名的哈希值，扩容时不用重新计算
+        const char *passwd;           // 密码
+        std::atomic<bool> referenced; // CLOCK淘汰用的访问位，命中时置位
+        char name[1];                 // 用户名，后面紧跟着密码
+    };
+
+    // 开放寻址表的一个槽位
+    struct slot
+    {
+        std::atomic<uint64_t> hash; // 记录的哈希值，先于rec写入
+        std::atomic<record *> rec;  // 为NULL表示空槽位，为墓碑表示已删除
+    };
+
+    // 一个分片当前使用的表
+    struct table
+    {
+        size_t mask;    // 槽位数-1，槽位数是2的幂
+        slot *slots;    // 槽位数组
+    };
+
+    // 一个分片，独占cache line，避免不同分片的写锁和表指针之间伪共享
+    struct alignas(CACHELINE_SIZE) shard
+    {
+        std::atomic<table *> tab; // 当前的表，读者无锁读取
+        size_t used;              // 被占用的槽位数（含墓碑），由lock保护
+        size_t count;             // 用户数，由lock保护
+        size_t hand;              // CLOCK淘汰的指针，由lock保护
+        locker lock;              // 写锁
+    };
+
+    shard *m_shards;
+    int m_shard_bits;           // 分片数的二进制位数
+    size_t m_shard_capacity;    // 每个分片最多存多少个用户，0表示不限
+    std::atomic<size_t> m_size;
+    std::atomic<long long> m_evictions; // 累计淘汰的记录数
+    epoch_domain m_epoch;       // 回收旧表和记录
+
+    static record *tombstone()
+    {
+        static record dead; // 墓碑，不会和任何用户名相等
+        return &dead;
+    }
+
+    static void free_record(void *p)
+    {
+        delete[] (char *)p;
+    }
+
+    static void free_table(void *p)
+    {
+        delete[] ((table *)p)->slots;
+        delete (table *)p;
+    }
+
+    // 把摘下来的对象交给m_epoch，攒够一批就回收一次
+    void retire(void *p, void (*free_fn)(void *))
+    {
+        m_epoch.retire(p, free_fn);
+        if (m_epoch.retired_count() >= COLLECT_BATCH)
+            m_epoch.collect();
+    }
+
+    // FNV-1a，用户名都很短，够用了
+    static uint64_t hash_of(const char *name)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (; *name; ++name)
+        {
+            h ^= (unsigned char)*name;
+            h *= 1099511628211ULL;
+        }
+        h ^= h >> 29; // FNV的低位分布不够均匀，混合一下，低位用来选槽位
+        return h;
+    }
+
+    shard &shard_of(uint64_t hash)
+    {
+        return m_shards[m_shard_bits ? hash >> (64 - m_shard_bits) : 0];
+    }
+
+    static table *new_table(size_t capacity)
+    {
+        table *t = new table;
+        t->mask = capacity - 1;
+        t->slots = new slot[capacity];
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            t->slots[i].hash.store(0, std::memory_order_relaxed);
+            t->slots[i].rec.store(NULL, std::memory_order_relaxed);
+        }
+        return t;
+    }
+
+    // 把分片的表换成capacity个槽位的新表，丢弃墓碑，调用者需持有写锁
+    void rebuild(shard &s, size_t capacity)
+    {
+        table *old = s.tab.load(std::memory_order_relaxed);
+        table *t = new_table(capacity);
+        for (size_t i = 0; i <= old->mask; ++i)
+        {
+            record *r = old->slots[i].rec.load(std::memory_order_relaxed);
+            if (!r || r == tombstone())
+                continue;
+            size_t j = r->hash & t->mask;
+            while (t->slots[j].rec.load(std::memory_order_relaxed))
+                j = (j + 1) & t->mask;
+            t->slots[j].hash.store(r->hash, std::memory_order_relaxed);
+            t->slots[j].rec.store(r, std::memory_order_relaxed);
+        }
+        s.tab.store(t, std::memory_order_release); // 新表填好之后再整体发布
+        s.used = s.count;
+        s.hand = 0;
+        retire(old, free_table);
+    }
+
+    // CLOCK淘汰一个记录：访问位为1的清零后跳过，遇到为0的淘汰，调用者需持有写锁
+    void evict_one(shard &s)
+    {
+        table *t = s.tab.load(std::memory_order_relaxed);
+        for (;; s.hand = (s.hand + 1) & t->mask)
+        {
+            slot &sl = t->slots[s.hand];
+            record *r = sl.rec.load(std::memory_order_relaxed);
+            if (!r || r == tombstone())
+                continue;
+            if (r->referenced.load(std::memory_order_relaxed))
+            {
+                r->referenced.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            sl.rec.store(tombstone(), std::memory_order_release);
+            --s.count;
+            m_size.fetch_sub(1, std::memory_order_relaxed);
+            m_evictions.fetch_add(1, std::memory_order_relaxed);
+            retire(r, free_record);
+            return;
+        }
+    }
+
+    // 在表中查找name，找到返回记录并把槽位存到where中，找不到返回NULL；写者和读者共用
+    static record *probe(table *t, uint64_t hash, const char *name, slot **where = NULL)
+    {
+        for (size_t i = hash & t->mask;; i = (i + 1) & t->mask)
+        {
+            record *r = t->slots[i].rec.load(std::memory_order_acquire);
+            if (!r)
+                return NULL;
+            if (t->slots[i].hash.load(std::memory_order_relaxed) == hash && r != tombstone() && strcmp(r->name, name) == 0)
+            {
+                if (where)
+                    *where = &t->slots[i];
+                return r;
+            }
+        }
+    }
+
+public:
+    // 分片数为2^shard_bits
+    user_table(int shard_bits = 6) : m_shard_bits(shard_bits), m_shard_capacity(0), m_size(0), m_evictions(0)
+    {
+        m_shards = new shard[(size_t)1 << shard_bits];
+        for (size_t i = 0; i < ((size_t)1 << shard_bits); ++i)
+        {
+            m_shards[i].tab.store(new_table(MIN_CAPACITY), std::memory_order_relaxed);
+            m_shards[i].used = 0;
+            m_shards[i].count = 0;
+            m_shards[i].hand = 0;
+        }
+    }
+
+    // 析构时不能再有读者
+    ~user_table()
+    {
+        for (size_t i = 0; i < ((size_t)1 << m_shard_bits); ++i)
+        {
+            shard &s = m_shards[i];
+            table *t = s.tab.load(std::memory_order_relaxed);
+            for (size_t j = 0; j <= t->mask; ++j)
+            {
+                record *r = t->slots[j].rec.load(std::memory_order_relaxed);
+                if (r && r != tombstone())
+                    free_record(r);
+            }
+            free_table(t);
+        }
+        delete[] m_shards;
+    }
+
+    // 设置最多存多少个用户，超过后按CLOCK淘汰，0表示不限；在开始使用之前调用
+    // 不预先分配，表随着用户数增长，到上限之后就不再变大
+    void set_capacity(size_t max_users)
+    {
+        m_shard_capacity = max_users ? (max_users >> m_shard_bits) + 1 : 0;
+    }
+
+    // 设置了容量上限并且已经存满了
+    bool full()
+    {
+        return m_shard_capacity && size() >= (m_shard_capacity - 1) << m_shard_bits;
+    }
+
+    // 预先按用户数扩容，批量加载之前调用，避免加载过程中反复扩容
+    void reserve(size_t n)
+    {
+        size_t per_shard = (n >> m_shard_bits) + 1;
+        size_t capacity = MIN_CAPACITY;
+        while (capacity * MAX_LOAD / 100 < per_shard)
+            capacity <<= 1;
+
+        for (size_t i = 0; i < ((size_t)1 << m_shard_bits); ++i)
+        {
+            shard &s = m_shards[i];
+            s.lock.lock();
+            if (s.tab.load(std::memory_order_relaxed)->mask + 1 < capacity)
+                rebuild(s, capacity);
+            s.lock.unlock();
+        }
+    }
+
+    // 插入一个用户，用户名已存在时返回false；检查和插入在同一把锁里完成，同名注册只有一个能成功
+    // 设置了容量上限时，分片满了会先淘汰一个记录
+    bool insert(const char *name, const char *passwd)
+    {
+        uint64_t hash = hash_of(name);
+        shard &s = shard_of(hash);
+        s.lock.lock();
+
+        table *t = s.tab.load(std::memory_order_relaxed);
+        if (probe(t, hash, name))
+        {
+            s.lock.unlock();
+            return false;
+        }
+        if (m_shard_capacity && s.count >= m_shard_capacity)
+            evict_one(s);
+        if ((s.used + 1) * 100 > (t->mask + 1) * MAX_LOAD)
+        {
+            rebuild(s, s.count * 100 / MAX_LOAD >= (t->mask + 1) / 2 ? (t->mask + 1) * 2 : t->mask + 1); // 墓碑多时原地重建
+            t = s.tab.load(std::memory_order_relaxed);
+        }
+
+        size_t name_len = strlen(name), passwd_len = strlen(passwd);
+        record *r = (record *)new char[sizeof(record) + name_len + passwd_len + 1];
+        r->hash = hash;
+        r->referenced.store(true, std::memory_order_relaxed); // 新记录至少能撑过一轮淘汰
+        memcpy(r->name, name, name_len + 1);
+        memcpy(r->name + name_len + 1, passwd, passwd_len + 1);
+        r->passwd = r->name + name_len + 1;
+
+        // 找第一个空槽位或墓碑，前面已经确认用户名不存在了
+        size_t i = hash & t->mask;
+        record *cur;
+        while ((cur = t->slots[i].rec.load(std::memory_order_relaxed)) && cur != tombstone())
+            i = (i + 1) & t->mask;
+        if (!cur)
+            ++s.used;
+        t->slots[i].hash.store(hash, std::memory_order_relaxed);
+        t->slots[i].rec.store(r, std::memory_order_release); // 发布之后读者才能看到这条记录
+        ++s.count;
+        m_size.fetch_add(1, std::memory_order_relaxed);
+
+        s.lock.unlock();
+        return true;
+    }
+
+    // 删除一个用户，不存在时返回false；正在读这条记录的读者不受影响，没有读者之后才释放
+    bool erase(const char *name)
+    {
+        uint64_t hash = hash_of(name);
+        shard &s = shard_of(hash);
+        s.lock.lock();
+        slot *p = NULL;
+        record *r = probe(s.tab.load(std::memory_order_relaxed), hash, name, &p);
+        if (r)
+        {
+            p->rec.store(tombstone(), std::memory_order_release);
+            --s.count;
+            m_size.fetch_sub(1, std::memory_order_relaxed);
+            retire(r, free_record);
+        }
+        s.lock.unlock();
+        return r != NULL;
+    }
+
+    // 无锁查找，找到时把密码复制到passwd中（可以为NULL），返回是否找到
+    bool find(const char *name, char *passwd = NULL, size_t len = 0)
+    {
+        uint64_t hash = hash_of(name);
+        epoch_guard guard(m_epoch);
+        record *r = probe(shard_of(hash).tab.load(std::memory_order_acquire), hash, name);
+        if (!r)
+            return false;
+        if (!r->referenced.load(std::memory_order_relaxed)) // 已经置位时不写，避免读者之间争抢cache line
+            r->referenced.store(true, std::memory_order_relaxed);
+        if (passwd && len)
+            snprintf(passwd, len, "%s", r->passwd);
+        return true;
+    }
+
+    bool contains(const char *name)
+    {
+        return find(name);
+    }
+
+    // 无锁校验用户名和密码，返回1表示正确，0表示密码错误，-1表示没有这个用户
+    int check(const char *name, const char *passwd)
+    {
+        uint64_t hash = hash_of(name);
+        epoch_guard guard(m_epoch);
+        record *r = probe(shard_of(hash).tab.load(std::memory_order_acquire), hash, name);
+        if (!r)
+            return -1;
+        if (!r->referenced.load(std::memory_order_relaxed))
+            r->referenced.store(true, std::memory_order_relaxed);
+        return strcmp(r->passwd, passwd) == 0;
+    }
+
+    size_t size()
+    {
+        return m_size.load(std::memory_order_relaxed);
+    }
+
+    long long evictions()
+    {
+        return m_evictions.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <time.h>
+
+/****************************************************************************************/
+/* 取当前时间的公共函数，各模块不再各自定义                                                   */
+/*   默认用CLOCK_MONOTONIC：单调递增，不受修改系统时间影响，时间轮、超时和耗时统计都用它           */
+/*   只需要时钟节拍精度的热路径（会话和缓存的过期、日志限流、连接的空闲时间）传CLOCK_MONOTONIC_COARSE， */
+/*   走vdso只读一个变量，比精确时钟便宜；两者的起点相同，可以互相比较，但粗粒度的会晚一个节拍以内   */
+/*   统计线程占用的CPU时间传CLOCK_THREAD_CPUTIME_ID                                           */
+/****************************************************************************************/
+
+// 时钟clk的当前时间，单位毫秒
+inline long long now_ms(clockid_t clk = CLOCK_MONOTONIC)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 时钟clk的当前时间，单位微秒
+inline long long now_us(clockid_t clk = CLOCK_MONOTONIC)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <stdint.h>
+#include "locker.h"
+#include "thread_id.h"
+
+/****************************************************************************************/
+/* 基于纪元的内存回收（epoch-based reclamation），给无锁读的数据结构安全地释放内存                 */
+/*   读者在访问共享指针前后调用enter()/leave()，进入时把当前纪元登记在自己线程的槽位上             */
+/*   写者把摘下来的对象交给retire()，记下当时的纪元；collect()推进纪元，                          */
+/*   只释放比所有正在读的线程登记的纪元都早的对象，这些对象不可能还有读者持有                       */
+/* 读者的开销是一次store加一次内存屏障，写的都是本线程独占的cache line，读者之间没有竞争           */
+/* 线程槽位按thread_id.h的线程编号索引，线程结束时归还，线程池伸缩不会耗尽槽位                      */
+/****************************************************************************************/
+
+class epoch_domain
+{
+public:
+    static const int MAX_THREADS = thread_id::MAX_THREADS; // 同时存在的读者线程数上限
+
+private:
+    static const size_t CACHELINE_SIZE = 64;
+
+    // 一个线程的登记槽位，0表示不在读
+    struct alignas(CACHELINE_SIZE) reader_slot
+    {
+        std::atomic<uint64_t> active;
+        int depth; // 嵌套进入的层数，只有本线程访问
+    };
+
+    // 等待释放的对象
+    struct retired
+    {
+        void *ptr;
+        void (*free_fn)(void *);
+        uint64_t epoch;
+        retired *next;
+    };
+
+    reader_slot m_slots[MAX_THREADS];
+    std::atomic<uint64_t> m_epoch; // 当前纪元，从1开始
+    locker m_lock;                 // 保护回收链表
+    retired *m_retired;
+    size_t m_retired_count;
+
+public:
+    epoch_domain() : m_epoch(1), m_retired(NULL), m_retired_count(0)
+    {
+        for (int i = 0; i < MAX_THREADS; ++i)
+        {
+            m_slots[i].active.store(0, std::memory_order_relaxed);
+            m_slots[i].depth = 0;
+        }
+    }
+
+    // 析构时不能再有读者，剩下的对象全部释放
+    ~epoch_domain()
+    {
+        while (m_retired)
+        {
+            retired *next = m_retired->next;
+            m_retired->free_fn(m_retired->ptr);
+            delete m_retired;
+            m_retired = next;
+        }
+    }
+
+    void enter()
+    {
+        reader_slot &s = m_slots[thread_id::get()];
+        if (s.depth++)
+            return;
+        s.active.store(m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst); // 登记对写者可见之后才能读共享指针
+    }
+
+    void leave()
+    {
+        reader_slot &s = m_slots[thread_id::get()];
+        if (--s.depth)
+            return;
+        s.active.store(0, std::memory_order_release);
+    }
+
+    // 对象已经从数据结构上摘下来之后调用，等没有读者之后用free_fn释放
+    void retire(void *ptr, void (*free_fn)(void *))
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        retired *r = new retired;
+        r->ptr = ptr;
+        r->free_fn = free_fn;
+        r->epoch = m_epoch.load(std::memory_order_relaxed);
+
+        m_lock.lock();
+        r->next = m_retired;
+        m_retired = r;
+        ++m_retired_count;
+        m_lock.unlock();
+    }
+
+    // 推进纪元并释放已经没有读者的对象，返回还没能释放的对象数
+    size_t collect()
+    {
+        m_epoch.fetch_add(1, std::memory_order_seq_cst);
+        uint64_t min_epoch = UINT64_MAX;
+        int n = thread_id::limit(); // 编号在登记之前就已经分配，没分配过的槽位不会有读者
+        for (int i = 0; i < n; ++i)
+        {
+            uint64_t e = m_slots[i].active.load(std::memory_order_seq_cst);
+            if (e && e < min_epoch)
+                min_epoch = e;
+        }
+
+        m_lock.lock();
+        retired *free_list = NULL;
+        for (retired **p = &m_retired; *p;)
+        {
+            if ((*p)->epoch < min_epoch)
+            {
+                retired *r = *p;
+                *p = r->next;
+                r->next = free_list;
+                free_list = r;
+                --m_retired_count;
+            }
+            else
+                p = &(*p)->next;
+        }
+        size_t left = m_retired_count;
+        m_lock.unlock();
+
+        while (free_list) // 在锁外释放
+        {
+            retired *next = free_list->next;
+            free_list->free_fn(free_list->ptr);
+            delete free_list;
+            free_list = next;
+        }
+        return left;
+    }
+
+    size_t retired_count()
+    {
+        m_lock.lock();
+        size_t n = m_retired_count;
+        m_lock.unlock();
+        return n;
+    }
+};
+
+// 读者的RAII封装，作用域内可以安全地访问共享指针
+class epoch_guard
+{
+public:
+    epoch_guard(epoch_domain &domain) : m_domain(domain)
+    {
+        m_domain.enter();
+    }
+    ~epoch_guard()
+    {
+        m_domain.leave();
+    }
+
+private:
+    epoch_domain &m_domain;
+};
+
+#endif
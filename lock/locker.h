@@ -4,6 +4,7 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 
 // 封装信号量的类
 class sem 
@@ -39,6 +40,27 @@ public:
         return sem_wait(&m_sem) == 0; // 返回0表示没出错
     }
 
+    // 非阻塞地尝试等待信号量，信号量为0时立即返回false
+    bool trywait()
+    {
+        return sem_trywait(&m_sem) == 0; // 返回0表示没出错
+    }
+
+    // 等待信号量，最多等待ms_timeout毫秒，超时返回false
+    bool timewait(int ms_timeout)
+    {
+        struct timespec t = {0, 0};
+        clock_gettime(CLOCK_REALTIME, &t); // sem_timedwait使用的是CLOCK_REALTIME的绝对时间
+        t.tv_sec += ms_timeout / 1000;
+        t.tv_nsec += (long)(ms_timeout % 1000) * 1000000;
+        if (t.tv_nsec >= 1000000000)
+        {
+            t.tv_sec += 1;
+            t.tv_nsec -= 1000000000;
+        }
+        return sem_timedwait(&m_sem, &t) == 0; // 返回0表示没出错
+    }
+
     // 封装sem_post增加信号量的值
     bool post()
     {
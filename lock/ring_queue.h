@@ -0,0 +1,233 @@
+#ifndef RING_QUEUE_H
+#define RING_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <utility>
+#include "locker.h"
+
+/****************************************************************************************/
+/* 无锁有界多生产者多消费者(MPMC)环形队列，思路来自Dmitry Vyukov的bounded MPMC queue            */
+/* 每个槽位带一个序号seq：                                                                  */
+/*   seq == pos       表示该槽位空闲，可以被位置为pos的生产者写入                               */
+/*   seq == pos + 1   表示该槽位已写入数据，可以被位置为pos的消费者读取                          */
+/* 生产者/消费者只需用CAS抢占入队/出队位置，不需要互斥锁。                                       */
+/* 入队位置和出队位置分别放在独立的cache line上，避免生产者和消费者之间的伪共享。                   */
+/*                                                                                      */
+/* 阻塞版本通过两个信号量记录「空闲槽位数」和「可取元素数」，glibc的信号量在无竞争时只是一次原子操作 */
+/* 只有真正需要睡眠/唤醒时才会陷入内核。                                                      */
+/****************************************************************************************/
+
+template <class T>
+class ring_queue
+{
+private:
+    static const size_t CACHELINE_SIZE = 64;
+
+    // 环形数组中的一个槽位
+    struct cell
+    {
+        std::atomic<size_t> seq; // 槽位序号，用来判断槽位当前是否可写/可读
+        T data;                  // 槽位中存放的元素
+    };
+
+    alignas(CACHELINE_SIZE) std::atomic<size_t> m_enqueue_pos; // 下一个入队位置，独占一个cache line
+    alignas(CACHELINE_SIZE) std::atomic<size_t> m_dequeue_pos; // 下一个出队位置，独占一个cache line
+    alignas(CACHELINE_SIZE) cell *m_cells;                     // 环形数组，大小为2的幂
+    size_t m_mask;                                             // 环形数组大小-1，用位与代替取模
+    int m_max_size;                                            // 队列中最多存放的元素个数
+
+    sem m_slots; // 空闲槽位数，生产者在入队前先获取
+    sem m_items; // 可取元素数，消费者在出队前先获取
+
+    // 忙等待时让出CPU，避免在某个慢速生产者/消费者上空转太久
+    static void relax(int &spins)
+    {
+        if (++spins > 64)
+        {
+            sched_yield();
+            spins = 0;
+        }
+    }
+
+    // 无锁入队，队列满时返回false
+    bool do_push(const T &item)
+    {
+        cell *c;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) // 槽位空闲，尝试抢占入队位置
+            {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0) // 槽位上一轮的数据还没被取走，队列满
+            {
+                return false;
+            }
+            else // 入队位置被其他生产者抢走了，重新读取
+            {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = item;
+        c->seq.store(pos + 1, std::memory_order_release); // 发布数据，消费者可以读取了
+        return true;
+    }
+
+    // 无锁出队，队列空时返回false
+    bool do_pop(T &item)
+    {
+        cell *c;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) // 槽位有数据，尝试抢占出队位置
+            {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0) // 槽位还没被写入，队列空
+            {
+                return false;
+            }
+            else // 出队位置被其他消费者抢走了，重新读取
+            {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(c->data);
+        c->seq.store(pos + m_mask + 1, std::memory_order_release); // 槽位留给下一轮的生产者
+        return true;
+    }
+
+    // 已经拿到m_slots后入队，保证一定有空槽，只可能短暂等待慢速消费者读完
+    void push_reserved(const T &item)
+    {
+        int spins = 0;
+        while (!do_push(item))
+            relax(spins);
+        m_items.post();
+    }
+
+    // 已经拿到m_items后出队，保证一定有元素，只可能短暂等待慢速生产者写完
+    void pop_reserved(T &item)
+    {
+        int spins = 0;
+        while (!do_pop(item))
+            relax(spins);
+        m_slots.post();
+    }
+
+public:
+    // max_size为队列中最多存放的元素个数，环形数组大小会向上取整到2的幂
+    ring_queue(int max_size = 1000) : m_slots(max_size), m_items(0)
+    {
+        if (max_size <= 0)
+            throw std::exception();
+
+        size_t capacity = 2;
+        while (capacity < (size_t)max_size)
+            capacity <<= 1;
+
+        m_cells = new cell[capacity];
+        for (size_t i = 0; i < capacity; ++i)
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+
+        m_mask = capacity - 1;
+        m_max_size = max_size;
+        m_enqueue_pos.store(0, std::memory_order_relaxed);
+        m_dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    ~ring_queue()
+    {
+        delete[] m_cells;
+    }
+
+    // 非阻塞入队，队列满时立即返回false
+    bool try_push(const T &item)
+    {
+        if (!m_slots.trywait())
+            return false;
+        push_reserved(item);
+        return true;
+    }
+
+    // 阻塞入队，队列满时等待消费者取走元素
+    bool push(const T &item)
+    {
+        while (!m_slots.wait())
+        {
+            if (errno != EINTR) // 被信号打断就继续等
+                return false;
+        }
+        push_reserved(item);
+        return true;
+    }
+
+    // 非阻塞出队，队列空时立即返回false
+    bool try_pop(T &item)
+    {
+        if (!m_items.trywait())
+            return false;
+        pop_reserved(item);
+        return true;
+    }
+
+    // 阻塞出队，队列空时等待生产者放入元素
+    bool pop(T &item)
+    {
+        while (!m_items.wait())
+        {
+            if (errno != EINTR) // 被信号打断就继续等
+                return false;
+        }
+        pop_reserved(item);
+        return true;
+    }
+
+    // 带超时的阻塞出队，超过ms_timeout毫秒仍没有元素则返回false
+    bool pop(T &item, int ms_timeout)
+    {
+        if (!m_items.timewait(ms_timeout))
+            return false;
+        pop_reserved(item);
+        return true;
+    }
+
+    // 队列中当前元素个数（并发情况下只是一个近似值）
+    int size()
+    {
+        size_t enq = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t deq = m_dequeue_pos.load(std::memory_order_relaxed);
+        return enq > deq ? (int)(enq - deq) : 0;
+    }
+
+    int max_size()
+    {
+        return m_max_size;
+    }
+
+    bool full()
+    {
+        return size() >= m_max_size;
+    }
+
+    bool empty()
+    {
+        return size() == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef THREAD_ID_H
+#define THREAD_ID_H
+
+#include <atomic>
+#include <sched.h>
+
+/****************************************************************************************/
+/* 进程内线程的小整数编号，用来索引按线程分配的槽位（每线程一个cache line，互相不竞争）         */
+/*   线程第一次调用get()时分配，线程结束时归还，线程池伸缩不会耗尽编号                          */
+/*   同时存在的线程超过MAX_THREADS时，新线程等其他线程结束                                    */
+/****************************************************************************************/
+
+class thread_id
+{
+public:
+    static const int MAX_THREADS = 1024; // 同时存在的线程数上限
+
+private:
+    static std::atomic<bool> *used()
+    {
+        static std::atomic<bool> slots[MAX_THREADS];
+        return slots;
+    }
+
+    struct holder
+    {
+        int id;
+        holder()
+        {
+            for (id = 0;; id = (id + 1) % MAX_THREADS) // 编号用完时等其他线程结束
+            {
+                bool expected = false;
+                if (!used()[id].load(std::memory_order_relaxed) && used()[id].compare_exchange_strong(expected, true))
+                    break;
+                if (id == MAX_THREADS - 1)
+                    sched_yield();
+            }
+
+            int hi = high().load(std::memory_order_relaxed);
+            while (id >= hi && !high().compare_exchange_weak(hi, id + 1))
+                ;
+        }
+        ~holder()
+        {
+            used()[id].store(false, std::memory_order_release);
+        }
+    };
+
+    static std::atomic<int> &high()
+    {
+        static std::atomic<int> h(0);
+        return h;
+    }
+
+public:
+    // 当前线程的编号，0 <= id < MAX_THREADS
+    static int get()
+    {
+        static thread_local holder h;
+        return h.id;
+    }
+
+    // 分配过的最大编号加一，遍历所有线程的槽位时只需要看[0, limit())
+    static int limit()
+    {
+        return high().load(std::memory_order_acquire);
+    }
+};
+
+#endif
@@ -3,168 +3,644 @@
 #include <sys/time.h>
 #include <stdarg.h>
 #include "log.h"
+#include "../lock/clock.h"
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
 using namespace std;
 
+std::atomic<int> Log::m_level(LOG_MIN_LEVEL); // 运行期级别默认和编译期级别一致
+
+// 日志级别对应的标签，下标就是write_log的level参数
+static const char *level_tag[] = {"[debug]:", "[info]:", "[warn]:", "[erro]:"};
+
+// 每个线程缓存当前这一秒的「年-月-日 时:分:秒.」前缀，同一秒内的日志只需要重新填写微秒，不用每行都调用localtime
+static __thread time_t t_last_sec = 0;
+static __thread struct tm t_last_tm;
+static __thread char t_time_prefix[32];
+static __thread int t_time_prefix_len = 0;
+
+// 当前线程领取的异步日志槽位
+static __thread log_slot *t_slot = NULL;
+
+// 刷新策略和报告被压制条数使用的时钟；同步模式下每条日志都要读，用粗粒度的时钟就够了
+static const clockid_t LOG_CLOCK = CLOCK_MONOTONIC_COARSE;
+
+// 秒数变了才重新计算缓存的时间
+static void update_time_cache(time_t sec)
+{
+    if (sec == t_last_sec && t_time_prefix_len != 0)
+        return;
+    t_last_sec = sec;
+    localtime_r(&t_last_sec, &t_last_tm);
+    t_time_prefix_len = snprintf(t_time_prefix, sizeof(t_time_prefix), "%d-%02d-%02d %02d:%02d:%02d.",
+                                 t_last_tm.tm_year + 1900, t_last_tm.tm_mon + 1, t_last_tm.tm_mday,
+                                 t_last_tm.tm_hour, t_last_tm.tm_min, t_last_tm.tm_sec);
+}
+
+// 当前时间，切分日志文件时用
+static void current_tm(struct tm &my_tm)
+{
+    update_time_cache(time(NULL));
+    my_tm = t_last_tm;
+}
+
+// 写入时间前缀"2024-01-01 12:00:00.123456"，返回写入的字节数
+static int format_time(char *buf)
+{
+    struct timeval now = {0, 0};
+    gettimeofday(&now, NULL);
+    update_time_cache(now.tv_sec);
+
+    int n = t_time_prefix_len;
+    memcpy(buf, t_time_prefix, n);
+    long usec = now.tv_usec;
+    for (int i = n + 5; i >= n; --i) // 微秒固定写6位
+    {
+        buf[i] = '0' + usec % 10;
+        usec /= 10;
+    }
+    return n + 6;
+}
+
 /* 构造函数 */
-Log::Log()
+Log::Log() : m_slot_count(0), m_stop(false), m_dropped(0), m_flush_seq(0), m_format_count(0)
 {
-    m_count = 0;
+    m_split_bytes = 64 << 20;
     m_is_async = false;
+    m_buf = NULL;
+    m_flush_interval_ms = 1000; // 默认每秒刷新一次
+    m_flush_bytes = 1 << 16;    // 或者攒够64KB刷新一次
+    m_flush_level = 3;          // ERROR日志立即刷新
+    m_unflushed = 0;
+    m_last_flush_ms = 0;
+    m_flushed_seq = 0;
+    m_written_formats = 0;
+    m_dropped_format = -1;
+    memset(m_limits, '\0', sizeof(m_limits)); // 默认不采样也不限流
+    m_site_rule_count = 0;
+    m_sites = NULL;
+    m_last_report_ms = 0;
+    m_suppressed_format = -1;
+
+    struct timespec res = {0, 0};
+    clock_getres(CLOCK_MONOTONIC_COARSE, &res);
+    m_coarse_ns = (long long)res.tv_sec * 1000000000 + res.tv_nsec;
+    for (int i = 0; i < MAX_SLOTS; ++i)
+    {
+        m_slots[i].state.store(SLOT_FREE, std::memory_order_relaxed);
+        m_slots[i].ring = NULL;
+        m_slots[i].line = NULL;
+    }
 }
 
 /* 析构函数 */
 Log::~Log()
 {
-    if (m_fp != NULL)
+    if (m_is_async) // 让后台写线程写完所有剩余日志后退出
     {
-        fclose(m_fp);
+        m_stop = true;
+        m_wakeup.post();
+        pthread_join(m_writer, NULL);
     }
+    // 槽位的缓冲区不释放：进程退出时可能还有线程持有槽位，由操作系统回收
+    struct tm my_tm;
+    current_tm(my_tm);
+    m_mutex.lock();
+    report_suppressed(my_tm, true); // 退出前把还没报告的被压制条数写进去
+    maybe_flush(true);
+    m_file.close(); // 截掉当前段没用完的预分配空间，这个段不压缩
+    m_mutex.unlock();
 }
 
-//异步需要设置阻塞队列的长度，同步不需要设置
-bool Log::init(const char *file_name, int log_buf_size, int split_lines, int max_queue_size)
+void Log::set_level(int level)
 {
-    //如果设置了max_queue_size,则设置为异步
-    if (max_queue_size >= 1)
-    {
-        m_is_async = true;
-        m_log_queue = new block_queue<string>(max_queue_size);
-        pthread_t tid;
-        //flush_log_thread为回调函数,这里表示创建线程异步写日志
-        pthread_create(&tid, NULL, flush_log_thread, NULL);
-    }
+    if (level < LOG_MIN_LEVEL) // 编译期已经去掉的级别打开了也没用
+        level = LOG_MIN_LEVEL;
+    if (level > LOG_LEVEL_ERROR)
+        level = LOG_LEVEL_ERROR;
+    m_level.store(level, std::memory_order_relaxed);
+}
 
-    m_log_buf_size = log_buf_size;
+void Log::set_flush_policy(int interval_ms, int bytes, int level)
+{
+    m_flush_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    m_flush_bytes = bytes < 4096 ? 4096 : bytes;
+    m_flush_level = level;
+}
+
+//异步需要设置max_queue_size，同步不需要设置
+bool Log::init(const char *file_name, int log_buf_size, long long split_bytes, int max_queue_size, bool compress)
+{
+    m_log_buf_size = log_buf_size < 128 ? 128 : log_buf_size; // 至少要放得下时间和级别前缀
+    if (m_log_buf_size > 65535)                              // 二进制日志的记录长度只有16位
+        m_log_buf_size = 65535;
     m_buf = new char[m_log_buf_size];
     memset(m_buf, '\0', m_log_buf_size);
-    m_split_lines = split_lines;
+    m_split_bytes = split_bytes < MIN_SPLIT_BYTES ? MIN_SPLIT_BYTES : split_bytes;
 
-    time_t t = time(NULL); /* Return the current time and put it in *TIMER if TIMER is not NULL. */
-    struct tm *sys_tm = localtime(&t); /* Return the `struct tm' representation of *TIMER in the local timezone. */
-    struct tm my_tm = *sys_tm;
-
-    
     const char *p = strrchr(file_name, '/'); /* https://www.runoob.com/cprogramming/c-function-strrchr.html */
-    char log_full_name[256] = {0};
-
     if (p == NULL)
     {
-        /* https://www.runoob.com/cprogramming/c-function-snprintf.html */
-        snprintf(log_full_name, 255, "%d_%02d_%02d_%s", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, file_name);
+        dir_name[0] = '\0';
+        snprintf(log_name, sizeof(log_name), "%s", file_name);
     }
     else
     {
-        strcpy(log_name, p + 1);
-        strncpy(dir_name, file_name, p - file_name + 1);
-        snprintf(log_full_name, 255, "%s%d_%02d_%02d_%s", dir_name, my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, log_name);
+        snprintf(log_name, sizeof(log_name), "%s", p + 1);
+        snprintf(dir_name, sizeof(dir_name), "%.*s", (int)(p - file_name + 1), file_name);
     }
 
-    m_today = my_tm.tm_mday;
+#ifdef LOG_BINARY_MODE
+    m_dropped_format = register_format(LOG_LEVEL_WARN, "log buffer full, dropped %lld lines", __FILE__, __LINE__);
+    m_suppressed_format = register_format(LOG_LEVEL_WARN, "suppressed %lld lines at %s:%d", __FILE__, __LINE__);
+#endif
 
-    m_fp = fopen(log_full_name, "a");
-    if (m_fp == NULL)
+    m_last_flush_ms = now_ms(LOG_CLOCK);
+    m_last_report_ms = m_last_flush_ms;
+    if (!m_file.open(dir_name, log_name, m_split_bytes, compress))
     {
         return false;
     }
+    start_file();
+
+    // 崩溃时尽力把日志写出去，处理一次后恢复默认行为，重新触发信号产生core
+    struct sigaction sa;
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = crash_handler;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+    sigaction(SIGFPE, &sa, NULL);
+    sigaction(SIGILL, &sa, NULL);
+    sigaction(SIGABRT, &sa, NULL);
+
+    //如果设置了max_queue_size,则设置为异步，日志文件打开之后再启动后台写线程
+    if (max_queue_size >= 1)
+    {
+        if (pthread_key_create(&m_slot_key, release_slot) != 0)
+            return false;
+        //flush_log_thread为回调函数,这里表示创建线程异步写日志
+        if (pthread_create(&m_writer, NULL, flush_log_thread, NULL) != 0)
+            return false;
+        m_is_async = true;
+    }
+
+    return true;
+}
+
+// 格式化一行日志到buf中（以换行和'\0'结尾），返回不含'\0'的长度，超长的内容会被截断
+int Log::format_line(char *buf, int level, const char *format, va_list valst)
+{
+    int n = format_time(buf);
+    const char *s = (level >= 0 && level <= 3) ? level_tag[level] : level_tag[1];
+    buf[n++] = ' ';
+    int len = strlen(s);
+    memcpy(buf + n, s, len);
+    n += len;
+    buf[n++] = ' ';
+
+    int m = vsnprintf(buf + n, m_log_buf_size - n - 1, format, valst);
+    if (m < 0)
+        m = 0;
+    else if (m > m_log_buf_size - n - 2) // 被截断了，留出换行符的位置
+        m = m_log_buf_size - n - 2;
+    buf[n + m] = '\n';
+    buf[n + m + 1] = '\0';
+    return n + m + 1;
+}
+
+// 写入len字节前检查是否需要切分日志文件，日期变了按天切分，当前段放不下了按大小切分
+// 下一段在当前段用到一半时由log_file的后台线程准备好，切分只是换上新段，旧段的关闭和压缩也交给后台线程
+void Log::check_split(const struct tm &my_tm, size_t len)
+{
+#ifdef LOG_BINARY_MODE
+    // 新注册的格式记录会写在这块数据前面，也要放得下，否则记录被截断后整段都解码不了
+    int count = m_format_count.load(std::memory_order_acquire);
+    for (int i = m_written_formats; i < count; ++i)
+        len += LOG_RECORD_HEADER + 13 + strlen(m_formats[i].file) + strlen(m_formats[i].format);
+#endif
+    if (m_file.prepare(len, my_tm))
+    {
+        m_unflushed = 0; // 旧段已经关闭，剩下的由内核写回
+        start_file();
+    }
+}
+
+void Log::start_file()
+{
+#ifdef LOG_BINARY_MODE
+    // 每个二进制日志段都能单独解码：开头写文件标识，再把已注册的格式全部写一遍
+    m_file.append(LOG_BINARY_MAGIC, LOG_BINARY_MAGIC_LEN);
+    m_unflushed += LOG_BINARY_MAGIC_LEN;
+    m_written_formats = 0;
+    write_formats();
+#endif
+}
+
+void Log::write_formats()
+{
+    char buf[8192];
+    int count = m_format_count.load(std::memory_order_acquire);
+    for (; m_written_formats < count; ++m_written_formats)
+    {
+        const log_format &f = m_formats[m_written_formats];
+        int len = log_encode_format(buf, sizeof(buf), m_written_formats, f.level, f.file, f.line, f.format);
+        m_file.append(buf, len);
+        m_unflushed += len;
+    }
+}
+
+int Log::register_format(int level, const char *format, const char *file, int line)
+{
+    Log *log = get_instance();
+    log->m_format_mutex.lock();
+    int id = log->m_format_count.load(std::memory_order_relaxed);
+    if (id < MAX_FORMATS)
+    {
+        log_format &f = log->m_formats[id];
+        f.format = format;
+        f.file = file;
+        f.line = line;
+        f.level = level;
+        log->m_format_count.store(id + 1, std::memory_order_release); // 后台写线程看到个数时格式已经填好了
+    }
+    else // 调用点太多，这个调用点的日志解码时只能显示编号
+    {
+        id = -1;
+    }
+    log->m_format_mutex.unlock();
+    return id;
+}
+
+void Log::register_site(log_site *site)
+{
+    Log *log = get_instance();
+#ifdef LOG_BINARY_MODE
+    site->id = register_format(site->level, site->format, site->file, site->line);
+#endif
+    log->m_site_mutex.lock();
+    log->apply_limit(site);
+    site->next = log->m_sites;
+    log->m_sites = site;
+    log->m_site_mutex.unlock();
+}
+
+// 判断调用点所在的文件是否以rule_file结尾
+static bool match_file(const char *file, const char *rule_file)
+{
+    size_t n = strlen(file), m = strlen(rule_file);
+    return n >= m && strcmp(file + n - m, rule_file) == 0;
+}
+
+void Log::apply_limit(log_site *site)
+{
+    int level = (site->level >= 0 && site->level <= 3) ? site->level : 1;
+    log_limit limit = m_limits[level];
+    if (site->fixed_sample > 0)
+        limit.sample = site->fixed_sample;
+    else if (site->fixed_sample == LOG_NO_LIMIT)
+        limit.sample = limit.rate = limit.burst = 0;
+
+    // 后设置的规则优先
+    for (int i = m_site_rule_count - 1; i >= 0; --i)
+    {
+        const log_site_rule &rule = m_site_rules[i];
+        if ((rule.line == 0 || rule.line == site->line) && match_file(site->file, rule.file))
+        {
+            limit = rule.limit;
+            break;
+        }
+    }
+
+    long long interval = limit.rate > 0 ? 1000000000LL / limit.rate : 0;
+    long long burst = limit.burst > 0 ? limit.burst : limit.rate;
+    long long burst_ns = (burst - 1) * interval;
+    if (burst_ns < m_coarse_ns) // 时钟一次跳好几毫秒，容量太小的话实际速率会低于设定值
+        burst_ns = m_coarse_ns;
+
+    site->sample.store(limit.sample, std::memory_order_relaxed);
+    site->burst_ns.store(burst_ns, std::memory_order_relaxed);
+    site->interval_ns.store(interval, std::memory_order_relaxed);
+}
+
+void Log::set_limit(int level, int sample, int rate, int burst)
+{
+    if (level < 0 || level > 3)
+        return;
+    m_site_mutex.lock();
+    m_limits[level].sample = sample;
+    m_limits[level].rate = rate;
+    m_limits[level].burst = burst;
+    for (log_site *site = m_sites; site; site = site->next)
+    {
+        if (site->level == level)
+            apply_limit(site);
+    }
+    m_site_mutex.unlock();
+}
 
+bool Log::set_site_limit(const char *file, int line, int sample, int rate, int burst)
+{
+    m_site_mutex.lock();
+    if (m_site_rule_count >= MAX_SITE_RULES)
+    {
+        m_site_mutex.unlock();
+        return false;
+    }
+    log_site_rule &rule = m_site_rules[m_site_rule_count++];
+    snprintf(rule.file, sizeof(rule.file), "%s", file);
+    rule.line = line;
+    rule.limit.sample = sample;
+    rule.limit.rate = rate;
+    rule.limit.burst = burst;
+    for (log_site *site = m_sites; site; site = site->next)
+        apply_limit(site);
+    m_site_mutex.unlock();
     return true;
 }
 
+void Log::report_suppressed(const struct tm &my_tm, bool force)
+{
+    long long now = now_ms(LOG_CLOCK);
+    if (!force && now - m_last_report_ms < REPORT_INTERVAL_MS)
+        return;
+    m_last_report_ms = now;
+
+    char buf[512];
+    m_site_mutex.lock();
+    for (log_site *site = m_sites; site; site = site->next)
+    {
+        long long count = site->suppressed.exchange(0, std::memory_order_relaxed);
+        if (count == 0)
+            continue;
+#ifdef LOG_BINARY_MODE
+        int len = log_encode_message(buf, sizeof(buf), m_suppressed_format, count, site->file, site->line);
+#else
+        int n = format_time(buf);
+        int len = n + snprintf(buf + n, sizeof(buf) - n, " %s suppressed %lld lines at %s:%d\n", level_tag[2], count, site->file, site->line);
+        if (len >= (int)sizeof(buf))
+            len = sizeof(buf) - 1;
+#endif
+        write_record(my_tm, buf, len);
+    }
+    m_site_mutex.unlock();
+}
+
+void Log::write_record(const struct tm &my_tm, const char *buf, int len)
+{
+    check_split(my_tm, len);
+#ifdef LOG_BINARY_MODE
+    write_formats();
+#endif
+    m_file.append(buf, len);
+    m_unflushed += len;
+}
+
+void Log::maybe_flush(bool force)
+{
+    if (m_unflushed == 0)
+        return;
+    long long now = now_ms(LOG_CLOCK);
+    if (force || m_unflushed >= m_flush_bytes || now - m_last_flush_ms >= m_flush_interval_ms)
+    {
+        m_file.sync();
+        m_unflushed = 0;
+        m_last_flush_ms = now;
+    }
+}
+
 void Log::write_log(int level, const char *format, ...)
 {
-    struct timeval now = {0, 0};
-    gettimeofday(&now, NULL);
-    time_t t = now.tv_sec;
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
-    
-    char s[16] = {0};
-
-    switch (level)
-    {
-    case 0:
-        strcpy(s, "[debug]:");
-        break;
-    case 1:
-        strcpy(s, "[info]:");
-        break;
-    case 2:
-        strcpy(s, "[warn]:");
-        break;
-    case 3:
-        strcpy(s, "[erro]:");
-        break;
-    default:
-        strcpy(s, "[info]:");
-        break;
-    }
-    
-    //写入一个log，对m_count++, m_split_lines最大行数
+    va_list valst;
+    va_start(valst, format);
+
+    log_slot *slot = thread_slot();
+    if (slot) // 在自己的行缓冲区里格式化，再放进自己的环形缓冲区，不和其他线程竞争
+    {
+        int len = format_line(slot->line, level, format, valst);
+        va_end(valst);
+        push_line(slot, len, level);
+        return;
+    }
+
+    // 同步模式，或者槽位已经用完，直接写入文件
     m_mutex.lock();
-    m_count++;
-
-    if (m_today != my_tm.tm_mday || m_count % m_split_lines == 0) //everyday log
-    {
-        
-        char new_log[256] = {0};
-        fflush(m_fp);
-        fclose(m_fp);
-        char tail[16] = {0};
-       
-        snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
-       
-        if (m_today != my_tm.tm_mday)
+    int len = format_line(m_buf, level, format, valst);
+    write_locked(m_buf, len, level);
+    m_mutex.unlock();
+
+    va_end(valst);
+}
+
+void Log::write_locked(const char *buf, int len, int level)
+{
+    struct tm my_tm;
+    current_tm(my_tm);
+    report_suppressed(my_tm, false);
+    write_record(my_tm, buf, len); // 这条日志用到的格式可能是刚注册的，会先写入格式记录
+    maybe_flush(level >= m_flush_level);
+}
+
+log_slot *Log::thread_slot()
+{
+    if (!m_is_async)
+        return NULL;
+    return t_slot ? t_slot : acquire_slot();
+}
+
+void Log::push_line(log_slot *slot, int len, int level)
+{
+    size_t used;
+    size_t half = slot->ring->capacity() / 2;
+    int retry = 0;
+    while (!slot->ring->push(slot->line, len, used))
+    {
+        // 环形缓冲区满了，唤醒后台写线程并让出CPU等它取走数据，等了几次还是满的就丢掉这一行
+        if (++retry > FULL_RETRY)
         {
-            snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
-            m_today = my_tm.tm_mday;
-            m_count = 0;
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
         }
-        else
+        m_wakeup.post();
+        sched_yield();
+    }
+
+    if (used < half && used + len >= half) // 刚超过一半，唤醒后台写线程尽快取走
+        m_wakeup.post();
+    if (level >= m_flush_level) // 重要的日志等它落到内核里再返回
+        flush();
+}
+
+log_slot *Log::acquire_slot()
+{
+    for (int i = 0; i < MAX_SLOTS; ++i)
+    {
+        log_slot *slot = &m_slots[i];
+        int expected = SLOT_FREE;
+        if (!slot->state.compare_exchange_strong(expected, SLOT_CLAIMED))
+            continue;
+
+        if (!slot->ring) // 回收的槽位直接复用之前的缓冲区
         {
-            snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_split_lines);
+            slot->ring = new log_ring(RING_SIZE);
+            slot->line = new char[m_log_buf_size];
         }
-        m_fp = fopen(new_log, "a");
+
+        int count = m_slot_count.load();
+        while (count <= i && !m_slot_count.compare_exchange_weak(count, i + 1))
+            ;
+
+        slot->state.store(SLOT_ACTIVE, std::memory_order_release); // 缓冲区准备好了，后台写线程可以读取了
+        pthread_setspecific(m_slot_key, slot);
+        t_slot = slot;
+        return slot;
     }
- 
-    m_mutex.unlock();
+    return NULL;
+}
 
-    va_list valst;
-    va_start(valst, format);
+void Log::release_slot(void *slot)
+{
+    t_slot = NULL;
+    ((log_slot *)slot)->state.store(SLOT_RETIRED, std::memory_order_release);
+}
 
-    string log_str;
-    m_mutex.lock();
+void *Log::async_write_log()
+{
+    int wait_ms = m_flush_interval_ms < WRITE_INTERVAL_MS ? m_flush_interval_ms : WRITE_INTERVAL_MS;
+    while (!m_stop.load())
+    {
+        m_wakeup.timewait(wait_ms); // 定时醒来，或者被快写满、要求刷新的线程唤醒
 
-    //写入的具体时间内容格式
-    int n = snprintf(m_buf, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ",
-                     my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
-                     my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
-    
-    int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
-    m_buf[n + m] = '\n';
-    m_buf[n + m + 1] = '\0';
-    log_str = m_buf;
+        // 先记下刷新请求再写，保证请求之前放进环形缓冲区的日志都包含在这次刷新里
+        long long seq = m_flush_seq.load(std::memory_order_acquire);
+        write_pending(seq != m_flushed_seq);
+        if (seq != m_flushed_seq)
+        {
+            m_flush_mutex.lock();
+            m_flushed_seq = seq;
+            m_flush_cond.broadcast();
+            m_flush_mutex.unlock();
+        }
+    }
 
-    m_mutex.unlock();
+    write_pending(true); // 退出前写完剩余的日志并刷新
+    m_flush_mutex.lock();
+    m_flushed_seq = m_flush_seq.load();
+    m_flush_cond.broadcast();
+    m_flush_mutex.unlock();
+    return NULL;
+}
 
-    if (m_is_async && !m_log_queue->full())
+void Log::write_pending(bool force_flush)
+{
+    char buf[128];
+    struct tm my_tm;
+    current_tm(my_tm);
+
+    m_mutex.lock(); // 只和退化为同步写的线程竞争，一般没有竞争
+
+    long long dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
     {
-        m_log_queue->push(log_str);
+#ifdef LOG_BINARY_MODE
+        int len = log_encode_message(buf, sizeof(buf), m_dropped_format, dropped);
+#else
+        int n = format_time(buf);
+        int len = n + snprintf(buf + n, sizeof(buf) - n, " %s log buffer full, dropped %lld lines\n", level_tag[2], dropped);
+#endif
+        write_record(my_tm, buf, len);
     }
-    else
+    report_suppressed(my_tm, false);
+
+    int count = m_slot_count.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i)
     {
-        m_mutex.lock();
-        fputs(log_str.c_str(), m_fp);
-        m_mutex.unlock();
+        log_slot *slot = &m_slots[i];
+        int state = slot->state.load(std::memory_order_acquire);
+        if (state != SLOT_ACTIVE && state != SLOT_RETIRED)
+            continue;
+
+        const char *p1, *p2;
+        size_t n1, n2;
+        size_t len = slot->ring->peek(p1, n1, p2, n2);
+        if (len > 0)
+        {
+            // 一整块数据写进同一个段，写之前判断是否需要切分
+            check_split(my_tm, len);
+#ifdef LOG_BINARY_MODE
+            write_formats(); // 这些日志用到的格式一定已经注册了，先把新注册的格式写进去
+#endif
+
+            m_file.append(p1, n1);
+            if (n2)
+                m_file.append(p2, n2);
+            slot->ring->consume(len);
+            m_unflushed += len;
+        }
+
+        // 线程已经退出并且日志都写完了，槽位可以给新线程使用
+        if (state == SLOT_RETIRED && slot->ring->empty())
+            slot->state.store(SLOT_FREE, std::memory_order_release);
     }
 
-    va_end(valst);
+    maybe_flush(force_flush);
+    m_mutex.unlock();
 }
 
 void Log::flush(void)
 {
+    if (m_is_async) // 异步模式交给后台写线程，等它写完环形缓冲区中的日志并刷新后再返回
+    {
+        long long seq = m_flush_seq.fetch_add(1, std::memory_order_acq_rel) + 1;
+        m_wakeup.post();
+
+        m_flush_mutex.lock();
+        while (m_flushed_seq < seq && !m_stop.load())
+        {
+            struct timespec t = {0, 0};
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_sec += 1; // 防止后台写线程已经退出时一直等下去
+            m_flush_cond.timewait(m_flush_mutex.get(), t);
+        }
+        m_flush_mutex.unlock();
+        return;
+    }
+
     m_mutex.lock();
     //强制刷新写入流缓冲区
-    fflush(m_fp);
+    maybe_flush(true);
     m_mutex.unlock();
 }
+
+void Log::crash_flush(void)
+{
+    // 已经写进映射内存的日志在进程崩溃后仍然会由内核写回文件，只需要处理环形缓冲区里的
+    // 崩溃的线程可能正持有锁，这里一律不加锁，直接拷贝到当前段的映射内存里，最后截掉预分配的空白
+    int count = m_is_async ? m_slot_count.load() : 0;
+    for (int i = 0; i < count; ++i)
+    {
+        int state = m_slots[i].state.load();
+        if (state != SLOT_ACTIVE && state != SLOT_RETIRED)
+            continue;
+
+        const char *p1, *p2;
+        size_t n1, n2;
+        size_t len = m_slots[i].ring->peek(p1, n1, p2, n2);
+        if (len == 0)
+            continue;
+        m_file.append(p1, n1);
+        if (n2)
+            m_file.append(p2, n2);
+        m_slots[i].ring->consume(len);
+    }
+    m_file.truncate();
+}
+
+void Log::crash_handler(int sig)
+{
+    Log::get_instance()->crash_flush();
+    raise(sig); // 处理函数已经恢复为默认行为，重新触发信号
+}
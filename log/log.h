@@ -6,43 +6,218 @@
 #include <string>
 #include <stdarg.h>
 #include <pthread.h>
-#include "block_queue.h"
+#include <time.h>
+#include <atomic>
+#include "../lock/locker.h"
+#include "log_ring.h"
+#include "log_binary.h"
+#include "log_file.h"
 
 using namespace std;
 
+// 日志级别，也是write_log的level参数
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+// 编译期的最低日志级别，低于它的LOG_XXX宏展开为空，参数也不会被求值；编译时可以用-DLOG_MIN_LEVEL=2覆盖
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// 二进制日志模式：写日志时不做printf格式化，只记录格式编号、时间和参数的原始字节，日志文件用logdecode还原成文本
+// #define LOG_BINARY_MODE
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+//// 异步日志：每个写日志的线程第一次写日志时领取一个槽位，槽位里有它独占的行缓冲区和环形缓冲区     ////
+////   写日志的线程在自己的行缓冲区里格式化，再拷贝进自己的环形缓冲区，全程不加锁、不分配内存        ////
+////   后台写线程定期（或者被快写满的线程唤醒）把所有环形缓冲区里的数据成块地写入日志文件           ////
+////   线程退出时把槽位标记为待回收，后台写线程写完其中剩余的日志后槽位就可以给新线程使用            ////
+//// 刷新策略：写入的日志满足下面任意一个条件才让内核开始写回磁盘，不再每条日志刷一次：            ////
+////   距离上次刷新超过m_flush_interval_ms；未刷新的字节数达到m_flush_bytes；                       ////
+////   写了级别不低于m_flush_level的日志（默认ERROR），异步模式下会等后台写线程刷完才返回             ////
+////   进程正常退出时刷新；收到SIGSEGV等崩溃信号时尽力把缓冲区中的日志写出去                         ////
+//// 采样和限流：每个LOG_XXX调用点可以每N条只写1条，也可以用令牌桶限制每秒写多少条，                ////
+////   参数按级别设置默认值，也可以单独设置某个调用点；被压制的条数定期写进日志                      ////
+//// 日志文件按大小切分成预分配、映射到内存的段（见log_file.h），写文件只是memcpy，刷新是msync：    ////
+////   异步模式下切换文件只发生在后台写线程里，写日志的线程不会因为切换文件而被阻塞                  ////
+//// 不同线程的日志各自有序，线程之间按后台写线程取数据的顺序交错                                  ////
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+// 异步模式下一个写日志线程的槽位
+struct log_slot
+{
+    std::atomic<int> state;       // 槽位状态，见Log::SLOT_STATE
+    log_ring *ring;               // 该线程独占的环形缓冲区，槽位回收后留给下一个线程复用
+    char *line;                   // 该线程格式化单条日志用的行缓冲区
+};
+
+// 采样和限流参数
+struct log_limit
+{
+    int sample; // 每sample条只写1条，0和1表示不采样
+    int rate;   // 令牌桶每秒放入的令牌数，也就是每秒最多写多少条，0表示不限流
+    int burst;  // 令牌桶的容量，也就是允许突发写多少条，0表示和rate相同
+};
+
+// 单独设置某个调用点的采样和限流参数
+struct log_site_rule
+{
+    char file[64]; // 调用点所在文件的后缀，比如"http_conn.cpp"
+    int line;      // 调用点所在的行号，0表示这个文件里的所有调用点
+    log_limit limit;
+};
+
+// 一个日志调用点，是LOG_XXX宏里的局部静态变量，第一次执行时注册到Log
+// 写日志之前先用admit()判断要不要写，不写的只计数，由Log定期报告
+struct log_site
+{
+    const char *format;                // 格式串
+    const char *file;                  // 调用点所在的文件
+    int line;                          // 调用点所在的行号
+    int level;                         // 日志级别
+    int fixed_sample;                  // 调用点自己指定的采样间隔（LOG_SAMPLED），0表示使用级别的默认值，LOG_NO_LIMIT表示不采样也不限流
+    int id;                            // 二进制日志模式下的格式编号
+    std::atomic<int> sample;           // 生效的采样间隔
+    std::atomic<long long> interval_ns; // 生效的令牌间隔，0表示不限流
+    std::atomic<long long> burst_ns;   // 令牌桶的容量换算成的时间
+    std::atomic<long long> tat;        // 令牌桶：下一个令牌理论上的到达时间(GCRA)，只用一个原子变量实现
+    std::atomic<long long> hits;       // 采样计数
+    std::atomic<long long> suppressed; // 上次报告之后被压制的条数
+    log_site *next;                    // 已注册调用点的链表
+
+    log_site(int level, const char *format, const char *file, int line, int fixed = 0);
+
+    // 这条日志是否要写：先按采样间隔，再按令牌桶，都不需要加锁
+    bool admit()
+    {
+        int n = sample.load(std::memory_order_relaxed);
+        if (n > 1 && hits.fetch_add(1, std::memory_order_relaxed) % n != 0)
+        {
+            suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        long long interval = interval_ns.load(std::memory_order_relaxed);
+        if (interval <= 0)
+            return true;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // 粗粒度时钟走vdso，只需要几纳秒
+        long long now = (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        long long limit = burst_ns.load(std::memory_order_relaxed);
+        long long t = tat.load(std::memory_order_relaxed);
+        while (true)
+        {
+            long long start = t > now ? t : now;
+            if (start - now > limit) // 桶里没有令牌了
+            {
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (tat.compare_exchange_weak(t, start + interval, std::memory_order_relaxed))
+                return true;
+        }
+    }
+};
+
+// 二进制日志模式下注册的一个日志调用点
+struct log_format
+{
+    const char *format; // 格式串，必须是字符串常量
+    const char *file;   // 调用点所在的文件
+    int line;           // 调用点所在的行号
+    int level;          // 日志级别
+};
+
 // 日志类
 class Log
 {
 
 private:
+    enum SLOT_STATE // 槽位状态
+    {
+        SLOT_FREE = 0, // 空闲，可以被新线程领取
+        SLOT_CLAIMED,  // 已被某个线程领取，正在初始化缓冲区
+        SLOT_ACTIVE,   // 正在使用
+        SLOT_RETIRED   // 线程已退出，等后台写线程写完剩余日志后回收
+    };
+
+    static const int MAX_SLOTS = 256;            // 最多同时有多少个线程使用异步日志，超出的线程退化为同步写
+    static const size_t RING_SIZE = 1 << 18;     // 每个线程的环形缓冲区大小
+    static const int WRITE_INTERVAL_MS = 100;    // 后台写线程至少每隔多久写一次文件
+    static const int FULL_RETRY = 8;             // 环形缓冲区满时最多让出几次CPU等后台写线程，之后丢弃日志
+    static const long long MIN_SPLIT_BYTES = 1 << 22; // 日志段的最小大小，要放得下一整块环形缓冲区和二进制模式的格式记录
+    static const int MAX_FORMATS = 4096;         // 二进制日志模式下最多注册多少个调用点
+    static const int MAX_SITE_RULES = 64;        // 最多单独设置多少个调用点的采样和限流参数
+    static const int REPORT_INTERVAL_MS = 10000; // 每隔多久报告一次被压制的日志条数
+
     char dir_name[128];               // 路径名
     char log_name[128];               // log文件名
-    int m_split_lines;                // 日志最大行数
+    long long m_split_bytes;          // 每个日志段的大小
     int m_log_buf_size;               // 日志缓冲区大小
-    long long m_count;                // 日志行数记录
-    int m_today;                      // 因为按天分类,记录当前时间是那一天
-    FILE *m_fp;                       // 打开log的文件指针
-    char *m_buf;                      // 写缓冲区
-    block_queue<string> *m_log_queue; // 阻塞队列
+    log_file m_file;                  // 按天、按大小切分的日志文件
+    char *m_buf;                      // 同步模式的写缓冲区
     bool m_is_async;                  // 是否同步标志位
-    locker m_mutex;                   // 互斥锁，用来保护日志缓冲区
+    locker m_mutex;                   // 互斥锁，保护日志文件和同步模式的写缓冲区
+
+    log_slot m_slots[MAX_SLOTS];      // 写日志线程的槽位
+    std::atomic<int> m_slot_count;    // 被领取过的槽位下标上限，后台写线程只需要扫描这么多个
+    pthread_key_t m_slot_key;         // 线程退出时通过它的析构函数归还槽位
+    pthread_t m_writer;               // 后台写线程
+    sem m_wakeup;                     // 唤醒后台写线程
+    std::atomic<bool> m_stop;         // 是否结束后台写线程
+    std::atomic<long long> m_dropped; // 环形缓冲区满了丢掉的日志条数
+
+    int m_flush_interval_ms;          // 刷新策略：最多隔多久刷新一次
+    int m_flush_bytes;                // 刷新策略：未刷新的字节数达到多少就刷新
+    int m_flush_level;                // 刷新策略：写了不低于这个级别的日志就立即刷新
+    long long m_unflushed;            // 上次刷新之后写入的字节数，由m_mutex保护
+    long long m_last_flush_ms;        // 上次刷新的时间，由m_mutex保护
+    std::atomic<long long> m_flush_seq; // 异步模式下要求刷新的次数
+    long long m_flushed_seq;          // 后台写线程已经完成的刷新请求，由m_flush_mutex保护
+    locker m_flush_mutex;             // 保护m_flushed_seq
+    cond m_flush_cond;                // 后台写线程完成刷新后唤醒等待的线程
+
+    log_format m_formats[MAX_FORMATS]; // 二进制日志模式下注册的调用点，下标就是格式编号
+    std::atomic<int> m_format_count;   // 已注册的调用点个数
+    locker m_format_mutex;             // 注册调用点时加锁，每个调用点只注册一次
+    int m_written_formats;             // 当前日志文件中已经写入的格式记录个数，由m_mutex保护
+    int m_dropped_format;              // 后台写线程报告丢弃条数用的格式编号
+
+    log_limit m_limits[4];                        // 每个级别的默认采样和限流参数，由m_site_mutex保护
+    log_site_rule m_site_rules[MAX_SITE_RULES];   // 单独设置的调用点参数，由m_site_mutex保护
+    int m_site_rule_count;
+    log_site *m_sites;                            // 已注册的调用点，由m_site_mutex保护
+    locker m_site_mutex;
+    long long m_coarse_ns;                        // 粗粒度时钟的精度，令牌桶的容量不能小于它
+    long long m_last_report_ms;                   // 上次报告被压制条数的时间，由m_mutex保护
+    int m_suppressed_format;                      // 报告被压制条数用的格式编号
 
 private:
-    Log();                  // 单例模式，构造函数私有化，防止外部new
-    virtual ~Log();         // 析构函数私有化，防止外部delete
-    void *async_write_log() // 异步写日志方法
-    {
-        string single_log; // 单条日志
+    Log();          // 单例模式，构造函数私有化，防止外部new
+    virtual ~Log(); // 析构函数私有化，防止外部delete
 
-        while (m_log_queue->pop(single_log)) // 从阻塞队列中取出一条日志
-        {
-            m_mutex.lock(); // 加锁
+    void *async_write_log();  // 后台写线程的主循环
+    void write_pending(bool force_flush); // 把所有槽位中的日志写入文件并按刷新策略刷新，只在后台写线程中调用
+    log_slot *thread_slot();  // 异步模式下返回当前线程的槽位，同步模式或者槽位用完时返回NULL
+    log_slot *acquire_slot(); // 当前线程第一次写异步日志时领取槽位
+    void push_line(log_slot *slot, int len, int level); // 把槽位行缓冲区中的一条日志放进环形缓冲区
+    void write_locked(const char *buf, int len, int level); // 同步写入一条日志，调用者需持有m_mutex
+    void write_formats();     // 把还没写入当前文件的格式记录写进去，调用者需持有m_mutex
+    static void release_slot(void *slot); // 线程退出时归还槽位
 
-            fputs(single_log.c_str(), m_fp); // 写入文件
+    int format_line(char *buf, int level, const char *format, va_list valst);                   // 格式化一行日志
+    void check_split(const struct tm &my_tm, size_t len);                                       // 写入len字节前按天、按大小切分日志文件，调用者需持有m_mutex
+    void start_file();                                                                          // 新的日志段开始时写入文件头，调用者需持有m_mutex
+    void write_record(const struct tm &my_tm, const char *buf, int len);                         // 写入一条日志模块自己产生的记录，调用者需持有m_mutex
+    void report_suppressed(const struct tm &my_tm, bool force);                                 // 到时间了就报告各调用点被压制的条数，调用者需持有m_mutex
+    void apply_limit(log_site *site);                                                           // 按级别默认值和单独的设置算出调用点生效的参数，调用者需持有m_site_mutex
+    void maybe_flush(bool force);                                                               // 按刷新策略决定是否刷新，调用者需持有m_mutex
+    static void crash_handler(int sig);                                                         // 崩溃信号的处理函数
 
-            m_mutex.unlock(); // 解锁
-        }
-    }
+    static std::atomic<int> m_level; // 运行期的最低日志级别，LOG_XXX宏在求值参数之前先检查它
 
 public:
     // 对外接口
@@ -54,28 +229,130 @@ public:
         return &instance;    // 返回单例对象的地址
     }
 
-    // 异步写日志公有方法，调用私有方法async_write_log
+    // 后台写线程的入口函数，调用私有方法async_write_log
     static void *flush_log_thread(void *args)
     {
-        Log::get_instance()->async_write_log();
+        return Log::get_instance()->async_write_log();
     }
 
-    // 可选择的参数有日志文件、日志缓冲区大小、最大行数以及最长日志条队列
-    bool init(const char *file_name, int log_buf_size = 8192, int split_lines = 5000000, int max_queue_size = 0);
+    // 可选择的参数有日志文件、单条日志的最大长度、每个日志段的字节数，max_queue_size大于0时使用异步日志
+    // compress为true时写满的日志段在后台用gzip压缩
+    bool init(const char *file_name, int log_buf_size = 8192, long long split_bytes = 64 << 20, int max_queue_size = 0, bool compress = true);
 
     // 将输出内容按照标准格式整理
     // 写入日志内容的函数，可变参数，最后一个参数为可变参数的个数
     void write_log(int level, const char *format, ...);
 
-    // 强制刷新缓冲区
+    // 设置刷新策略，需要在init之前调用；flush_level为4时只按时间和大小刷新
+    void set_flush_policy(int interval_ms, int bytes, int level);
+
+    // 二进制日志模式下写一条日志，id是register_format返回的格式编号
+    template <typename... Args>
+    void write_binary(int level, int id, const Args &... args);
+
+    // 注册一个日志调用点，返回格式编号；每个调用点只在第一次执行时注册
+    static int register_format(int level, const char *format, const char *file, int line);
+
+    // 注册一个调用点的采样和限流状态，由log_site的构造函数调用
+    static void register_site(log_site *site);
+
+    // 设置某个级别所有调用点默认的采样和限流参数，随时可以调用，对已经注册的调用点立即生效
+    void set_limit(int level, int sample, int rate, int burst = 0);
+
+    // 单独设置某个调用点的参数，优先于级别的默认值；file按后缀匹配，line为0表示这个文件里的所有调用点
+    bool set_site_limit(const char *file, int line, int sample, int rate, int burst = 0);
+
+    // 强制刷新缓冲区，异步模式下等后台写线程把之前的日志都写入并刷新后才返回
     void flush(void);
+
+    // 崩溃时尽力写出缓冲区中的日志，不加锁，只在信号处理函数中调用
+    void crash_flush(void);
+
+    // 运行期日志级别，可以随时修改，超出范围的值会被限制在DEBUG到ERROR之间
+    static bool enabled(int level) { return level >= m_level.load(std::memory_order_relaxed); }
+    static int get_level() { return m_level.load(std::memory_order_relaxed); }
+    static void set_level(int level);
 };
 
 // 日志类中的方法都不会被其他程序直接调用（所以定义成public有啥用*.*)
 // 下面四个可变参数宏提供了其他程序的调用方法，用于不同类型的日志输出
-#define LOG_DEBUG(format, ...) Log::get_instance()->write_log(0, format, ##__VA_ARGS__)
-#define LOG_INFO(format, ...) Log::get_instance()->write_log(1, format, ##__VA_ARGS__)
-#define LOG_WARN(format, ...) Log::get_instance()->write_log(2, format, ##__VA_ARGS__)
-#define LOG_ERROR(format, ...) Log::get_instance()->write_log(3, format, ##__VA_ARGS__)
+// 先检查运行期级别再调用write_log，级别不够时只有一次原子读，参数表达式不会被求值
+// 每个调用点用一个局部静态的log_site记住自己的采样和限流状态，只在第一次执行时注册，被压制的日志参数也不会被求值
+// 高频的调用点可以用LOG_SAMPLED直接指定每sample条只写1条，比如LOG_SAMPLED(LOG_LEVEL_INFO, 100, "...")
+#ifndef LOG_BINARY_MODE
+#define LOG_SAMPLED(level, sample, format, ...)                                             \
+    do                                                                                      \
+    {                                                                                       \
+        if ((level) >= LOG_MIN_LEVEL && Log::enabled(level))                                \
+        {                                                                                   \
+            static log_site log_site_(level, format, __FILE__, __LINE__, sample);           \
+            if (log_site_.admit())                                                          \
+                Log::get_instance()->write_log(level, format, ##__VA_ARGS__);               \
+        }                                                                                   \
+    } while (0)
+#else
+// 二进制日志模式下调用点注册时同时注册格式，log_site_.id就是格式编号
+#define LOG_SAMPLED(level, sample, format, ...)                                             \
+    do                                                                                      \
+    {                                                                                       \
+        if ((level) >= LOG_MIN_LEVEL && Log::enabled(level))                                \
+        {                                                                                   \
+            static log_site log_site_(level, format, __FILE__, __LINE__, sample);           \
+            if (log_site_.admit())                                                          \
+                Log::get_instance()->write_binary(level, log_site_.id, ##__VA_ARGS__);      \
+        }                                                                                   \
+    } while (0)
+#endif
+
+#define LOG_WRITE(level, format, ...) LOG_SAMPLED(level, 0, format, ##__VA_ARGS__)
+
+// 每一条都要写的日志（比如每个请求一条的访问日志）用LOG_UNLIMITED，不受级别默认的采样和限流参数影响，只看运行期级别
+// 确实需要时仍然可以用set_site_limit单独限制这个调用点
+#define LOG_NO_LIMIT (-1)
+#define LOG_UNLIMITED(level, format, ...) LOG_SAMPLED(level, LOG_NO_LIMIT, format, ##__VA_ARGS__)
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) LOG_WRITE(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) do {} while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) LOG_WRITE(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) do {} while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) LOG_WRITE(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) do {} while (0)
+#endif
+
+#define LOG_ERROR(format, ...) LOG_WRITE(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+inline log_site::log_site(int level, const char *format, const char *file, int line, int fixed)
+    : format(format), file(file), line(line), level(level), fixed_sample(fixed), id(-1),
+      sample(0), interval_ns(0), burst_ns(0), tat(0), hits(0), suppressed(0), next(NULL)
+{
+    Log::register_site(this);
+}
+
+template <typename... Args>
+void Log::write_binary(int level, int id, const Args &... args)
+{
+    log_slot *slot = thread_slot();
+    if (slot) // 编码到自己的行缓冲区，再放进自己的环形缓冲区
+    {
+        int len = log_encode_message(slot->line, m_log_buf_size, id, args...);
+        push_line(slot, len, level);
+        return;
+    }
+
+    m_mutex.lock();
+    int len = log_encode_message(m_buf, m_log_buf_size, id, args...);
+    write_locked(m_buf, len, level);
+    m_mutex.unlock();
+}
 
 #endif
@@ -0,0 +1,149 @@
+#ifndef LOG_BINARY_H
+#define LOG_BINARY_H
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/****************************************************************************************/
+/* 二进制日志的记录格式，日志模块写入、logdecode解析都用这个文件，整数按本机字节序存放             */
+/* 每个日志文件以LOG_BINARY_MAGIC开头，之后是一条条记录，每条记录的前3个字节都是：               */
+/*   u8 类型  u16 整条记录的长度                                                             */
+/* 格式记录(LOG_RECORD_FORMAT)：每个LOG_XXX调用点第一次执行时注册一次，每个日志文件开头会重新写一遍 */
+/*   u32 格式编号  u8 日志级别  u32 行号  u16 文件名长度  文件名  u16 格式串长度  格式串            */
+/* 日志记录(LOG_RECORD_MESSAGE)：写日志时只写编号、时间和参数的原始字节，格式化留给logdecode       */
+/*   u32 格式编号  u64 时间(微秒)  若干个参数，每个参数是「u8 类型标签 + 值」：                    */
+/*   LOG_ARG_INT/LOG_ARG_UINT/LOG_ARG_DOUBLE/LOG_ARG_POINTER是8字节的值，LOG_ARG_STRING是u16长度+内容 */
+/****************************************************************************************/
+
+#define LOG_BINARY_MAGIC "TWLOGBIN"
+#define LOG_BINARY_MAGIC_LEN 8
+
+enum LOG_RECORD_TYPE
+{
+    LOG_RECORD_FORMAT = 'F',
+    LOG_RECORD_MESSAGE = 'M'
+};
+
+enum LOG_ARG_TYPE
+{
+    LOG_ARG_INT = 'i',
+    LOG_ARG_UINT = 'u',
+    LOG_ARG_DOUBLE = 'd',
+    LOG_ARG_STRING = 's',
+    LOG_ARG_POINTER = 'p'
+};
+
+static const int LOG_RECORD_HEADER = 3;                     // 类型 + 长度
+static const int LOG_MESSAGE_HEADER = LOG_RECORD_HEADER + 12; // 再加上格式编号和时间
+
+// 往p处写入一个定长的值，空间不够时把end移到p，后面的参数也都不再写入，避免参数错位
+template <typename T>
+inline void log_put(char *&p, char *&end, char tag, T v)
+{
+    if (end - p < (long)(1 + sizeof(v)))
+    {
+        end = p;
+        return;
+    }
+    *p++ = tag;
+    memcpy(p, &v, sizeof(v));
+    p += sizeof(v);
+}
+
+// 按实参类型选择类型标签，整数统一按8字节存放
+inline void log_encode_arg(char *&p, char *&end, int v) { log_put(p, end, LOG_ARG_INT, (int64_t)v); }
+inline void log_encode_arg(char *&p, char *&end, long v) { log_put(p, end, LOG_ARG_INT, (int64_t)v); }
+inline void log_encode_arg(char *&p, char *&end, long long v) { log_put(p, end, LOG_ARG_INT, (int64_t)v); }
+inline void log_encode_arg(char *&p, char *&end, unsigned int v) { log_put(p, end, LOG_ARG_UINT, (uint64_t)v); }
+inline void log_encode_arg(char *&p, char *&end, unsigned long v) { log_put(p, end, LOG_ARG_UINT, (uint64_t)v); }
+inline void log_encode_arg(char *&p, char *&end, unsigned long long v) { log_put(p, end, LOG_ARG_UINT, (uint64_t)v); }
+inline void log_encode_arg(char *&p, char *&end, double v) { log_put(p, end, LOG_ARG_DOUBLE, v); }
+
+// 字符串写入长度和内容，放不下时截断
+inline void log_encode_arg(char *&p, char *&end, const char *v)
+{
+    if (!v)
+        v = "(null)";
+    if (end - p < 3)
+    {
+        end = p;
+        return;
+    }
+    size_t len = strlen(v);
+    if (len > (size_t)(end - p - 3))
+        len = end - p - 3;
+    uint16_t n = (uint16_t)len;
+    *p++ = LOG_ARG_STRING;
+    memcpy(p, &n, 2);
+    memcpy(p + 2, v, n);
+    p += 2 + n;
+}
+
+inline void log_encode_arg(char *&p, char *&end, char *v) { log_encode_arg(p, end, (const char *)v); }
+
+// 其他指针只记录地址
+template <typename T>
+inline void log_encode_arg(char *&p, char *&end, T *v) { log_put(p, end, LOG_ARG_POINTER, (uint64_t)(uintptr_t)v); }
+
+inline void log_encode_args(char *&p, char *&end) {}
+
+template <typename T, typename... Rest>
+inline void log_encode_args(char *&p, char *&end, const T &v, const Rest &... rest)
+{
+    log_encode_arg(p, end, v);
+    log_encode_args(p, end, rest...);
+}
+
+// 把一条日志记录编码到buf中，返回记录长度；size不超过65535
+template <typename... Args>
+inline int log_encode_message(char *buf, int size, uint32_t id, const Args &... args)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    char *p = buf + LOG_RECORD_HEADER;
+    char *end = buf + size;
+    buf[0] = LOG_RECORD_MESSAGE;
+    memcpy(p, &id, 4);
+    memcpy(p + 4, &us, 8);
+    p += 12;
+    log_encode_args(p, end, args...);
+
+    uint16_t len = (uint16_t)(p - buf);
+    memcpy(buf + 1, &len, 2);
+    return len;
+}
+
+// 把一条格式记录编码到buf中，返回记录长度；buf至少要有LOG_RECORD_HEADER + 15 + 文件名和格式串的长度
+inline int log_encode_format(char *buf, int size, uint32_t id, int level, const char *file, int line, const char *format)
+{
+    char *p = buf + LOG_RECORD_HEADER;
+    char *end = buf + size;
+    uint8_t lv = (uint8_t)level;
+    uint32_t ln = (uint32_t)line;
+    buf[0] = LOG_RECORD_FORMAT;
+    memcpy(p, &id, 4);
+    memcpy(p + 4, &lv, 1);
+    memcpy(p + 5, &ln, 4);
+    p += 9;
+
+    const char *strs[2] = {file, format};
+    for (int i = 0; i < 2; ++i)
+    {
+        size_t n = strlen(strs[i]);
+        if (n > (size_t)(end - p - 2))
+            n = end - p - 2;
+        uint16_t n16 = (uint16_t)n;
+        memcpy(p, &n16, 2);
+        memcpy(p + 2, strs[i], n16);
+        p += 2 + n16;
+    }
+
+    uint16_t len = (uint16_t)(p - buf);
+    memcpy(buf + 1, &len, 2);
+    return len;
+}
+
+#endif
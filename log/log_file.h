@@ -0,0 +1,401 @@
+#ifndef LOG_FILE_H
+#define LOG_FILE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include "../lock/locker.h"
+
+extern char **environ;
+
+/****************************************************************************************/
+/* 按大小切分、预分配并映射到内存的日志文件                                                   */
+/*   每个日志段创建时就用fallocate分配好m_segment_size字节的磁盘空间，再整个mmap进来，          */
+/*   写日志只是一次memcpy，不需要write系统调用，也不会因为文件变长而去分配磁盘块                  */
+/*   当前段用到一半时通知后台线程提前创建好下一段，写满后切换只是交换一下                        */
+/*   换下来的旧段交给后台线程munmap、截掉没用完的预分配空间、关闭，再交给最低优先级的gzip压缩    */
+/*   同步和异步日志都一样：写日志的线程在Log::m_mutex下只做交换，不碰fallocate/mmap/munmap/fork */
+/* 文件名为「目录/年_月_日_文件名」，同一天的后续段加上「.编号」；日期变了从新一天的第一段开始     */
+/* 服务器每次启动都从一个新的段开始写，不会追加到已有的段里                                     */
+/* 当前段只由Log在m_mutex的保护下使用；下一段、待关闭的段和段编号由m_seg_lock保护，和后台线程共享 */
+/****************************************************************************************/
+
+class log_file
+{
+private:
+    static const int MAX_CHILDREN = 16; // 最多同时有几个压缩进程
+    static const int MAX_RETIRED = 8;   // 最多有几个换下来还没关闭的段
+
+    // 一个映射到内存的日志段
+    struct segment
+    {
+        int fd;            // 文件描述符，-1表示没有打开
+        char *map;         // 映射的内存
+        size_t size;       // 预分配的大小
+        size_t offset;     // 已经写入的字节数
+        size_t synced;     // 已经msync过的字节数
+        int day;           // 这个段属于哪一天
+        char path[300];    // 文件路径
+    };
+
+    // 等后台线程关闭的段
+    struct retired
+    {
+        segment seg;
+        bool compress;     // 关闭后是否压缩
+    };
+
+    segment m_cur;           // 当前正在写的段
+    bool m_next_requested;   // 已经通知后台线程准备下一段了，只由写日志的线程使用
+    char m_dir[128];         // 日志目录，以'/'结尾，可以为空
+    char m_name[128];        // 日志文件名
+    size_t m_segment_size;   // 每个段的大小
+    bool m_compress;         // 是否压缩写满的段
+    pid_t m_children[MAX_CHILDREN]; // 还没回收的压缩进程，只由后台线程使用
+    int m_child_count;
+
+    // 以下由m_seg_lock保护
+    segment m_next;          // 后台线程提前准备好的下一段
+    retired m_retired[MAX_RETIRED]; // 换下来等后台线程关闭的段
+    int m_retired_count;
+    int m_index;             // 当天下一个段的编号
+    int m_index_day;         // m_index属于哪一天
+    bool m_want_next;        // 需要后台线程准备下一段
+    bool m_preparing;        // 后台线程正在创建下一段
+    bool m_stop;             // 让后台线程退出
+
+    locker m_seg_lock;
+    cond m_work;             // 唤醒后台线程
+    cond m_done;             // 后台线程准备好一段或者关闭了一段
+    pthread_t m_worker;
+    bool m_running;          // 后台线程是否在运行
+
+    static void reset(segment &seg)
+    {
+        seg.fd = -1;
+        seg.map = NULL;
+        seg.size = 0;
+        seg.offset = 0;
+        seg.synced = 0;
+        seg.day = -1;
+        seg.path[0] = '\0';
+    }
+
+    // 创建并映射my_tm那一天的下一个段，preallocate为false时不fallocate，建成稀疏文件
+    // 不能在持有m_seg_lock时调用
+    bool open_segment(segment &seg, const struct tm &my_tm, bool preallocate)
+    {
+        int fd = -1;
+        while (fd < 0)
+        {
+            m_seg_lock.lock();
+            if (m_index_day != my_tm.tm_mday)
+            {
+                m_index = 0;
+                m_index_day = my_tm.tm_mday;
+            }
+            int index = m_index++;
+            m_seg_lock.unlock();
+
+            if (index == 0)
+                snprintf(seg.path, sizeof(seg.path), "%s%d_%02d_%02d_%s", m_dir, my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, m_name);
+            else
+                snprintf(seg.path, sizeof(seg.path), "%s%d_%02d_%02d_%s.%d", m_dir, my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, m_name, index);
+
+            char gz[320];
+            snprintf(gz, sizeof(gz), "%s.gz", seg.path);
+            if (access(seg.path, F_OK) == 0 || access(gz, F_OK) == 0) // 已有的段不再追加
+                continue;
+
+            fd = ::open(seg.path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0 && errno != EEXIST)
+                return false;
+        }
+
+        // 预分配磁盘空间，文件系统不支持fallocate时退化为稀疏文件
+        if ((!preallocate || fallocate(fd, 0, 0, m_segment_size) != 0) && ftruncate(fd, m_segment_size) != 0)
+        {
+            ::close(fd);
+            unlink(seg.path);
+            return false;
+        }
+
+        void *map = mmap(NULL, m_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            ::close(fd);
+            unlink(seg.path);
+            return false;
+        }
+
+        seg.fd = fd;
+        seg.map = (char *)map;
+        seg.size = m_segment_size;
+        seg.offset = 0;
+        seg.synced = 0;
+        seg.day = my_tm.tm_mday;
+        return true;
+    }
+
+    // 关闭一个段：截掉没用完的预分配空间，没写过的段直接删掉，需要时交给gzip压缩
+    void close_segment(segment &seg, bool compress)
+    {
+        if (seg.fd < 0)
+            return;
+
+        munmap(seg.map, seg.size);
+        if (ftruncate(seg.fd, seg.offset) != 0)
+            ; // 截断失败只是多占一些磁盘空间
+        ::close(seg.fd);
+
+        if (seg.offset == 0)
+            unlink(seg.path);
+        else if (compress)
+            spawn_gzip(seg.path);
+        reset(seg);
+    }
+
+    // 把段交给后台线程关闭，调用时持有m_seg_lock
+    void retire(segment &seg, bool compress)
+    {
+        if (seg.fd < 0)
+            return;
+        while (m_retired_count == MAX_RETIRED) // 后台线程跟不上，等它关掉一个
+            m_done.wait(m_seg_lock.get());
+        m_retired[m_retired_count].seg = seg;
+        m_retired[m_retired_count].compress = compress;
+        ++m_retired_count;
+        reset(seg);
+        m_work.signal();
+    }
+
+    // 启动gzip压缩文件，不等待它结束
+    void spawn_gzip(char *path)
+    {
+        reap();
+        if (m_child_count >= MAX_CHILDREN) // 压缩跟不上，这个段就不压缩了
+            return;
+
+        // 服务器的socket没有设置CLOEXEC，不关掉的话gzip结束之前这些连接都关不掉
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+        posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+
+        // 压缩用最低的优先级，不和处理请求的线程抢CPU
+        char *argv[] = {(char *)"nice", (char *)"-n", (char *)"19", (char *)"gzip", (char *)"-f", path, NULL};
+        pid_t pid;
+        if (posix_spawnp(&pid, "nice", &actions, NULL, argv, environ) == 0)
+            m_children[m_child_count++] = pid;
+        posix_spawn_file_actions_destroy(&actions);
+    }
+
+    // 回收已经结束的压缩进程
+    void reap()
+    {
+        for (int i = 0; i < m_child_count;)
+        {
+            if (waitpid(m_children[i], NULL, WNOHANG) != 0)
+                m_children[i] = m_children[--m_child_count];
+            else
+                ++i;
+        }
+    }
+
+    static void *worker(void *arg)
+    {
+        ((log_file *)arg)->run();
+        return NULL;
+    }
+
+    // 后台线程：关闭换下来的段、准备下一段，每秒检查一次日期并回收压缩进程
+    void run()
+    {
+        m_seg_lock.lock();
+        while (true)
+        {
+            if (m_retired_count > 0) // 先关旧段，退出前也要把它们都关掉
+            {
+                retired r = m_retired[--m_retired_count];
+                m_seg_lock.unlock();
+                close_segment(r.seg, r.compress);
+                m_seg_lock.lock();
+                m_done.broadcast();
+                continue;
+            }
+            if (m_stop)
+                break;
+
+            time_t t = time(NULL);
+            struct tm my_tm;
+            localtime_r(&t, &my_tm);
+            if (m_next.fd >= 0 && m_next.day != my_tm.tm_mday) // 前一天准备的段用不上了，没写过会被删掉
+            {
+                retire(m_next, false);
+                m_want_next = true;
+                continue;
+            }
+            if (m_want_next && m_next.fd < 0)
+            {
+                m_want_next = false; // 失败了也不重试，到时候由写日志的线程自己创建
+                m_preparing = true;
+                m_seg_lock.unlock();
+                segment seg;
+                reset(seg);
+                open_segment(seg, my_tm, true);
+                m_seg_lock.lock();
+                m_next = seg;
+                m_preparing = false;
+                m_done.broadcast();
+                continue;
+            }
+
+            m_seg_lock.unlock();
+            reap();
+            m_seg_lock.lock();
+            if (m_retired_count > 0 || m_stop || m_want_next)
+                continue;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            m_work.timewait(m_seg_lock.get(), ts);
+        }
+        m_seg_lock.unlock();
+    }
+
+public:
+    log_file() : m_next_requested(false), m_segment_size(0), m_compress(false), m_child_count(0),
+                 m_retired_count(0), m_index(0), m_index_day(-1), m_want_next(false), m_preparing(false),
+                 m_stop(false), m_running(false)
+    {
+        reset(m_cur);
+        reset(m_next);
+        m_dir[0] = '\0';
+        m_name[0] = '\0';
+    }
+
+    ~log_file()
+    {
+        close();
+    }
+
+    // dir为日志目录（以'/'结尾或为空），segment_size为每个段的大小，compress表示写满的段是否压缩
+    bool open(const char *dir, const char *name, size_t segment_size, bool compress)
+    {
+        snprintf(m_dir, sizeof(m_dir), "%s", dir);
+        snprintf(m_name, sizeof(m_name), "%s", name);
+        size_t page = sysconf(_SC_PAGESIZE);
+        m_segment_size = (segment_size + page - 1) / page * page;
+        m_compress = compress;
+
+        time_t t = time(NULL);
+        struct tm my_tm;
+        localtime_r(&t, &my_tm);
+        if (!open_segment(m_cur, my_tm, true))
+            return false;
+
+        m_stop = false;
+        if (pthread_create(&m_worker, NULL, worker, this) != 0)
+        {
+            close_segment(m_cur, false);
+            return false;
+        }
+        m_running = true;
+        return true;
+    }
+
+    // 写入len字节之前调用：日期变了或者当前段放不下时切换到下一段，返回true表示切换了
+    bool prepare(size_t len, const struct tm &my_tm)
+    {
+        if (m_cur.fd >= 0 && m_cur.day == my_tm.tm_mday && m_cur.offset + len <= m_cur.size)
+        {
+            if (!m_next_requested && m_cur.offset >= m_cur.size / 2) // 用到一半了，让后台线程准备好下一段
+            {
+                m_next_requested = true;
+                m_seg_lock.lock();
+                m_want_next = true;
+                m_work.signal();
+                m_seg_lock.unlock();
+            }
+            return false;
+        }
+
+        m_seg_lock.lock();
+        while (m_preparing) // 后台线程正在创建下一段，等它建好，段编号才不会乱
+            m_done.wait(m_seg_lock.get());
+        retire(m_cur, m_compress);
+        if (m_next.fd >= 0 && m_next.day == my_tm.tm_mday)
+        {
+            m_cur = m_next;
+            reset(m_next);
+        }
+        else
+            retire(m_next, false); // 前一天准备的段用不上了，没写过会被删掉
+        m_want_next = false;
+        m_seg_lock.unlock();
+        m_next_requested = false;
+
+        // 没有准备好的段（日期刚变，或者一条日志就超过了半段），只好自己创建
+        // 不做fallocate，建成稀疏文件，请求线程上只有open/ftruncate/mmap
+        if (m_cur.fd < 0)
+            open_segment(m_cur, my_tm, false);
+        return true;
+    }
+
+    // 追加数据，当前段放不下的部分被丢弃；只有memcpy，可以在崩溃信号的处理函数中调用
+    size_t append(const char *data, size_t len)
+    {
+        if (m_cur.fd < 0)
+            return 0;
+        if (len > m_cur.size - m_cur.offset)
+            len = m_cur.size - m_cur.offset;
+        memcpy(m_cur.map + m_cur.offset, data, len);
+        m_cur.offset += len;
+        return len;
+    }
+
+    // 让内核开始把写入的数据写回磁盘，不等待完成
+    void sync()
+    {
+        if (m_cur.fd < 0 || m_cur.synced == m_cur.offset)
+            return;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = m_cur.synced / page * page; // msync的起始地址要按页对齐
+        msync(m_cur.map + begin, m_cur.offset - begin, MS_ASYNC);
+        m_cur.synced = m_cur.offset;
+    }
+
+    // 崩溃时把当前段截到已经写入的长度，去掉预分配的空白；ftruncate可以在信号处理函数中调用
+    void truncate()
+    {
+        if (m_cur.fd >= 0 && ftruncate(m_cur.fd, m_cur.offset) != 0)
+            ; // 截断失败只是文件尾部多出一段'\0'
+    }
+
+    // 等后台线程关完换下来的段后退出，再关闭当前段和准备好的下一段，当前段不压缩
+    void close()
+    {
+        if (m_running)
+        {
+            m_seg_lock.lock();
+            m_stop = true;
+            m_work.signal();
+            m_seg_lock.unlock();
+            pthread_join(m_worker, NULL);
+            m_running = false;
+        }
+        close_segment(m_cur, false);
+        close_segment(m_next, false);
+    }
+};
+
+#endif
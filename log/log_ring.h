@@ -0,0 +1,107 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <string.h>
+
+/****************************************************************************************/
+/* 单生产者单消费者(SPSC)的字节环形缓冲区，每个写日志的线程独占一个                             */
+/* 生产者（写日志的线程）只修改m_head，消费者（后台写线程）只修改m_tail，不需要任何锁和CAS：      */
+/*   生产者把格式化好的一行日志拷贝到m_head处，再用release语义发布新的m_head                    */
+/*   消费者一次取走[m_tail, m_head)之间的所有数据（最多分成首尾两段），写完后再发布新的m_tail     */
+/* 相当于双缓冲的「前台缓冲区写满后交换给后台」，只是交换的粒度从整块缓冲区变成了已写入的字节，     */
+/* 后台线程不用等缓冲区写满就能取走数据，生产者也不用等后台线程归还空缓冲区。                     */
+/****************************************************************************************/
+
+class log_ring
+{
+private:
+    static const size_t CACHELINE_SIZE = 64;
+
+    alignas(CACHELINE_SIZE) std::atomic<size_t> m_head; // 下一个写入位置，只由生产者修改
+    alignas(CACHELINE_SIZE) std::atomic<size_t> m_tail; // 下一个读取位置，只由消费者修改
+    alignas(CACHELINE_SIZE) char *m_buf;                // 环形缓冲区，大小为2的幂
+    size_t m_mask;                                      // 缓冲区大小-1，用位与代替取模
+
+public:
+    // capacity会向上取整到2的幂
+    log_ring(size_t capacity = 1 << 18) : m_head(0), m_tail(0)
+    {
+        size_t size = 4096;
+        while (size < capacity)
+            size <<= 1;
+        m_buf = new char[size];
+        m_mask = size - 1;
+    }
+
+    ~log_ring()
+    {
+        delete[] m_buf;
+    }
+
+    size_t capacity()
+    {
+        return m_mask + 1;
+    }
+
+    // 生产者调用：写入len字节，剩余空间不够时不写入并返回false
+    // used返回写入前缓冲区中未被取走的字节数，生产者据此决定要不要唤醒消费者
+    bool push(const char *data, size_t len, size_t &used)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        used = head - m_tail.load(std::memory_order_acquire);
+        if (len > capacity() - used)
+            return false;
+
+        size_t pos = head & m_mask;
+        size_t first = capacity() - pos; // 到缓冲区末尾还能连续写多少字节
+        if (first >= len)
+        {
+            memcpy(m_buf + pos, data, len);
+        }
+        else // 绕回缓冲区开头，分两段拷贝
+        {
+            memcpy(m_buf + pos, data, first);
+            memcpy(m_buf, data + first, len - first);
+        }
+        m_head.store(head + len, std::memory_order_release);
+        return true;
+    }
+
+    // 消费者调用：取得所有已写入的数据，最多两段，返回总字节数
+    size_t peek(const char *&p1, size_t &n1, const char *&p2, size_t &n2)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t len = m_head.load(std::memory_order_acquire) - tail;
+        size_t pos = tail & m_mask;
+        size_t first = capacity() - pos;
+
+        p1 = m_buf + pos;
+        p2 = m_buf;
+        if (first >= len)
+        {
+            n1 = len;
+            n2 = 0;
+        }
+        else
+        {
+            n1 = first;
+            n2 = len - first;
+        }
+        return len;
+    }
+
+    // 消费者调用：数据写出之后，把这len字节的空间还给生产者
+    void consume(size_t len)
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    }
+
+    bool empty()
+    {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,354 @@
+// 二进制日志解码工具：把LOG_BINARY_MODE下写出的日志文件还原成和文本日志一样的格式，输出到标准输出
+// 用法：./logdecode 日志文件 [日志文件 ...]
+// 同一个文件里格式记录可能出现在用到它的日志记录之后，所以分两遍：第一遍收集格式，第二遍解码日志
+// 每个日志段都以文件标识开头，格式编号只在一段之内有效；多个段解压后拼接成一个文件也可以逐段解码
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "log_binary.h"
+
+using namespace std;
+
+// 日志级别对应的标签，和log.cpp中一致
+static const char *level_tag[] = {"[debug]:", "[info]:", "[warn]:", "[erro]:"};
+
+struct format_entry
+{
+    int level;
+    string file;
+    int line;
+    string format;
+};
+
+// 解码过程中的一个参数
+struct arg_value
+{
+    char type;
+    int64_t i;
+    uint64_t u;
+    double d;
+    string s;
+};
+
+// 读出整个文件
+static bool read_file(const char *name, vector<char> &data)
+{
+    FILE *fp = fopen(name, "rb");
+    if (!fp)
+        return false;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(fp);
+    return true;
+}
+
+// 判断pos处是不是新一段内容的文件标识
+static bool at_magic(const vector<char> &data, size_t pos)
+{
+    return pos + LOG_BINARY_MAGIC_LEN <= data.size() && memcmp(&data[pos], LOG_BINARY_MAGIC, LOG_BINARY_MAGIC_LEN) == 0;
+}
+
+// 找到从begin（文件标识之后）开始的这一段内容的结尾
+static size_t segment_end(const vector<char> &data, size_t begin)
+{
+    size_t pos = begin;
+    while (pos + LOG_RECORD_HEADER <= data.size() && !at_magic(data, pos))
+    {
+        uint16_t len;
+        memcpy(&len, &data[pos] + 1, 2);
+        if (len < LOG_RECORD_HEADER || pos + len > data.size()) // 文件尾部不完整的记录
+            return data.size();
+        pos += len;
+    }
+    return pos < data.size() && at_magic(data, pos) ? pos : data.size();
+}
+
+// 第一遍：收集这一段中所有的格式记录
+static void collect_formats(const vector<char> &data, size_t begin, size_t end_pos, map<uint32_t, format_entry> &formats)
+{
+    size_t pos = begin;
+    while (pos + LOG_RECORD_HEADER <= end_pos)
+    {
+        const char *rec = &data[pos];
+        uint16_t len;
+        memcpy(&len, rec + 1, 2);
+        if (len < LOG_RECORD_HEADER || pos + len > end_pos)
+            break;
+
+        if (rec[0] == LOG_RECORD_FORMAT && len >= LOG_RECORD_HEADER + 13)
+        {
+            const char *p = rec + LOG_RECORD_HEADER;
+            const char *end = rec + len;
+            uint32_t id, line;
+            uint8_t level;
+            uint16_t n;
+            memcpy(&id, p, 4);
+            memcpy(&level, p + 4, 1);
+            memcpy(&line, p + 5, 4);
+            p += 9;
+
+            format_entry f;
+            f.level = level;
+            f.line = line;
+            memcpy(&n, p, 2);
+            if (p + 2 + n <= end)
+                f.file.assign(p + 2, n);
+            p += 2 + n;
+            if (p + 2 <= end)
+            {
+                memcpy(&n, p, 2);
+                if (p + 2 + n <= end)
+                    f.format.assign(p + 2, n);
+            }
+            formats[id] = f;
+        }
+        pos += len;
+    }
+}
+
+// 按格式串中的一个转换说明输出一个参数，spec是去掉长度修饰符后的"%...x"
+static void print_arg(string &out, string spec, char conv, const arg_value *arg)
+{
+    char buf[4096];
+    if (!arg)
+    {
+        out += "<missing>";
+        return;
+    }
+
+    switch (conv)
+    {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'c':
+    {
+        long long v = arg->type == LOG_ARG_UINT ? (long long)arg->u : arg->type == LOG_ARG_DOUBLE ? (long long)arg->d : arg->i;
+        if (arg->type == LOG_ARG_STRING)
+        {
+            out += arg->s;
+            return;
+        }
+        if (conv != 'c')
+            spec.insert(spec.size() - 1, "ll");
+        snprintf(buf, sizeof(buf), spec.c_str(), v);
+        break;
+    }
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        snprintf(buf, sizeof(buf), spec.c_str(), arg->type == LOG_ARG_DOUBLE ? arg->d : (double)arg->i);
+        break;
+    case 's':
+        if (arg->type != LOG_ARG_STRING)
+        {
+            snprintf(buf, sizeof(buf), "%lld", (long long)arg->i);
+            break;
+        }
+        snprintf(buf, sizeof(buf), spec.c_str(), arg->s.c_str());
+        break;
+    case 'p':
+        snprintf(buf, sizeof(buf), "%p", (void *)(uintptr_t)arg->u);
+        break;
+    default:
+        buf[0] = '\0';
+        break;
+    }
+    out += buf;
+}
+
+// 用格式串和参数拼出日志正文
+static string format_message(const string &format, const vector<arg_value> &args)
+{
+    string out;
+    size_t next = 0;
+    const char *f = format.c_str();
+    while (*f)
+    {
+        if (*f != '%')
+        {
+            out += *f++;
+            continue;
+        }
+        if (f[1] == '%')
+        {
+            out += '%';
+            f += 2;
+            continue;
+        }
+
+        // 解析一个转换说明：标志、宽度、精度、长度修饰符、转换字符
+        string spec = "%";
+        ++f;
+        while (*f && strchr("-+ #0'", *f))
+            spec += *f++;
+        for (int part = 0; part < 2; ++part) // 宽度和精度都可能是*，由参数给出
+        {
+            if (part == 1)
+            {
+                if (*f != '.')
+                    break;
+                spec += *f++;
+            }
+            if (*f == '*')
+            {
+                char num[32];
+                snprintf(num, sizeof(num), "%lld", next < args.size() ? (long long)args[next].i : 0LL);
+                spec += num;
+                ++next;
+                ++f;
+            }
+            while (*f >= '0' && *f <= '9')
+                spec += *f++;
+        }
+        while (*f && strchr("hlLqjzt", *f))
+            ++f;
+        if (!*f)
+            break;
+
+        char conv = *f++;
+        if (conv == 'n')
+            continue;
+        spec += conv;
+        print_arg(out, spec, conv, next < args.size() ? &args[next] : NULL);
+        ++next;
+    }
+    return out;
+}
+
+// 解析日志记录中的参数
+static void parse_args(const char *p, const char *end, vector<arg_value> &args)
+{
+    while (p < end)
+    {
+        arg_value v;
+        v.type = *p++;
+        v.i = 0;
+        v.u = 0;
+        v.d = 0;
+        if (v.type == LOG_ARG_STRING)
+        {
+            uint16_t n;
+            if (end - p < 2)
+                break;
+            memcpy(&n, p, 2);
+            p += 2;
+            if (end - p < n)
+                break;
+            v.s.assign(p, n);
+            p += n;
+        }
+        else
+        {
+            if (end - p < 8)
+                break;
+            if (v.type == LOG_ARG_INT)
+                memcpy(&v.i, p, 8);
+            else if (v.type == LOG_ARG_DOUBLE)
+                memcpy(&v.d, p, 8);
+            else
+            {
+                memcpy(&v.u, p, 8);
+                v.i = (int64_t)v.u;
+            }
+            p += 8;
+        }
+        args.push_back(v);
+    }
+}
+
+// 第二遍：解码这一段中所有的日志记录
+static void decode_messages(const vector<char> &data, size_t begin, size_t end_pos, const map<uint32_t, format_entry> &formats)
+{
+    size_t pos = begin;
+    vector<arg_value> args;
+    while (pos + LOG_RECORD_HEADER <= end_pos)
+    {
+        const char *rec = &data[pos];
+        uint16_t len;
+        memcpy(&len, rec + 1, 2);
+        if (len < LOG_RECORD_HEADER || pos + len > end_pos)
+            break;
+
+        if (rec[0] == LOG_RECORD_MESSAGE && len >= LOG_MESSAGE_HEADER)
+        {
+            uint32_t id;
+            uint64_t us;
+            memcpy(&id, rec + LOG_RECORD_HEADER, 4);
+            memcpy(&us, rec + LOG_RECORD_HEADER + 4, 8);
+
+            time_t sec = us / 1000000;
+            struct tm my_tm;
+            localtime_r(&sec, &my_tm);
+            printf("%d-%02d-%02d %02d:%02d:%02d.%06ld ", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
+                   my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, (long)(us % 1000000));
+
+            args.clear();
+            parse_args(rec + LOG_MESSAGE_HEADER, rec + len, args);
+
+            map<uint32_t, format_entry>::const_iterator it = formats.find(id);
+            if (it == formats.end())
+            {
+                printf("[info]: <unknown format %u, %d args>\n", id, (int)args.size());
+            }
+            else
+            {
+                int level = it->second.level <= 3 ? it->second.level : 1;
+                printf("%s %s\n", level_tag[level], format_message(it->second.format, args).c_str());
+            }
+        }
+        pos += len;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc <= 1)
+    {
+        printf("usage: %s log_file [log_file ...]\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; ++i)
+    {
+        vector<char> data;
+        if (!read_file(argv[i], data))
+        {
+            fprintf(stderr, "%s: cannot open\n", argv[i]);
+            return 1;
+        }
+        if (!at_magic(data, 0))
+        {
+            fprintf(stderr, "%s: not a binary log file\n", argv[i]);
+            return 1;
+        }
+
+        size_t pos = 0;
+        while (at_magic(data, pos)) // 逐段解码
+        {
+            size_t begin = pos + LOG_BINARY_MAGIC_LEN;
+            size_t end_pos = segment_end(data, begin);
+
+            map<uint32_t, format_entry> formats;
+            collect_formats(data, begin, end_pos, formats);
+            decode_messages(data, begin, end_pos, formats);
+            pos = end_pos;
+        }
+    }
+    return 0;
+}
@@ -8,17 +8,71 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <sys/sysinfo.h>
 
 #include "./lock/locker.h"
 #include "./threadpool/threadpool.h"
-#include "./timer/lst_timer.h"
+#include "./timer/timing_wheel.h"
 #include "./http/http_conn.h"
 #include "./log/log.h"
 #include "./CGImysql/sql_connection_pool.h"
+#include "./store/mysql_store.h"
+#include "./store/local_store.h"
 
 #define MAX_FD 65536           // 最大可打开的文件描述符
 #define MAX_EVENT_NUMBER 10000 // 最大可监听的事件数
-#define TIMESLOT 5             // 设置最小超时单位，每TIMESLOT秒触发一次SIGALRM信号
+#define TIMESLOT 1             // 设置最小超时单位，每TIMESLOT秒触发一次SIGALRM信号，也是超时淘汰的精度
+#define STATS_INTERVAL 5       // 每STATS_INTERVAL个TIMESLOT导出一次运行统计
+
+// 连接各阶段的超时时间，单位秒
+#define HEADER_TIMEOUT 10  // 从请求的第一个字节到达开始，读完请求头的期限
+#define BODY_TIMEOUT 30    // 从请求头读完开始，读完消息体的期限
+#define IDLE_TIMEOUT 15    // 长连接两个请求之间最多空闲多久
+#define SEND_GRACE 10      // 开始发送响应后的宽限时间
+#define MIN_SEND_RATE 4096 // 宽限时间之后响应发送速度的下限，单位字节/秒
+
+// 日志限流：每个日志调用点每秒最多写多少条，允许突发一秒的量，超出的只计数，定期在日志里报告被压制的条数
+// 这样不管负载多高，日志量的上限都是「调用点个数 * 速率」
+#define LOG_RATE_DEBUG 100
+#define LOG_RATE_INFO 1000
+#define LOG_RATE_WARN 1000
+#define LOG_RATE_ERROR 1000
+
+// 用户名和密码的存储后端，两个选一个
+// USER_STORE_MYSQL：存在MySQL的user表里，要有数据库服务
+// USER_STORE_LOCAL：内嵌的本地存储引擎，数据在LOCAL_STORE_PATH.log和.idx两个文件里，不需要数据库服务，登录注册都在内存速度
+#define USER_STORE_MYSQL
+// #define USER_STORE_LOCAL
+#define LOCAL_STORE_PATH "./users"
+#define LOCAL_STORE_SYNC false // 本地存储每次注册是否刷盘，不刷盘时进程崩溃不丢数据，断电可能丢最近的注册
+
+// 用户表：USER_CACHE_SIZE为0时启动时把user表全部读进内存，user表很大时启动慢、占内存多
+// 不为0时只缓存这么多用户，没命中时按用户名查数据库，启动时不读user表，服务器立即开始监听
+#define USER_CACHE_SIZE (1 << 20)
+#define USER_WARM_UP true // 缓存模式下启动后在后台按页把user表读进缓存，直到缓存满
+#define REGISTER_WINDOW_MS 1 // 注册攒批写入数据库时最多等多久，越长一批越大，注册的响应也越慢
+// 数据库连接池：空闲时保留DB_MIN_CONN个连接，忙时按需扩容到DB_MAX_CONN个
+// 拿不到连接时最多等DB_WAIT_TIMEOUT_MS毫秒，数据库出问题时请求直接失败，不会在线程池里越堆越多
+#define DB_MIN_CONN 2
+#define DB_MAX_CONN 16
+#define DB_WAIT_TIMEOUT_MS 1000
+#define ASYNC_DB_CONN 4      // 登录时查用户的非阻塞连接数，查询在主线程的epoll里推进，不占工作线程；0表示阻塞查询
+// 只读从库，逗号分隔的「主机:端口」，比如"10.0.0.2:3306,10.0.0.3:3306"；登录查询和预热分给从库，注册写主库
+// 每个从库有自己的连接池（连接数和主库相同）和ASYNC_DB_CONN个非阻塞连接；为空时读写都走主库
+#define DB_REPLICAS ""
+// 查找用户的结果缓存：最多缓存这么多个用户名，查到的缓存DB_CACHE_TTL_MS毫秒，没查到的缓存DB_CACHE_NEGATIVE_TTL_MS毫秒
+// 热门的用户名和反复尝试的不存在的用户名在过期之前都不再查库；0表示不缓存
+#define DB_CACHE_SIZE 4096
+#define DB_CACHE_TTL_MS 5000
+#define DB_CACHE_NEGATIVE_TTL_MS 1000
+
+// 登录会话：登录成功后下发会话号Cookie，SESSION_TTL秒不访问就过期，最多同时MAX_SESSIONS个会话，满了之后新登录不建会话
+// 定时器每个TIMESLOT清理SESSION_SWEEP_BATCH个桶里过期的会话（桶数约等于MAX_SESSIONS），每次只扫一部分，不卡主线程
+// SESSION_REQUIRED为true时图片、视频、关注页面要带着有效的会话号才能访问，否则跳转到登录页面；默认false，不改变这些页面原来的访问方式
+#define SESSION_TTL 1800
+#define MAX_SESSIONS (1 << 16)
+#define SESSION_SWEEP_BATCH 4096
+#define SESSION_REQUIRED false
 
 #define SYNLOG // 同步写日志
 // #define ASYNLOG // 异步写日志
@@ -37,8 +91,52 @@ extern int remove(int epollfd, int fd);               // 从内核事件监听
 extern int setnonblocking(int fd);                    // 设置fd的属性为非阻塞
 
 static int pipefd[2];            // 传递监听到的信号的管道，交给主线程处理
-static sort_timer_lst timer_lst; // 定时器升序链表实例，静态的，只能在当前文件内使用
+static timing_wheel timer_lst;   // 分层时间轮定时器实例，静态的，只能在当前文件内使用
 static int epollfd = 0;          // 标识内核事件监听表的文件描述符
+static http_conn *users = NULL;  // 所有可能的socket连接对应的http_conn对象，用fd索引，定时器计算超时时间时要用到
+static client_data *users_timer = NULL; // 时间轮定时器中的用户数据，用fd索引
+static async_mysql async_db;     // 登录查询用的非阻塞MySQL客户端
+#ifdef USER_STORE_MYSQL
+static mysql_store user_db;      // 用户名和密码的存储后端
+#else
+static local_store user_db;
+#endif
+
+// 舱壁隔离：静态文件请求和访问数据库的请求分别交给两个独立的线程池，各自有自己的线程数和队列上限
+// 登录/注册请求阻塞在MySQL上时，只会占满db_pool，static_pool照常处理静态文件请求
+static threadpool<http_conn> *static_pool = NULL; // 处理静态文件请求的工作线程池
+static threadpool<http_conn> *db_pool = NULL;     // 处理登录/注册请求的工作线程池
+
+#ifdef USER_STORE_MYSQL
+// 一个数据库的地址
+struct db_endpoint
+{
+    char host[64];
+    int port;
+};
+
+// 解析DB_REPLICAS，最多取max个从库，返回个数
+static int parse_replicas(db_endpoint *out, int max)
+{
+    char list[] = DB_REPLICAS;
+    int n = 0;
+    for (char *save, *host = strtok_r(list, ",", &save); host; host = strtok_r(NULL, ",", &save))
+    {
+        if (n == max)
+        {
+            LOG_WARN("too many replicas, %s ignored", host);
+            continue;
+        }
+        char *colon = strchr(host, ':');
+        out[n].port = colon ? atoi(colon + 1) : 3306;
+        if (colon)
+            *colon = '\0';
+        snprintf(out[n].host, sizeof(out[n].host), "%s", host);
+        ++n;
+    }
+    return n;
+}
+#endif
 
 // 传入一个信号值sig，将它通过管道发送给主线程
 void sig_handler(int sig)
@@ -62,22 +160,133 @@ void addsig(int sig, void(handler)(int), bool restart = true)
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
+// 把一个线程池本周期的队列深度和延迟写入日志
+void log_pool_stats(const char *name, threadpool<http_conn> *pool)
+{
+    pool_stats st;
+    pool->get_stats(st);
+    LOG_INFO("pool %s: threads=%d queued=%d requests=%lld avg_wait=%lldus max_wait=%lldus avg_service=%lldus shed=%lld",
+             name, st.threads, st.queued, st.requests, st.avg_wait_us, st.max_wait_us, st.avg_service_us, st.shed);
+}
+
 // 定时处理任务，重新定时以不断触发SIGALRM信号
 void timer_handler()
 {
-    timer_lst.tick(); // 检查链表上是否有到期任务
-    alarm(TIMESLOT);  // 过TIMESLOT秒后再次触发SIGALRM信号
+    timer_lst.tick(); // 推进时间轮，处理到期任务
+    http_conn::sweep_sessions(SESSION_SWEEP_BATCH); // 增量清理过期的会话
+    if (http_conn::m_async_db)
+        async_db.tick(); // 结束超时的异步查询，重连断开的异步数据库连接
+
+    static int stats_ticks = 0; // 距离上次导出运行统计过了几个TIMESLOT
+    if (++stats_ticks < STATS_INTERVAL)
+    {
+        alarm(TIMESLOT);
+        return;
+    }
+    stats_ticks = 0;
+
+    log_pool_stats("static", static_pool); // 导出每类请求的队列深度和延迟
+    log_pool_stats("db", db_pool);
+
+#ifdef USER_STORE_MYSQL
+    conn_pool_stats cst;
+    connection_pool::GetInstance()->GetStats(cst); // 导出数据库连接池的连接数、等待时长和重连情况
+    LOG_INFO("mysql pool: total=%d free=%d waits=%lld avg_wait=%lldus max_wait=%lldus timeouts=%lld created=%lld closed=%lld reconnects=%lld connect_failures=%lld",
+             cst.total, cst.free, cst.waits, cst.avg_wait_us, cst.max_wait_us, cst.timeouts, cst.created, cst.closed, cst.reconnects, cst.connect_failures);
+
+    // 导出查找缓存的命中情况和读请求在主从之间的分布
+    long long cache_hits, cache_misses, primary_reads, replica_reads[db_router::MAX_REPLICAS];
+    int replicas = user_db.get_read_stats(cache_hits, cache_misses, primary_reads, replica_reads);
+    char reads[db_router::MAX_REPLICAS * 21 + 1];
+    int len = 0;
+    reads[0] = '\0';
+    for (int i = 0; i < replicas; ++i)
+        len += snprintf(reads + len, sizeof(reads) - len, i ? ",%lld" : "%lld", replica_reads[i]);
+    LOG_INFO("mysql reads: cache_hits=%lld cache_misses=%lld primary=%lld replicas=[%s]", cache_hits, cache_misses, primary_reads, reads);
+#endif
+
+    int cached;
+    long long misses, evictions, register_batches, registered;
+    http_conn::get_user_stats(cached, misses, evictions, register_batches, registered); // 导出用户缓存的命中情况和注册的攒批情况
+    LOG_INFO("users: cached=%d misses=%lld evictions=%lld register_batches=%lld registered=%lld",
+             cached, misses, evictions, register_batches, registered);
+
+    int sessions;
+    long long sessions_created, session_hits, session_misses, sessions_expired;
+    http_conn::get_session_stats(sessions, sessions_created, session_hits, session_misses, sessions_expired); // 导出会话的新建、校验和过期情况
+    LOG_INFO("sessions: active=%d created=%lld hits=%lld misses=%lld expired=%lld",
+             sessions, sessions_created, session_hits, session_misses, sessions_expired);
+
+    alarm(TIMESLOT); // 过TIMESLOT秒后再次触发SIGALRM信号
 }
 
 // 定时器回调函数，删除非活动连接在epollfd上的注册事件，并关闭
 void cb_func(client_data *user_data)
 {
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0); // 取消监听
     assert(user_data);
-    close(user_data->sockfd);                   // 关闭socket连接
-    http_conn::m_user_count--;                  // http连接个数相应减少
+    users[user_data->sockfd].close_conn(); // 取消监听并关闭socket，连接的m_sockfd置为-1，还没回来的异步查询不会再恢复这个请求
     LOG_INFO("close fd %d", user_data->sockfd); // 输出日志
-    Log::get_instance()->flush();               // 强制刷新缓冲区
+}
+
+// 过载时直接在主线程回复的503响应，提前拼好，不需要经过工作线程
+static const char overload_response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                        "Content-Length:0\r\n"
+                                        "Retry-After:1\r\n"
+                                        "Connection:close\r\n\r\n";
+
+// 定时器到期时计算连接真正的超时时间：读请求头、读消息体、空行等待和发送响应各有各的期限
+long long conn_deadline(client_data *user_data)
+{
+    return users[user_data->sockfd].deadline(user_data->last_active);
+}
+
+// 连接进入新阶段后超时时间可能提前（比如空闲的长连接开始读请求头），这时立即移动定时器保证准时淘汰
+// 超时时间推迟的情况不用管，留给定时器到期时惰性刷新
+void refresh_conn_timer(client_data *user_data)
+{
+    long long deadline = conn_deadline(user_data);
+    if (deadline < user_data->timer.expire)
+    {
+        user_data->timer.expire = deadline;
+        timer_lst.adjust_timer(&user_data->timer);
+    }
+}
+
+// 新连接建立时启动它的定时器，定时器结点嵌在users_timer[connfd]里，不需要new
+void add_conn_timer(client_data *user_data, int connfd, const sockaddr_in &address, long long now)
+{
+    user_data->address = address;                       // 初始化该socket连接对应的定时器结点的用户数据
+    user_data->sockfd = connfd;                         // 初始化该socket连接对应的定时器结点的用户数据
+    user_data->last_active = now;                       // 刚建立的连接视为活跃
+    user_data->timer.user_data = user_data;             // 设置用户数据
+    user_data->timer.cb_func = cb_func;                 // 设置回调函数
+    user_data->timer.deadline_func = conn_deadline;     // 设置惰性刷新时计算超时时间的函数
+    user_data->timer.expire = conn_deadline(user_data); // 新连接处于空闲阶段，按空闲期限设置超时时间
+    timer_lst.add_timer(&user_data->timer);             // 将定时器结点插入到时间轮中
+}
+
+// 关闭连接并从时间轮中删除它的定时器
+void close_conn_timer(client_data *user_data)
+{
+    cb_func(user_data);                     // 删除非活动连接在epollfd上的注册事件，并关闭
+    timer_lst.del_timer(&user_data->timer); // 从时间轮中删除该定时器结点
+}
+
+// 线程池拒绝了请求，回复503后关闭连接并删除它的定时器
+void shed_request(client_data *user_data)
+{
+    ssize_t sent = send(user_data->sockfd, overload_response, sizeof(overload_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    users[user_data->sockfd].log_rejected(503, sent > 0 ? (int)sent : 0); // 被拒绝的请求也写一条访问日志
+    close_conn_timer(user_data);
+}
+
+// 异步查询完成后在主线程中调用，把暂停的登录请求重新交给数据库线程池
+void resume_request(http_conn *conn)
+{
+    int sockfd = conn - users;
+    conn->on_dispatch();
+    if (!db_pool->append(conn))
+        shed_request(&users_timer[sockfd]);
 }
 
 // 给connfd发送info错误信息，然后关闭connfd对应的socket连接
@@ -91,12 +300,16 @@ void show_error(int connfd, const char *info)
 int main(int argc, char *argv[])
 {
 #ifdef ASYNLOG
-    Log::get_instance()->init("ServerLog", 2000, 800000, 8); // 初始化异步日志
+    Log::get_instance()->init("ServerLog", 2000, 64 << 20, 8); // 初始化异步日志
 #endif
 
 #ifdef SYNLOG
-    Log::get_instance()->init("ServerLog", 2000, 800000, 0); // 初始化同步日志
+    Log::get_instance()->init("ServerLog", 2000, 64 << 20, 0); // 初始化同步日志
 #endif
+    Log::get_instance()->set_limit(LOG_LEVEL_DEBUG, 0, LOG_RATE_DEBUG);
+    Log::get_instance()->set_limit(LOG_LEVEL_INFO, 0, LOG_RATE_INFO);
+    Log::get_instance()->set_limit(LOG_LEVEL_WARN, 0, LOG_RATE_WARN);
+    Log::get_instance()->set_limit(LOG_LEVEL_ERROR, 0, LOG_RATE_ERROR);
 
     if (argc <= 1) // 没有输入端口号
     {
@@ -108,13 +321,32 @@ int main(int argc, char *argv[])
 
     addsig(SIGPIPE, SIG_IGN); // 监听到SIGPIPE信号直接忽略
 
+#ifdef USER_STORE_MYSQL
     connection_pool *connPool = connection_pool::GetInstance();  // 指向数据库连接池唯一实例的指针变量
-    connPool->init("localhost", "root", "root", "web", 3306, 8); // 数据库连接池初始化
+    connPool->init("localhost", "root", "root", "web", 3306, DB_MAX_CONN, DB_MIN_CONN, DB_WAIT_TIMEOUT_MS); // 数据库连接池初始化
+    user_db.init(connPool, REGISTER_WINDOW_MS, DB_CACHE_SIZE, DB_CACHE_TTL_MS, DB_CACHE_NEGATIVE_TTL_MS);
+
+    // 每个从库一个连接池，程序运行期间一直存在
+    db_endpoint replicas[db_router::MAX_REPLICAS];
+    int replica_count = parse_replicas(replicas, db_router::MAX_REPLICAS);
+    for (int i = 0; i < replica_count; ++i)
+    {
+        connection_pool *replica = new connection_pool;
+        replica->init(replicas[i].host, "root", "root", "web", replicas[i].port, DB_MAX_CONN, DB_MIN_CONN, DB_WAIT_TIMEOUT_MS);
+        user_db.add_replica(replica);
+    }
+#else
+    if (!user_db.open(LOCAL_STORE_PATH, LOCAL_STORE_SYNC)) // 打开本地存储，上次没有正常退出时从日志重建索引
+        return 1;
+#endif
 
-    threadpool<http_conn> *pool = NULL; // 指向http_conn类型的工作线程池
     try
     {
-        pool = new threadpool<http_conn>(connPool); // 创建线程池
+        // 静态文件请求只消耗CPU：常驻线程数等于CPU核数，不伸缩
+        // 登录/注册请求会阻塞在MySQL上：常驻线程少一些，阻塞时最多扩容到核数的4倍，队列也更短
+        int cpu_number = get_nprocs();
+        static_pool = new threadpool<http_conn>(cpu_number, 10000);       // 创建静态文件请求线程池
+        db_pool = new threadpool<http_conn>(2, 1000, cpu_number * 4); // 创建数据库请求线程池
     }
     catch (...) // 捕获所有异常
     {
@@ -122,14 +354,16 @@ int main(int argc, char *argv[])
     }
 
     // 用于存放「所有可能的」socket连接的数据，可以用fd来索引对应用户数据
-    http_conn *users = new http_conn[MAX_FD];
+    users = new http_conn[MAX_FD];
     assert(users);
 
-    // 作用仅仅是从数据库中取出用户名和密码，存放到http_conn.cpp里的全局变量map<string, string> users;
-    // 注意这里的users(http_conn)和上一条注释的users(map容器)不是同一个变量
+    // 作用仅仅是从存储中取出用户名和密码，存放到http_conn.cpp里的全局变量user_table users;
+    // 注意这里的users(http_conn)和上一条注释的users(user_table)不是同一个变量
     // users = users[0]，就是随便取一个users数组中的元素，然后调用它的initmysql_result()函数
-    // 所以其实map<string, string> users定义成类的静态成员变量会不会更合理？
-    users->initmysql_result(connPool);
+    // 所以其实user_table users定义成类的静态成员变量会不会更合理？
+    users->initmysql_result(&user_db, USER_CACHE_SIZE, USER_WARM_UP);
+    http_conn::init_sessions(MAX_SESSIONS, SESSION_TTL);
+    http_conn::m_require_session = SESSION_REQUIRED;
 
     int listenfd = socket(PF_INET, SOCK_STREAM, 0); // 主线程中的监听描述符
     assert(listenfd >= 0);
@@ -167,6 +401,27 @@ int main(int argc, char *argv[])
     addfd(epollfd, listenfd, false); // 把监听文件描述符listenfd加入监听表
     http_conn::m_epollfd = epollfd;  // http_conn类中m_epollfd其实就是主线程中的epollfd
 
+    // 设置连接各阶段的超时时间
+    http_conn::m_timeout.header_ms = HEADER_TIMEOUT * 1000;
+    http_conn::m_timeout.body_ms = BODY_TIMEOUT * 1000;
+    http_conn::m_timeout.idle_ms = IDLE_TIMEOUT * 1000;
+    http_conn::m_timeout.send_grace_ms = SEND_GRACE * 1000;
+    http_conn::m_timeout.min_send_rate = MIN_SEND_RATE;
+
+#ifdef USER_STORE_MYSQL
+    // 客户端库支持非阻塞接口时，登录查询改在主线程的epoll里异步执行，否则仍由工作线程阻塞查询
+    if (ASYNC_DB_CONN > 0 && async_db.init("localhost", "root", "root", "web", 3306, ASYNC_DB_CONN, epollfd))
+    {
+        for (int i = 0; i < replica_count; ++i)
+            if (!async_db.add_replica(replicas[i].host, "root", "root", "web", replicas[i].port, ASYNC_DB_CONN))
+                LOG_WARN("async mysql: replica %s:%d unavailable", replicas[i].host, replicas[i].port);
+        http_conn::m_async_db = &async_db;
+        http_conn::m_resume = resume_request;
+    }
+    else if (ASYNC_DB_CONN > 0)
+        LOG_WARN("%s", "async mysql unavailable, login queries block worker threads");
+#endif
+
     // 给信号处理函数用的，实现统一信号源
     // 注意，用socketpair创建的管道pipefd[0] 和pipefd[1] 都是可读可写的，但一般还是用0读，1写
     ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
@@ -182,11 +437,13 @@ int main(int argc, char *argv[])
     // 添加监听信号，不使用restart参数
     addsig(SIGALRM, sig_handler, false); // 定时器信号
     addsig(SIGTERM, sig_handler, false); // 终止进程信号
+    addsig(SIGUSR1, sig_handler, false); // 调低日志级别（输出更多日志）
+    addsig(SIGUSR2, sig_handler, false); // 调高日志级别（输出更少日志）
 
     bool stop_server = false; // 是否停止服务器运行
 
-    // 指向定时器链表中用户数据的指针变量，可用users_timer[fd]索引fd的用户数据
-    client_data *users_timer = new client_data[MAX_FD];
+    // 时间轮定时器中的用户数据，可用users_timer[fd]索引fd的用户数据
+    users_timer = new client_data[MAX_FD];
 
     bool timeout = false; // 超时标志
     alarm(TIMESLOT);      // TIMESLOT秒后会触发SIGALRM信号
@@ -201,6 +458,8 @@ int main(int argc, char *argv[])
             break;
         }
 
+        long long loop_now = now_ms(); // 本轮事件共用的当前时间，避免每个事件都取一次时间
+
         // 依次遍历evnents上监听到的事件
         for (int i = 0; i < number; i++)
         {
@@ -232,19 +491,8 @@ int main(int argc, char *argv[])
                     continue;
                 }
 
-                users[connfd].init(connfd, client_address); // 初始化该socket连接对应的http_conn对象的数据成员
-
-                users_timer[connfd].address = client_address; // 初始化该socket连接对应的定时器链表中结点的用户数据
-                users_timer[connfd].sockfd = connfd;          // 初始化该socket连接对应的定时器链表中结点的用户数据
-                util_timer *timer = new util_timer;           // 创建定时器结点
-                timer->user_data = &users_timer[connfd];      // 设置用户数据
-                timer->cb_func = cb_func;                     // 设置回调函数
-
-                time_t cur = time(NULL);            // 获取当前时间
-                timer->expire = cur + 3 * TIMESLOT; // 设置超时时间为3倍的TIMESLOT
-
-                users_timer[connfd].timer = timer; // 有点套娃，用户数据里的timer指针存放了定时器链表中的结点信息
-                timer_lst.add_timer(timer);        // 将新的定时器结点插入到定时器链表的正确位置
+                users[connfd].init(connfd, client_address);                         // 初始化该socket连接对应的http_conn对象的数据成员
+                add_conn_timer(&users_timer[connfd], connfd, client_address, loop_now); // 启动该连接的定时器
 
 #endif
 
@@ -268,37 +516,24 @@ int main(int argc, char *argv[])
                         break;
                     }
 
-                    users[connfd].init(connfd, client_address); // 初始化该socket连接对应的http_conn对象的数据成员
-
-                    users_timer[connfd].address = client_address; // 初始化该socket连接对应的定时器链表中结点的用户数据
-                    users_timer[connfd].sockfd = connfd;          // 初始化该socket连接对应的定时器链表中结点的用户数据
-
-                    util_timer *timer = new util_timer;      // 创建定时器结点
-                    timer->user_data = &users_timer[connfd]; // 设置用户数据
-                    timer->cb_func = cb_func;                // 设置回调函数
-
-                    time_t cur = time(NULL);            // 获取当前时间
-                    timer->expire = cur + 3 * TIMESLOT; // 设置超时时间为3倍的TIMESLOT
-                    users_timer[connfd].timer = timer;  // 有点套娃，用户数据里的timer指针存放了定时器链表中的结点信息
-
-                    timer_lst.add_timer(timer); // 将新的定时器结点插入到定时器链表的正确位置
+                    users[connfd].init(connfd, client_address);                         // 初始化该socket连接对应的http_conn对象的数据成员
+                    add_conn_timer(&users_timer[connfd], connfd, client_address, loop_now); // 启动该连接的定时器
                 }
 
                 continue; // 接收完所有新连接后，处理下一个内核事件（后续用的是else if所以这个continue其实也没必要）
 #endif
             }
 
+            // 异步数据库连接和它的通知eventfd上的事件，推进正在执行的查询（出错也交给它处理，不能当作客户连接关闭）
+            else if (http_conn::m_async_db && async_db.owns(sockfd))
+            {
+                async_db.handle(sockfd, events[i].events);
+            }
+
             // 不管是哪个文件描述符出现以下3个错误，我们都服务器端关闭连接，移除对应的定时器
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
-                util_timer *timer = users_timer[sockfd].timer; // 获取该socket连接对应的定时器结点
-                timer->cb_func(&users_timer[sockfd]);
-
-                // 如果定时器结点存在（注意：管道的timer不存在）
-                if (timer)
-                {
-                    timer_lst.del_timer(timer);
-                }
+                close_conn_timer(&users_timer[sockfd]); // 关闭连接并删除它的定时器
             }
 
             // 处理管道上的可读信号
@@ -334,6 +569,16 @@ int main(int argc, char *argv[])
                         case SIGTERM:
                         {
                             stop_server = true; // 服务器停止运行的信号
+                            break;
+                        }
+
+                        case SIGUSR1:
+                        case SIGUSR2:
+                        {
+                            // 不用重启服务就能调整日志级别，比如线上默认WARN，排查问题时临时打开INFO
+                            Log::set_level(Log::get_level() + (signals[i] == SIGUSR1 ? -1 : 1));
+                            LOG_WARN("log level set to %d", Log::get_level());
+                            break;
                         }
                         }
                     }
@@ -343,63 +588,41 @@ int main(int argc, char *argv[])
             // 处理客户连接上接收到的数据
             else if (events[i].events & EPOLLIN)
             {
-                util_timer *timer = users_timer[sockfd].timer; // 获取该socket连接对应的定时器结点，等会要更新其超时时间
-
                 if (users[sockfd].read_once()) // 读取客户数据
                 {
-
-                    LOG_INFO("deal with the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr)); // 将网络字节序的IP地址转换为点分十进制的IP地址
-                    Log::get_instance()->flush();                                                           // 强制刷新缓冲区
-
-                    pool->append(users + sockfd); // 若监测到读事件，将该事件放入请求队列中，工作线程池中的某个线程会处理这个事件
-
-                    if (timer)
+                    // 若监测到读事件，先根据请求行分类，再放入对应线程池的请求队列中，工作线程池中的某个线程会处理这个事件
+                    // 若有数据传输，记录最后活跃时间；刚开始读请求头时超时时间会提前，需要移动定时器
+                    users_timer[sockfd].last_active = loop_now;
+                    refresh_conn_timer(&users_timer[sockfd]);
+
+                    threadpool<http_conn> *pool = users[sockfd].classify() == http_conn::DB_REQUEST ? db_pool : static_pool;
+                    users[sockfd].on_dispatch(); // 请求交给线程池后不按读写期限淘汰，避免关闭正在被工作线程使用的连接
+                    if (!pool->append(users + sockfd))
                     {
-                        time_t cur = time(NULL);             // 获取当前时间
-                        timer->expire = cur + 3 * TIMESLOT;  // 若有数据传输，则将定时器往后延迟3个单位
-                        LOG_INFO("%s", "adjust timer once"); // 输出日志
-                        Log::get_instance()->flush();        // 强制刷新缓冲区
-                        timer_lst.adjust_timer(timer);       // 并对新的定时器在链表上的位置进行调整
+                        shed_request(&users_timer[sockfd]); // 线程池过载拒绝了请求，直接回复503并关闭连接
+                        continue;
                     }
                 }
 
                 else // 读取失败，关闭连接
                 {
-                    timer->cb_func(&users_timer[sockfd]); // 调用定时器的回调函数，即删除非活动连接在epollfd上的注册事件，并关闭
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer); // 从定时器链表中删除该定时器结点
-                    }
+                    close_conn_timer(&users_timer[sockfd]); // 删除非活动连接在epollfd上的注册事件并关闭，再删除它的定时器
                 }
             }
 
             // 处理客户连接上的可写事件
             else if (events[i].events & EPOLLOUT)
             {
-                util_timer *timer = users_timer[sockfd].timer; // 获取该socket连接对应的定时器结点，等会要更新其超时时间
-
                 if (users[sockfd].write()) // 向客户发送数据
                 {
-                    LOG_INFO("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr)); // 将网络字节序的IP地址转换为点分十进制的IP地址
-                    Log::get_instance()->flush();                                                              // 强制刷新缓冲区
-
-                    if (timer)
-                    {
-                        time_t cur = time(NULL);             // 获取当前时间
-                        timer->expire = cur + 3 * TIMESLOT;  // 若有数据传输，则将定时器往后延迟3个单位
-                        LOG_INFO("%s", "adjust timer once"); // 输出日志
-                        Log::get_instance()->flush();        // 强制刷新缓冲区
-                        timer_lst.adjust_timer(timer);       // 并对新的定时器在链表上的位置进行调整
-                    }
+                    // 若有数据传输，记录最后活跃时间；刚开始发送响应时超时时间可能提前，需要移动定时器
+                    users_timer[sockfd].last_active = loop_now;
+                    refresh_conn_timer(&users_timer[sockfd]);
                 }
 
                 else // 写入失败，关闭连接
                 {
-                    timer->cb_func(&users_timer[sockfd]); // 调用定时器的回调函数，即删除非活动连接在epollfd上的注册事件，并关闭
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer); // 从定时器链表中删除该定时器结点
-                    }
+                    close_conn_timer(&users_timer[sockfd]); // 删除非活动连接在epollfd上的注册事件并关闭，再删除它的定时器
                 }
             }
         }
@@ -414,8 +637,14 @@ int main(int argc, char *argv[])
     close(listenfd);
     close(pipefd[1]);
     close(pipefd[0]);
+    delete static_pool; // 等工作线程处理完手上的请求并退出，之后才能释放连接和关闭存储
+    delete db_pool;
+    http_conn::stop_warm_up();
+    timer_lst.clear(); // 定时器结点在users_timer里，释放之前先从时间轮上摘下来
     delete[] users;
     delete[] users_timer;
-    delete pool;
+#ifdef USER_STORE_LOCAL
+    user_db.close(); // 把索引标记为正常关闭，下次启动不用重建
+#endif
     return 0;
 }
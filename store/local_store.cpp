@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "local_store.h"
+#include "../log/log.h"
+
+static const uint64_t INDEX_MAGIC = 0x5844495245535557ULL; // "WUSERIDX"
+static const uint32_t INDEX_VERSION = 1;
+
+// 按字节查表的crc32（多项式0xEDB88320），表在第一次用到时生成
+static const uint32_t *crc_table()
+{
+    static struct table
+    {
+        uint32_t v[256];
+        table()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+                v[i] = c;
+            }
+        }
+    } t;
+    return t.v;
+}
+
+static uint32_t crc_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint32_t *t = crc_table();
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; ++i)
+        crc = t[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+uint32_t local_store::crc_of(const char *name, size_t name_len, const char *passwd, size_t passwd_len)
+{
+    uint16_t lens[2] = {(uint16_t)name_len, (uint16_t)passwd_len};
+    uint32_t crc = crc_update(0xFFFFFFFFU, lens, sizeof(lens));
+    crc = crc_update(crc, name, name_len);
+    crc = crc_update(crc, passwd, passwd_len);
+    return ~crc;
+}
+
+// FNV-1a，和user_table一样混合一下高位，低位用来选槽位
+uint64_t local_store::hash_of(const char *name, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 29;
+    return h;
+}
+
+void local_store::free_index(void *p)
+{
+    index_map *idx = (index_map *)p;
+    munmap(idx->header, idx->size);
+    ::close(idx->fd);
+    delete idx;
+}
+
+local_store::local_store() : m_sync_writes(false), m_log_fd(-1), m_log_map(NULL), m_log_end(0), m_index(NULL), m_inserted(0)
+{
+    m_log_path[0] = '\0';
+    m_index_path[0] = '\0';
+}
+
+local_store::~local_store()
+{
+    close();
+}
+
+// 映射一个索引文件，create为true时新建（已有的会被清空），否则打开已有的并检查文件头
+local_store::index_map *local_store::map_index(const char *path, uint64_t capacity, bool create)
+{
+    int fd = ::open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (fd < 0)
+        return NULL;
+
+    if (!create)
+    {
+        index_header h;
+        struct stat st;
+        if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || fstat(fd, &st) ||
+            h.magic != INDEX_MAGIC || h.version != INDEX_VERSION ||
+            h.capacity < MIN_CAPACITY || (h.capacity & (h.capacity - 1)) ||
+            (uint64_t)st.st_size != sizeof(index_header) + h.capacity * sizeof(slot))
+        {
+            ::close(fd);
+            return NULL;
+        }
+        capacity = h.capacity;
+    }
+
+    size_t size = sizeof(index_header) + capacity * sizeof(slot);
+    void *map = MAP_FAILED;
+    if (!create || !ftruncate(fd, size)) // 新文件全是0，所有槽位都是空的
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        int err = errno; // 调用者要拿到失败的原因，不能被close改掉
+        ::close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    index_map *idx = new index_map;
+    idx->fd = fd;
+    idx->size = size;
+    idx->header = (index_header *)map;
+    idx->slots = (slot *)(idx->header + 1);
+    idx->mask = capacity - 1;
+    if (create)
+    {
+        idx->header->magic = INDEX_MAGIC;
+        idx->header->version = INDEX_VERSION;
+        idx->header->clean = 0;
+        idx->header->capacity = capacity;
+        idx->header->count = 0;
+        idx->header->log_end = 0;
+    }
+    return idx;
+}
+
+// 打开已有的索引，只有上次正常关闭并且和日志的长度对得上时才能直接用
+bool local_store::load_index()
+{
+    index_map *idx = map_index(m_index_path, 0, false);
+    if (!idx)
+        return false;
+
+    struct stat st;
+    if (fstat(m_log_fd, &st) || idx->header->clean != 1 || idx->header->log_end != (uint64_t)st.st_size)
+    {
+        free_index(idx);
+        return false;
+    }
+    m_index.store(idx, std::memory_order_release);
+    m_log_end.store(idx->header->log_end, std::memory_order_release);
+    return true;
+}
+
+// 从头扫描日志重建索引，日志末尾残缺或者校验不通过的记录截断掉
+bool local_store::rebuild_index()
+{
+    struct stat st;
+    if (fstat(m_log_fd, &st))
+        return false;
+    uint64_t size = st.st_size;
+
+    index_map *idx = map_index(m_index_path, MIN_CAPACITY, true);
+    if (!idx)
+        return false;
+    m_index.store(idx, std::memory_order_release);
+
+    uint64_t end = 0;
+    long long records = 0;
+    while (end + sizeof(record_header) <= size)
+    {
+        record_header h;
+        memcpy(&h, m_log_map + end, sizeof(h));
+        uint64_t total = sizeof(h) + h.name_len + h.passwd_len;
+        if (h.name_len > MAX_FIELD_LEN || h.passwd_len > MAX_FIELD_LEN || end + total > size)
+            break;
+        const char *name = m_log_map + end + sizeof(h);
+        if (crc_of(name, h.name_len, name + h.name_len, h.passwd_len) != h.crc)
+            break;
+
+        uint64_t hash = hash_of(name, h.name_len);
+        uint64_t offset;
+        if (!lookup(name, h.name_len, hash, offset)) // 重复的用户名以第一次写入的为准
+        {
+            int err;
+            if ((idx->header->count + 1) * 100 > (idx->mask + 1) * MAX_LOAD && (err = grow_index()))
+            {
+                errno = err; // open按errno打日志
+                return false;
+            }
+            idx = m_index.load(std::memory_order_relaxed);
+            put(idx, hash, end);
+        }
+        end += total;
+        ++records;
+    }
+
+    if (end < size)
+    {
+        LOG_WARN("local store %s: truncate %llu torn bytes at %llu", m_log_path, (unsigned long long)(size - end), (unsigned long long)end);
+        if (ftruncate(m_log_fd, end))
+            return false;
+    }
+    m_log_end.store(end, std::memory_order_release);
+    LOG_INFO("local store %s: rebuilt index from %lld records", m_log_path, records);
+    return true;
+}
+
+// 建一个两倍大的新索引，rename替换旧的索引文件后发布，旧的映射等读者离开后再解除，调用者持有写锁
+// 成功返回0，否则返回错误码
+int local_store::grow_index()
+{
+    index_map *old = m_index.load(std::memory_order_relaxed);
+    char tmp_path[sizeof(m_index_path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", m_index_path);
+
+    index_map *idx = map_index(tmp_path, (old->mask + 1) * 2, true);
+    if (!idx)
+        return errno ? errno : ENOMEM;
+    for (uint64_t i = 0; i <= old->mask; ++i)
+    {
+        uint64_t offset = old->slots[i].offset.load(std::memory_order_relaxed);
+        if (offset)
+            put(idx, old->slots[i].hash.load(std::memory_order_relaxed), offset - 1);
+    }
+    if (rename(tmp_path, m_index_path))
+    {
+        int err = errno;
+        free_index(idx);
+        unlink(tmp_path);
+        return err;
+    }
+
+    m_index.store(idx, std::memory_order_release);
+    m_epoch.retire(old, free_index);
+    m_epoch.collect();
+    return 0;
+}
+
+// 把日志偏移offset处的记录放进索引，调用者持有写锁
+void local_store::put(index_map *idx, uint64_t hash, uint64_t offset)
+{
+    uint64_t i = hash & idx->mask;
+    while (idx->slots[i].offset.load(std::memory_order_relaxed))
+        i = (i + 1) & idx->mask;
+    idx->slots[i].hash.store(hash, std::memory_order_relaxed);
+    idx->slots[i].offset.store(offset + 1, std::memory_order_release);
+    ++idx->header->count;
+}
+
+// 在当前索引中查找用户名，找到时offset为记录在日志中的偏移；调用者在epoch_guard内或者持有写锁
+bool local_store::lookup(const char *name, size_t len, uint64_t hash, uint64_t &offset)
+{
+    index_map *idx = m_index.load(std::memory_order_acquire);
+    for (uint64_t i = hash & idx->mask;; i = (i + 1) & idx->mask)
+    {
+        uint64_t off = idx->slots[i].offset.load(std::memory_order_acquire);
+        if (!off)
+            return false;
+        if (idx->slots[i].hash.load(std::memory_order_relaxed) != hash)
+            continue;
+
+        record_header h;
+        memcpy(&h, m_log_map + off - 1, sizeof(h));
+        if (h.name_len == len && memcmp(m_log_map + off - 1 + sizeof(h), name, len) == 0)
+        {
+            offset = off - 1;
+            return true;
+        }
+    }
+}
+
+// 成功返回0，否则返回错误码；pwrite写不进去又不报错时按EIO算
+int local_store::write_all(const char *buf, size_t len, uint64_t offset)
+{
+    while (len)
+    {
+        ssize_t n = pwrite(m_log_fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno;
+        if (n == 0)
+            return EIO;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// clean为false时把索引标记为使用中，崩溃后再打开会重建；为true时先把日志和整个索引刷盘，再标记为正常关闭
+bool local_store::mark_clean(bool clean)
+{
+    index_map *idx = m_index.load(std::memory_order_relaxed);
+    if (clean)
+    {
+        idx->header->log_end = m_log_end.load(std::memory_order_relaxed);
+        if (fdatasync(m_log_fd) || msync(idx->header, idx->size, MS_SYNC))
+            return false;
+    }
+    idx->header->clean = clean ? 1 : 0;
+    return msync(idx->header, sizeof(index_header), MS_SYNC) == 0;
+}
+
+bool local_store::open(const char *path, bool sync_writes)
+{
+    if (m_log_fd >= 0)
+        return false;
+    snprintf(m_log_path, sizeof(m_log_path), "%s.log", path);
+    snprintf(m_index_path, sizeof(m_index_path), "%s.idx", path);
+    m_sync_writes = sync_writes;
+
+    m_log_fd = ::open(m_log_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_log_fd < 0 || flock(m_log_fd, LOCK_EX | LOCK_NB)) // 同一份数据只能有一个进程打开
+    {
+        LOG_ERROR("local store %s: open failed: %s", m_log_path, strerror(errno));
+        close();
+        return false;
+    }
+
+    // 一次映射整个预留空间，日志变长不用重新映射，读者拿到的地址一直有效
+    void *map = mmap(NULL, MAX_LOG_SIZE, PROT_READ, MAP_SHARED | MAP_NORESERVE, m_log_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        LOG_ERROR("local store %s: mmap failed: %s", m_log_path, strerror(errno));
+        close();
+        return false;
+    }
+    m_log_map = (const char *)map;
+
+    if (!load_index() && !rebuild_index())
+    {
+        LOG_ERROR("local store %s: rebuild index failed: %s", m_index_path, strerror(errno));
+        index_map *idx = m_index.exchange(NULL, std::memory_order_relaxed); // 重建了一半的索引不能标记为正常关闭
+        if (idx)
+            free_index(idx);
+        close();
+        return false;
+    }
+    if (!mark_clean(false))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void local_store::close()
+{
+    if (m_log_fd < 0)
+        return;
+
+    index_map *idx = m_index.load(std::memory_order_relaxed);
+    if (idx)
+    {
+        if (!mark_clean(true))
+            LOG_ERROR("local store %s: sync on close failed: %s", m_index_path, strerror(errno));
+        m_index.store(NULL, std::memory_order_relaxed);
+        free_index(idx);
+    }
+    m_epoch.collect();
+    if (m_log_map)
+        munmap((void *)m_log_map, MAX_LOG_SIZE);
+    m_log_map = NULL;
+    ::close(m_log_fd);
+    m_log_fd = -1;
+}
+
+int local_store::find(const char *name, char *passwd, size_t len)
+{
+    size_t name_len = strlen(name);
+    if (name_len > MAX_FIELD_LEN)
+        return 0;
+
+    epoch_guard guard(m_epoch);
+    uint64_t offset;
+    if (!lookup(name, name_len, hash_of(name, name_len), offset))
+        return 0;
+
+    record_header h;
+    memcpy(&h, m_log_map + offset, sizeof(h));
+    size_t n = h.passwd_len < len - 1 ? h.passwd_len : len - 1;
+    memcpy(passwd, m_log_map + offset + sizeof(h) + h.name_len, n);
+    passwd[n] = '\0';
+    return 1;
+}
+
+int local_store::insert(const char *name, const char *passwd)
+{
+    size_t name_len = strlen(name), passwd_len = strlen(passwd);
+    if (name_len > MAX_FIELD_LEN || passwd_len > MAX_FIELD_LEN)
+        return EINVAL;
+
+    char buf[sizeof(record_header) + 2 * MAX_FIELD_LEN];
+    record_header h;
+    h.crc = crc_of(name, name_len, passwd, passwd_len);
+    h.name_len = name_len;
+    h.passwd_len = passwd_len;
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), name, name_len);
+    memcpy(buf + sizeof(h) + name_len, passwd, passwd_len);
+    size_t total = sizeof(h) + name_len + passwd_len;
+    uint64_t hash = hash_of(name, name_len);
+
+    m_write_lock.lock();
+    uint64_t offset;
+    int err = 0;
+    uint64_t end = m_log_end.load(std::memory_order_relaxed);
+    index_map *idx = m_index.load(std::memory_order_relaxed);
+    if (lookup(name, name_len, hash, offset))
+        err = EEXIST;
+    else if (end + total > MAX_LOG_SIZE)
+        err = ENOSPC;
+    else if ((idx->header->count + 1) * 100 > (idx->mask + 1) * MAX_LOAD)
+        err = grow_index(); // 先扩容，扩容失败时日志还没动
+
+    if (!err)
+    {
+        err = write_all(buf, total, end);
+        if (!err && m_sync_writes && fdatasync(m_log_fd))
+            err = errno;
+        if (err)
+        {
+            if (ftruncate(m_log_fd, end)) // 写了一半的记录去掉，不然下一条记录会接在它后面
+                LOG_ERROR("local store %s: truncate after failed write: %s", m_log_path, strerror(errno));
+        }
+        else
+        {
+            // 记录已经完整写入，这时才发布到索引，读者看到偏移时记录一定是完整的
+            put(m_index.load(std::memory_order_relaxed), hash, end);
+            m_log_end.store(end + total, std::memory_order_release);
+            m_inserted.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    m_write_lock.unlock();
+    return err;
+}
+
+int local_store::scan(char *cursor, size_t cursor_len, user_row_handler on_row, void *arg)
+{
+    uint64_t offset = cursor[0] ? strtoull(cursor, NULL, 10) : 0;
+    uint64_t end = m_log_end.load(std::memory_order_acquire);
+    int rows = 0;
+    char name[MAX_FIELD_LEN + 1], passwd[MAX_FIELD_LEN + 1];
+    while (offset < end && rows < SCAN_PAGE_SIZE)
+    {
+        record_header h;
+        memcpy(&h, m_log_map + offset, sizeof(h));
+        memcpy(name, m_log_map + offset + sizeof(h), h.name_len);
+        name[h.name_len] = '\0';
+        memcpy(passwd, m_log_map + offset + sizeof(h) + h.name_len, h.passwd_len);
+        passwd[h.passwd_len] = '\0';
+        on_row(name, passwd, arg);
+        offset += sizeof(h) + h.name_len + h.passwd_len;
+        ++rows;
+    }
+    snprintf(cursor, cursor_len, "%llu", (unsigned long long)offset);
+    return rows;
+}
+
+// 本地存储每次插入单独写一次日志，批数和用户数相同
+void local_store::get_write_stats(long long &batches, long long &rows)
+{
+    rows = m_inserted.exchange(0, std::memory_order_relaxed);
+    batches = rows;
+}
@@ -0,0 +1,108 @@
+#ifndef LOCAL_STORE_H
+#define LOCAL_STORE_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include "user_store.h"
+#include "../lock/locker.h"
+#include "../lock/epoch.h"
+
+/****************************************************************************************/
+/* 内嵌的本地用户存储引擎，不需要数据库服务，数据在「path.log」和「path.idx」两个文件里          */
+/*   日志文件只追加：每个用户一条记录{crc32, 用户名长度, 密码长度, 用户名, 密码}，                 */
+/*   整个文件映射在一段预留好的地址空间上，记录追加之后直接从映射的内存里读，不用read系统调用      */
+/*   索引文件是mmap的开放寻址哈希表，槽位里存用户名的哈希值和记录在日志中的偏移                   */
+/* 查找完全无锁：写者先写槽位里的哈希值，再用release语义发布偏移，读者用acquire语义读偏移        */
+/*   索引装载率超过70%时写者建一个两倍大的新索引文件，rename替换后整体发布，                     */
+/*   旧索引的映射交给epoch_domain，等没有读者之后再解除                                         */
+/* 插入由一把写锁串行化，先追加日志记录，再写索引；sync_writes为true时每次插入都fdatasync日志   */
+/* 启动恢复：索引头里记着是否正常关闭和当时的日志长度，不一致（崩溃、断电）时丢掉索引，           */
+/*   从头扫描日志重建，遇到校验不通过的残缺记录就把日志截断到那里                                */
+/****************************************************************************************/
+
+class local_store : public user_store
+{
+private:
+    static const uint64_t MAX_LOG_SIZE = 1ULL << 36; // 日志文件的上限，也是预留的地址空间大小
+    static const uint64_t MIN_CAPACITY = 1 << 16;    // 索引最少的槽位数
+    static const int MAX_LOAD = 70;                  // 索引装载率超过70%就扩容
+    static const int SCAN_PAGE_SIZE = 1000;          // scan()每页最多读多少个用户
+    static const size_t MAX_FIELD_LEN = 255;         // 用户名和密码的最大长度
+
+    // 日志记录头，后面紧跟用户名和密码，不以'\0'结尾
+    struct record_header
+    {
+        uint32_t crc;        // 长度、用户名和密码的crc32
+        uint16_t name_len;
+        uint16_t passwd_len;
+    };
+
+    // 索引文件头，独占一个cache line，后面是槽位数组
+    struct alignas(64) index_header
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t clean;    // 1表示正常关闭，索引和日志一致
+        uint64_t capacity; // 槽位数，2的幂
+        uint64_t count;    // 已经用了的槽位数
+        uint64_t log_end;  // 索引覆盖到的日志长度
+    };
+
+    // 索引槽位
+    struct slot
+    {
+        std::atomic<uint64_t> hash;   // 用户名的哈希值，先于offset写入
+        std::atomic<uint64_t> offset; // 记录在日志中的偏移+1，0表示空槽位
+    };
+
+    // 一个映射好的索引文件
+    struct index_map
+    {
+        int fd;
+        size_t size;
+        index_header *header;
+        slot *slots;
+        uint64_t mask;
+    };
+
+    char m_log_path[256];
+    char m_index_path[256];
+    bool m_sync_writes;
+    int m_log_fd;
+    const char *m_log_map;              // 日志的只读映射，大小固定为MAX_LOG_SIZE
+    std::atomic<uint64_t> m_log_end;    // 已经完整写入并建好索引的日志长度，读者只看这之前的记录
+    std::atomic<index_map *> m_index;   // 当前的索引，读者无锁读取
+    locker m_write_lock;                // 串行化插入和扩容
+    epoch_domain m_epoch;               // 回收被替换下来的索引映射
+    std::atomic<long long> m_inserted;  // 插入了多少个用户
+
+    static uint64_t hash_of(const char *name, size_t len);
+    static uint32_t crc_of(const char *name, size_t name_len, const char *passwd, size_t passwd_len);
+    static void free_index(void *p);
+
+    index_map *map_index(const char *path, uint64_t capacity, bool create);
+    bool load_index();
+    bool rebuild_index();
+    int grow_index();
+    void put(index_map *idx, uint64_t hash, uint64_t offset);
+    bool lookup(const char *name, size_t len, uint64_t hash, uint64_t &offset);
+    int write_all(const char *buf, size_t len, uint64_t offset);
+    bool mark_clean(bool clean);
+
+public:
+    local_store();
+    ~local_store();
+
+    // 打开或创建path.log和path.idx，需要时从日志重建索引；sync_writes表示每次插入是否刷盘
+    bool open(const char *path, bool sync_writes);
+    // 把索引标记为正常关闭并刷盘，下次打开时不用重建
+    void close();
+
+    int find(const char *name, char *passwd, size_t len);
+    int insert(const char *name, const char *passwd);
+    int scan(char *cursor, size_t cursor_len, user_row_handler on_row, void *arg); // cursor是十进制的日志偏移
+    void get_write_stats(long long &batches, long long &rows);
+};
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef MYSQL_STORE_H
+#define MYSQL_STORE_H
+
+#include <string.h>
+#include <stdio.h>
+#include "user_store.h"
+#include "../CGImysql/sql_connection_pool.h"
+#include "../CGImysql/register_batcher.h"
+#include "../CGImysql/db_router.h"
+#include "../CGImysql/result_cache.h"
+
+/****************************************************************************************/
+/* 存在MySQL的user表里的用户存储                                                            */
+/*   查找和分页遍历由db_router分给从库，从连接池取连接执行预处理语句，用完马上归还                */
+/*   注册交给register_batcher，和同时到达的其他注册攒成一批写入主库                              */
+/*   从库上没查到（可能是刚注册、还没同步过来）或者出错时回主库再查一次                          */
+/*   查找的结果（包括没查到）放进result_cache，热门的用户名在过期之前不再查库；                    */
+/*   注册成功后更新缓存里的结果，刚注册的用户不会因为缓存了「没有」而登录不上                      */
+/****************************************************************************************/
+
+class mysql_store : public user_store
+{
+private:
+    connection_pool *m_pool; // 主库
+    register_batcher m_registrar;
+    db_router m_router;
+    result_cache m_cache;
+
+    // 把MYSQL_ROW形式的一行转给调用者的回调，同时记下这一页最后一个用户名
+    struct page
+    {
+        user_row_handler on_row;
+        void *arg;
+        char *cursor;
+        size_t cursor_len;
+    };
+
+    static void page_row(char **row, void *arg)
+    {
+        page *p = (page *)arg;
+        snprintf(p->cursor, p->cursor_len, "%s", row[0]);
+        p->on_row(row[0], row[1] ? row[1] : "", p->arg);
+    }
+
+    // 按用户名查一次密码，primary为false时由路由选库，replica返回实际查的是不是从库
+    int query(const char *name, char *passwd, size_t len, bool primary, bool &replica)
+    {
+        db_router::lease db(m_router, primary);
+        replica = db.replica();
+        if (!db.mysql)
+            return -1;
+
+        const char *params[] = {name};
+        int found = db.pool()->QueryRow(db.mysql, STMT_FIND_USER, params, passwd, len);
+        if (found < 0)
+            db.fail();
+        return found;
+    }
+
+    int scan_page(char *cursor, size_t cursor_len, user_row_handler on_row, void *arg, bool primary, bool &replica)
+    {
+        db_router::lease db(m_router, primary);
+        replica = db.replica();
+        if (!db.mysql)
+            return -1;
+
+        char last[256]; // 回调会改写cursor，参数用一份拷贝
+        snprintf(last, sizeof(last), "%s", cursor);
+        const char *params[] = {last};
+        page p = {on_row, arg, cursor, cursor_len};
+        int rows = db.pool()->QueryRows(db.mysql, STMT_PAGE_USERS, params, page_row, &p);
+        if (rows < 0)
+            db.fail();
+        return rows;
+    }
+
+public:
+    mysql_store() : m_pool(NULL)
+    {
+    }
+
+    // pool为主库的连接池，register_window_ms为注册攒批写入数据库的最长等待时间
+    // 查找结果最多缓存cache_size个，查到的缓存ttl_ms毫秒，没查到的缓存negative_ttl_ms毫秒
+    bool init(connection_pool *pool, int register_window_ms, size_t cache_size, int ttl_ms, int negative_ttl_ms)
+    {
+        m_pool = pool;
+        m_router.init(pool);
+        m_cache.init(cache_size, ttl_ms, negative_ttl_ms);
+        return m_registrar.start(pool, register_window_ms);
+    }
+
+    // 加一个只读的从库，在init之后、开始处理请求之前调用
+    bool add_replica(connection_pool *pool)
+    {
+        return m_router.add_replica(pool);
+    }
+
+    int find(const char *name, char *passwd, size_t len)
+    {
+        int found = m_cache.get(name, passwd, len);
+        if (found >= 0)
+            return found;
+
+        bool replica;
+        found = query(name, passwd, len, false, replica);
+        if (found <= 0 && replica)
+            found = query(name, passwd, len, true, replica);
+        remember(name, found, passwd);
+        return found;
+    }
+
+    int insert(const char *name, const char *passwd)
+    {
+        int res = m_registrar.submit(name, passwd); // 等这一批提交完，成功返回0
+        if (!res)
+            m_cache.put(name, 1, passwd);
+        else
+            m_cache.erase(name); // 注册前查到的「没有」不一定对了，比如用户名在数据库里已经有了
+        return res;
+    }
+
+    int peek(const char *name, char *passwd, size_t len)
+    {
+        return m_cache.get(name, passwd, len);
+    }
+
+    void remember(const char *name, int found, const char *passwd)
+    {
+        if (found >= 0)
+            m_cache.put(name, found, passwd);
+    }
+
+    // 用上一页的最后一个用户名定位下一页，不用OFFSET，每页的代价都一样
+    // 预热时整页读取，放到从库上，不和注册抢主库
+    int scan(char *cursor, size_t cursor_len, user_row_handler on_row, void *arg)
+    {
+        bool replica;
+        int rows = scan_page(cursor, cursor_len, on_row, arg, false, replica);
+        if (rows < 0 && replica) // 从库出错时这一页回主库读
+            rows = scan_page(cursor, cursor_len, on_row, arg, true, replica);
+        return rows;
+    }
+
+    void get_write_stats(long long &batches, long long &rows)
+    {
+        m_registrar.get_stats(batches, rows);
+    }
+
+    // 读取并清零查找缓存的命中情况、主库和每个从库的读请求数，返回从库个数
+    int get_read_stats(long long &cache_hits, long long &cache_misses, long long &primary_reads, long long *replica_reads)
+    {
+        m_cache.get_stats(cache_hits, cache_misses);
+        return m_router.get_read_stats(primary_reads, replica_reads);
+    }
+};
+
+#endif
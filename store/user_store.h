@@ -0,0 +1,49 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <stddef.h>
+
+/****************************************************************************************/
+/* 用户名和密码的存储后端接口，登录和注册只通过它访问存储，不关心数据存在哪里                    */
+/*   mysql_store.h：存在MySQL的user表里，查询走连接池的预处理语句，注册攒批写入                  */
+/*   local_store.h：内嵌的本地存储引擎，追加写的日志文件加mmap的哈希索引，不需要数据库服务        */
+/* 所有接口都是线程安全的，可以在多个工作线程中同时调用                                         */
+/****************************************************************************************/
+
+// 遍历用户时每一行的回调
+typedef void (*user_row_handler)(const char *name, const char *passwd, void *arg);
+
+class user_store
+{
+public:
+    virtual ~user_store()
+    {
+    }
+
+    // 按用户名查密码，返回1表示有这个用户，0表示没有，-1表示出错
+    virtual int find(const char *name, char *passwd, size_t len) = 0;
+
+    // 插入一个用户，返回0表示成功，否则为错误码（用户名已经存在也是错误）
+    virtual int insert(const char *name, const char *passwd) = 0;
+
+    // 从cursor处读下一页用户，逐行回调，把cursor更新到这一页之后
+    // cursor第一次传空串；返回这一页的行数，0表示已经读完，-1表示出错
+    virtual int scan(char *cursor, size_t cursor_len, user_row_handler on_row, void *arg) = 0;
+
+    // 只看后端自己的结果缓存，不访问存储：返回1表示有这个用户，0表示没有，-1表示缓存里没有结论
+    // 给不经过find的查询（比如主线程里的异步查询）先用，默认没有缓存
+    virtual int peek(const char *name, char *passwd, size_t len)
+    {
+        return -1;
+    }
+
+    // 不经过find查到的结果交给后端缓存，found为1表示有这个用户，0表示没有
+    virtual void remember(const char *name, int found, const char *passwd)
+    {
+    }
+
+    // 读取并清零写入的批数和写入的用户数
+    virtual void get_write_stats(long long &batches, long long &rows) = 0;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <list>
+#include <atomic>
+#include "../lock/locker.h"
+#include "../lock/ring_queue.h"
+
+/****************************************************************************************/
+/* 线程池工作队列的竞争测试：无锁环形队列ring_queue对比原来的std::list+互斥锁+信号量            */
+/*   生产者和消费者各n个（n从1到64），生产者用try_push放入，队列满时让出CPU再试，                */
+/*   和threadpool::append的用法一样；消费者阻塞地pop，取到0时退出                              */
+/*   输出每种线程数下两种队列的吞吐量（每秒百万次入队+出队）                                     */
+/* 用法：ring_queue_bench [每轮元素个数] [队列容量]                                             */
+/****************************************************************************************/
+
+// 原来threadpool里的工作队列：std::list加互斥锁，信号量记录可取的元素数
+template <class T>
+class locked_queue
+{
+private:
+    std::list<T> m_list;
+    locker m_lock;
+    sem m_items;
+    int m_max_size;
+
+public:
+    locked_queue(int max_size) : m_items(0), m_max_size(max_size) {}
+
+    bool try_push(const T &item)
+    {
+        m_lock.lock();
+        if ((int)m_list.size() >= m_max_size)
+        {
+            m_lock.unlock();
+            return false;
+        }
+        m_list.push_back(item);
+        m_lock.unlock();
+        m_items.post();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        if (!m_items.wait())
+            return false;
+        m_lock.lock();
+        item = m_list.front();
+        m_list.pop_front();
+        m_lock.unlock();
+        return true;
+    }
+};
+
+template <class Q>
+struct bench_args
+{
+    Q *queue;
+    long count;                // 生产者要放入的元素个数
+    std::atomic<long> *sum;    // 消费者取到的元素之和，用来检查没有丢失或者重复
+};
+
+template <class Q>
+static void *producer(void *arg)
+{
+    bench_args<Q> *a = (bench_args<Q> *)arg;
+    for (long i = 1; i <= a->count; ++i)
+        while (!a->queue->try_push(i))
+            sched_yield();
+    return NULL;
+}
+
+template <class Q>
+static void *consumer(void *arg)
+{
+    bench_args<Q> *a = (bench_args<Q> *)arg;
+    long sum = 0, item;
+    while (a->queue->pop(item) && item)
+        sum += item;
+    a->sum->fetch_add(sum);
+    return NULL;
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// n个生产者、n个消费者一共传递total个元素，返回每秒百万次操作数，元素丢失或重复时返回-1
+template <class Q>
+static double run(int n, long total, int capacity)
+{
+    Q queue(capacity);
+    std::atomic<long> sum(0);
+    long per = total / n;
+    bench_args<Q> a = {&queue, per, &sum};
+    pthread_t producers[64], consumers[64];
+
+    double start = now_sec();
+    for (int i = 0; i < n; ++i)
+        pthread_create(&consumers[i], NULL, consumer<Q>, &a);
+    for (int i = 0; i < n; ++i)
+        pthread_create(&producers[i], NULL, producer<Q>, &a);
+    for (int i = 0; i < n; ++i)
+        pthread_join(producers[i], NULL);
+    for (int i = 0; i < n; ++i) // 每个消费者一个0，取到就退出
+        while (!queue.try_push(0))
+            sched_yield();
+    for (int i = 0; i < n; ++i)
+        pthread_join(consumers[i], NULL);
+    double elapsed = now_sec() - start;
+
+    if (sum.load() != (long)n * per * (per + 1) / 2)
+        return -1;
+    return per * n / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    long total = argc > 1 ? atol(argv[1]) : 2000000;
+    int capacity = argc > 2 ? atoi(argv[2]) : 10000; // 和main中静态文件线程池的max_requests一样
+
+    printf("%d cpus, %ld items per run, capacity %d\n", (int)sysconf(_SC_NPROCESSORS_ONLN), total, capacity);
+    printf("%8s %14s %14s %8s\n", "threads", "locked Mops/s", "ring Mops/s", "speedup");
+    for (int n = 1; n <= 64; n *= 2)
+    {
+        double locked = run<locked_queue<long> >(n, total, capacity);
+        double ring = run<ring_queue<long> >(n, total, capacity);
+        if (locked < 0 || ring < 0)
+        {
+            printf("%8d lost or duplicated items\n", n);
+            return 1;
+        }
+        printf("%5dx%-2d %14.2f %14.2f %7.2fx\n", n, n, locked, ring, ring / locked);
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../log/log.h"
+#include "../timer/timing_wheel.h"
+
+/****************************************************************************************/
+/* 时间轮的规模测试：定时器从1千个到1百万个，每种操作的平均耗时应该基本不变                      */
+/*   add      插入n个超时时间散布在未来60秒内的定时器                                          */
+/*   adjust   把每个定时器改到新的随机超时时间                                                 */
+/*   del      删除一半的定时器                                                                */
+/*   expire   剩下的定时器改到未来200毫秒内超时，等全部超时后一次tick处理完，包括逐层降级的开销     */
+/* 输出每种操作平均每个定时器多少纳秒                                                          */
+/* 一百万个定时器结点有几十MB，随机访问基本都是cache miss，耗时会上涨一些，但和定时器个数无关     */
+/****************************************************************************************/
+
+static int fired; // 触发的定时器个数
+
+static void on_expire(client_data *)
+{
+    ++fired;
+}
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift随机数，每轮用同一个种子，结果可以复现
+static unsigned long long next_rand(unsigned long long &x)
+{
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+static void run(int n)
+{
+    client_data *users = new client_data[n];
+    timing_wheel wheel(1); // 1毫秒一个tick，60秒内的超时分布在第0到第2层
+    unsigned long long seed = 88172645463325252ULL;
+    long long base = now_ms();
+
+    for (int i = 0; i < n; ++i)
+    {
+        users[i].timer.user_data = &users[i];
+        users[i].timer.cb_func = on_expire;
+        users[i].timer.expire = base + next_rand(seed) % 60000;
+    }
+
+    long long start = now_ns();
+    for (int i = 0; i < n; ++i)
+        wheel.add_timer(&users[i].timer);
+    double add_ns = (double)(now_ns() - start) / n;
+
+    for (int i = 0; i < n; ++i)
+        users[i].timer.expire = base + next_rand(seed) % 60000;
+    start = now_ns();
+    for (int i = 0; i < n; ++i)
+        wheel.adjust_timer(&users[i].timer);
+    double adjust_ns = (double)(now_ns() - start) / n;
+
+    start = now_ns();
+    for (int i = 0; i < n; i += 2)
+        wheel.del_timer(&users[i].timer);
+    double del_ns = (double)(now_ns() - start) / ((n + 1) / 2);
+
+    base = now_ms();
+    int left = wheel.size();
+    for (int i = 1; i < n; i += 2)
+    {
+        users[i].timer.expire = base + next_rand(seed) % 200;
+        wheel.adjust_timer(&users[i].timer);
+    }
+    while (now_ms() <= base + 200) // 等到全部超时，再用一次tick处理，只算处理的开销
+        usleep(10000);
+    fired = 0;
+    start = now_ns();
+    wheel.tick();
+    double expire_ns = (double)(now_ns() - start) / left;
+
+    if (fired != left)
+        printf("%9d fired %d of %d timers\n", n, fired, left);
+    printf("%9d %10.1f %10.1f %10.1f %10.1f\n", n, add_ns, adjust_ns, del_ns, expire_ns);
+    delete[] users;
+}
+
+int main()
+{
+    Log::get_instance()->set_level(LOG_LEVEL_ERROR); // 不写每次tick的日志
+
+    printf("%9s %10s %10s %10s %10s   (ns per timer)\n", "timers", "add", "adjust", "del", "expire");
+    for (int n = 1000; n <= 1000000; n *= 10)
+        run(n);
+    return 0;
+}
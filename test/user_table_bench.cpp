@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <atomic>
+#include "../lock/locker.h"
+#include "../http/user_table.h"
+
+/****************************************************************************************/
+/* 用户表的查找吞吐量测试：分片无锁读的user_table对比原来的map<string, string>+全局互斥锁        */
+/*   先加载n个用户，再用1到16个线程随机校验已有用户的密码，输出每秒百万次查找                     */
+/*   用户名事先格式化好，只测查找本身                                                          */
+/*   最后8个线程同时注册同一批用户名，检查每个用户名只有一次注册成功                              */
+/* 用法：user_table_bench [用户数] [每个线程的查找次数]                                         */
+/****************************************************************************************/
+
+// 原来的用户表：std::map加一把全局互斥锁
+class locked_map
+{
+private:
+    std::map<std::string, std::string> m_users;
+    locker m_lock;
+
+public:
+    void insert(const char *name, const char *passwd)
+    {
+        m_lock.lock();
+        m_users[name] = passwd;
+        m_lock.unlock();
+    }
+
+    int check(const char *name, const char *passwd)
+    {
+        m_lock.lock();
+        std::map<std::string, std::string>::iterator it = m_users.find(name);
+        int ret = it == m_users.end() ? -1 : it->second == passwd;
+        m_lock.unlock();
+        return ret;
+    }
+};
+
+static char (*names)[16]; // 事先格式化好的用户名
+static int user_count;
+static long lookups;
+
+template <class M>
+struct bench_args
+{
+    M *users;
+    unsigned long long seed;
+    long found;
+};
+
+template <class M>
+static void *lookup(void *arg)
+{
+    bench_args<M> *a = (bench_args<M> *)arg;
+    unsigned long long x = a->seed;
+    long found = 0;
+    for (long i = 0; i < lookups; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        found += a->users->check(names[x % user_count], "passwd") == 1;
+    }
+    a->found = found;
+    return NULL;
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// threads个线程同时查找，返回每秒百万次查找，有查不到的用户时返回-1
+template <class M>
+static double run(M &users, int threads)
+{
+    pthread_t tids[16];
+    bench_args<M> args[16];
+    double start = now_sec();
+    for (int i = 0; i < threads; ++i)
+    {
+        args[i].users = &users;
+        args[i].seed = 88172645463325252ULL + i * 7919;
+        pthread_create(&tids[i], NULL, lookup<M>, &args[i]);
+    }
+    long found = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(tids[i], NULL);
+        found += args[i].found;
+    }
+    double elapsed = now_sec() - start;
+    if (found != lookups * threads)
+        return -1;
+    return lookups * threads / elapsed / 1e6;
+}
+
+static user_table race_table;
+static const int RACE_NAMES = 20000;
+static std::atomic<int> race_wins(0);
+
+// 注册线程：把同一批用户名都注册一遍，记下成功的次数
+static void *register_all(void *)
+{
+    char name[16];
+    int wins = 0;
+    for (int i = 0; i < RACE_NAMES; ++i)
+    {
+        snprintf(name, sizeof(name), "r%d", i);
+        wins += race_table.insert(name, "passwd");
+    }
+    race_wins.fetch_add(wins);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    user_count = argc > 1 ? atoi(argv[1]) : 1000000;
+    lookups = argc > 2 ? atol(argv[2]) : 200000;
+
+    names = new char[user_count][16];
+    for (int i = 0; i < user_count; ++i)
+        snprintf(names[i], sizeof(names[i]), "user%d", i);
+
+    double start = now_sec();
+    locked_map map;
+    for (int i = 0; i < user_count; ++i)
+        map.insert(names[i], "passwd");
+    double map_load = now_sec() - start;
+
+    start = now_sec();
+    user_table table;
+    table.reserve(user_count);
+    for (int i = 0; i < user_count; ++i)
+        table.insert(names[i], "passwd");
+    double table_load = now_sec() - start;
+
+    printf("%d cpus, %d users (load: map %.2fs, user_table %.2fs), %ld lookups per thread\n",
+           (int)sysconf(_SC_NPROCESSORS_ONLN), user_count, map_load, table_load, lookups);
+    printf("%8s %18s %18s %8s\n", "threads", "map M lookups/s", "table M lookups/s", "speedup");
+    for (int threads = 1; threads <= 16; threads *= 2)
+    {
+        double locked = run(map, threads);
+        double lock_free = run(table, threads);
+        if (locked < 0 || lock_free < 0)
+        {
+            printf("%8d missing users\n", threads);
+            return 1;
+        }
+        printf("%8d %18.2f %18.2f %7.2fx\n", threads, locked, lock_free, lock_free / locked);
+    }
+
+    pthread_t tids[8];
+    for (int i = 0; i < 8; ++i)
+        pthread_create(&tids[i], NULL, register_all, NULL);
+    for (int i = 0; i < 8; ++i)
+        pthread_join(tids[i], NULL);
+    printf("8 threads registering %d names each: %d succeeded\n", RACE_NAMES, race_wins.load());
+    delete[] names;
+    return race_wins.load() == RACE_NAMES ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <atomic>
+#include <cmath>
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+//// 基于排队时延的准入控制，思路来自CoDel(Controlled Delay)                                       ////
+//// 工作线程每取出一个请求就上报它的排队时长(sojourn time)：                                       ////
+////   排队时长持续超过m_target_us达m_interval_us之久，说明队列形成了「坏队列」，进入过载状态         ////
+////   只要有一个请求的排队时长低于m_target_us，就退出过载状态                                       ////
+//// 主线程在请求入队前询问是否丢弃：过载状态下按CoDel的控制律，每隔 interval/sqrt(count) 丢弃一个， ////
+//// 持续过载时丢弃越来越密，直到排队时长回到目标以内。被丢弃的请求直接在主线程回复503，不进入队列    ////
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+class codel
+{
+public:
+    codel(long long target_us = 5000, long long interval_us = 100000)
+        : m_target_us(target_us), m_interval_us(interval_us), m_first_above_us(0), m_overloaded(false),
+          m_dropping(false), m_count(0), m_last_count(0), m_drop_next_us(0)
+    {
+    }
+
+    // 工作线程取出请求时调用，sojourn_us是该请求的排队时长，可以被多个线程并发调用
+    void on_dequeue(long long sojourn_us, long long now_us)
+    {
+        if (sojourn_us < m_target_us)
+        {
+            m_first_above_us.store(0, std::memory_order_relaxed);
+            if (m_overloaded.load(std::memory_order_relaxed))
+                m_overloaded.store(false, std::memory_order_relaxed);
+            return;
+        }
+
+        long long first_above = m_first_above_us.load(std::memory_order_relaxed);
+        if (first_above == 0) // 刚开始超过目标时延，再观察一个interval
+            m_first_above_us.compare_exchange_strong(first_above, now_us + m_interval_us, std::memory_order_relaxed);
+        else if (now_us >= first_above && !m_overloaded.load(std::memory_order_relaxed))
+            m_overloaded.store(true, std::memory_order_relaxed);
+    }
+
+    // 请求入队前由主线程调用，返回true表示应当丢弃该请求；只允许一个线程调用
+    bool should_drop(long long now_us)
+    {
+        if (!m_overloaded.load(std::memory_order_relaxed))
+        {
+            m_dropping = false;
+            return false;
+        }
+
+        if (!m_dropping) // 刚进入过载状态，立即丢弃一个
+        {
+            m_dropping = true;
+            // 如果距离上次过载不久，沿用上次的丢弃密度，避免每次都从头开始
+            int delta = m_count - m_last_count;
+            m_count = (delta > 1 && now_us - m_drop_next_us < 16 * m_interval_us) ? delta : 1;
+            m_last_count = m_count;
+            m_drop_next_us = control_law(now_us);
+            return true;
+        }
+
+        if (now_us >= m_drop_next_us) // 到了下一次丢弃的时间
+        {
+            ++m_count;
+            m_drop_next_us = control_law(m_drop_next_us);
+            return true;
+        }
+        return false;
+    }
+
+    bool overloaded()
+    {
+        return m_overloaded.load(std::memory_order_relaxed);
+    }
+
+private:
+    // CoDel控制律：下一次丢弃的时间间隔为 interval/sqrt(count)
+    long long control_law(long long t)
+    {
+        return t + (long long)(m_interval_us / std::sqrt((double)m_count));
+    }
+
+private:
+    long long m_target_us;                  // 目标排队时延
+    long long m_interval_us;                // 排队时延持续超过目标多久才认为过载
+    std::atomic<long long> m_first_above_us; // 排队时延超过目标后，应当判定为过载的时间点，0表示当前没有超过目标
+    std::atomic<bool> m_overloaded;          // 是否处于过载状态，由工作线程根据排队时长更新
+
+    // 以下成员只在主线程的should_drop中访问
+    bool m_dropping;          // 主线程是否处于丢弃状态
+    int m_count;              // 本轮过载已经丢弃的请求数，决定丢弃的密度
+    int m_last_count;         // 进入本轮过载时的m_count
+    long long m_drop_next_us; // 下一次丢弃的时间
+};
+
+#endif
@@ -1,86 +1,220 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
 #include <exception>
+#include <atomic>
 #include <pthread.h>
+#include <time.h>
+#include <sys/sysinfo.h>
 #include "../lock/locker.h"
-#include "../CGImysql/sql_connection_pool.h"
+#include "../lock/ring_queue.h"
+#include "../lock/clock.h"
+#include "codel.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+//// 弹性线程池：线程数在[m_thread_number, m_max_thread_number]之间随负载伸缩                      ////
+//// 扩容：append时发现没有空闲线程、请求在队列里排队太久，并且正在跑CPU的线程还不到核数时，新建线程  ////
+////       「正在跑CPU的线程数」用 忙碌线程数 * (1 - 阻塞比例) 估算，阻塞比例来自每个任务的            ////
+////       墙上时间和线程CPU时间之差，所以访问MySQL被阻塞的任务会触发扩容，纯静态文件请求不会        ////
+//// 缩容：线程空闲超过m_idle_timeout_ms且线程数多于m_thread_number时自行退出                       ////
+//// 工作线程是分离的，析构时用空任务叫醒空闲线程，等所有线程都退出之后才返回                         ////
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+// 线程池在一个统计周期内的运行情况
+struct pool_stats
+{
+    int threads;              // 当前存活的工作线程数
+    int queued;               // 请求队列中排队的请求数
+    long long requests;       // 本周期处理完的请求数
+    long long avg_wait_us;    // 本周期请求在队列中的平均排队时长
+    long long max_wait_us;    // 本周期请求在队列中的最长排队时长
+    long long avg_service_us; // 本周期请求的平均处理时长
+    long long shed;           // 本周期因为过载或队列满被拒绝的请求数
+};
 
 template <typename T>
 class threadpool // 线程池类，将它定义为模板类是为了代码复用。模板参数T是任务类
 {
 public:
-    threadpool(connection_pool *connPool, int thread_number = 8, int max_request = 10000); // 构造函数
-    ~threadpool();                                                                         // 析构函数
-    bool append(T *request);                                                               // 向请求队列中添加任务请求
+    // thread_number是常驻线程数，max_thread_number大于thread_number时开启弹性模式
+    threadpool(int thread_number = 8, int max_request = 10000, int max_thread_number = 0); // 构造函数
+    ~threadpool();                                                                         // 析构函数，等所有工作线程退出
+    void shutdown();                                                                       // 停止线程池，正在处理的请求处理完，等所有工作线程退出后返回
+    bool append(T *request);                                                               // 向请求队列中添加任务请求，过载或队列满时返回false
+
+    int thread_count() { return m_alive.load(std::memory_order_relaxed); } // 当前存活的工作线程数
+    void get_stats(pool_stats &st);                                        // 读取本统计周期的运行情况并开始新的周期
 
 private:
+    // 请求队列中的元素，记录入队时间用于计算排队时长
+    struct task
+    {
+        T *request;
+        long long enqueue_us;
+    };
+
     // 工作线程运行的函数，它不断从工作队列中取出任务并执行之
     static void *worker(void *arg); //
     void run();
 
+    bool spawn_worker(); // 新建一个分离的工作线程
+    void try_grow();     // 弹性模式下判断是否需要扩容
+
 private:
-    int m_thread_number;         // 线程池中的线程数
-    int m_max_requests;          // 请求队列中允许的最大请求数
-    pthread_t *m_threads;        // 描述线程池的数组，其大小为m_thread_number
-    std::list<T *> m_workqueue;  // 请求队列
-    locker m_queuelocker;        // 保护请求队列的互斥锁
-    sem m_queuestat;             // 是否有任务需要处理
-    bool m_stop;                 // 是否结束线程
-    connection_pool *m_connPool; // 指向数据库连接池的指针
+    int m_thread_number;          // 常驻线程数，也是弹性模式下的最少线程数
+    int m_max_thread_number;      // 弹性模式下的最多线程数，等于m_thread_number时不伸缩
+    int m_max_requests;           // 请求队列中允许的最大请求数
+    int m_cpu_number;             // CPU核数，扩容时正在跑CPU的线程数不超过它
+    int m_idle_timeout_ms;        // 多出来的线程空闲多久后退出
+    int m_wait_threshold_us;      // 请求排队超过这个时长就认为线程不够用
+    int m_spawn_interval_us;      // 两次扩容之间的最小间隔，避免瞬间创建一堆线程
+    ring_queue<task> m_workqueue; // 请求队列，无锁的有界MPMC环形队列，容量为m_max_requests
+    codel m_codel;                // 基于排队时延的准入控制
+    std::atomic<int> m_alive;     // 当前存活的工作线程数
+    std::atomic<int> m_busy;      // 正在处理请求的工作线程数
+
+    std::atomic<long long> m_last_wait_us;   // 最近一个被取出的请求的排队时长
+    std::atomic<int> m_blocked_permille;     // 任务执行时间中阻塞(非CPU)时间所占的千分比，指数加权平均
+    std::atomic<long long> m_last_spawn_us;  // 上一次扩容的时间
+
+    std::atomic<long long> m_stat_requests;   // 本周期处理完的请求数
+    std::atomic<long long> m_stat_wait_us;    // 本周期排队时长之和
+    std::atomic<long long> m_stat_max_wait;   // 本周期最长排队时长
+    std::atomic<long long> m_stat_service_us; // 本周期处理时长之和
+    std::atomic<long long> m_stat_shed;       // 本周期被拒绝的请求数
+
+    std::atomic<bool> m_stop;                // 是否结束线程
+    locker m_exit_lock;                      // 工作线程退出时减m_alive并通知shutdown，两件事在同一把锁里完成
+    cond m_exited;                           // 有工作线程退出
 };
 
 template <typename T>
-threadpool<T>::threadpool(connection_pool *connPool, int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL), m_connPool(connPool)
+threadpool<T>::threadpool(int thread_number, int max_requests, int max_thread_number) : m_thread_number(thread_number), m_max_thread_number(max_thread_number > thread_number ? max_thread_number : thread_number), m_max_requests(max_requests), m_idle_timeout_ms(10000), m_wait_threshold_us(2000), m_spawn_interval_us(5000), m_workqueue(max_requests > 0 ? max_requests : 1), m_alive(0), m_busy(0), m_last_wait_us(0), m_blocked_permille(0), m_last_spawn_us(0), m_stat_requests(0), m_stat_wait_us(0), m_stat_max_wait(0), m_stat_service_us(0), m_stat_shed(0), m_stop(false)
 {
     if (thread_number <= 0 || max_requests <= 0) // 线程数和请求队列中允许的最大请求数必须大于0
         throw std::exception();
 
-    m_threads = new pthread_t[m_thread_number]; // 创建线程池中的线程数组
-
-    if (!m_threads)
-        throw std::exception(); // 创建线程数组失败
+    m_cpu_number = get_nprocs();
+    if (m_cpu_number <= 0)
+        m_cpu_number = 1;
 
     for (int i = 0; i < thread_number; ++i)
     {
         // printf("create the %dth thread\n",i);
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0) // 创建线程失败
-        {
-            delete[] m_threads;
+        if (!spawn_worker()) // 创建线程失败
             throw std::exception();
-        }
-        if (pthread_detach(m_threads[i])) // 分离线程在结束时会自动释放其资源，而无需显式调用 pthread_join 来等待它。
-        {
-            delete[] m_threads;
-            throw std::exception();
-        }
     }
 }
 
 template <typename T>
 threadpool<T>::~threadpool()
 {
-    delete[] m_threads;
+    shutdown();
+}
+
+template <typename T>
+void threadpool<T>::shutdown()
+{
     m_stop = true;
+
+    // 每个线程一个空任务，阻塞在pop里的空闲线程马上醒来看到m_stop；队列满时线程都有活干，处理完当前请求就会看到
+    task wake = {NULL, 0};
+    for (int i = m_alive.load(); i > 0; --i)
+        if (!m_workqueue.try_push(wake))
+            break;
+
+    // 线程是分离的，不能join，等m_alive减到0；减和通知在锁里，这里返回后工作线程不会再碰线程池
+    m_exit_lock.lock();
+    while (m_alive.load() > 0)
+        m_exited.wait(m_exit_lock.get());
+    m_exit_lock.unlock();
+}
+
+template <typename T>
+bool threadpool<T>::spawn_worker()
+{
+    if (m_stop)
+        return false;
+    pthread_t tid;
+    m_alive.fetch_add(1);
+    if (pthread_create(&tid, NULL, worker, this) != 0)
+    {
+        m_alive.fetch_sub(1);
+        return false;
+    }
+    pthread_detach(tid); // 分离线程在结束时会自动释放其资源，而无需显式调用 pthread_join 来等待它。
+    return true;
+}
+
+template <typename T>
+void threadpool<T>::try_grow()
+{
+    int alive = m_alive.load(std::memory_order_relaxed);
+    if (alive >= m_max_thread_number)
+        return;
+
+    int busy = m_busy.load(std::memory_order_relaxed);
+    if (busy < alive) // 还有空闲线程
+        return;
+
+    // 请求在排队：最近取出的请求等得太久，或者积压的请求已经比线程还多
+    int queued = m_workqueue.size();
+    if (queued == 0)
+        return;
+    if (m_last_wait_us.load(std::memory_order_relaxed) < m_wait_threshold_us && queued < alive)
+        return;
+
+    // 忙碌线程大多在跑CPU的话，再加线程只会抢CPU
+    int running = busy * (1000 - m_blocked_permille.load(std::memory_order_relaxed)) / 1000;
+    if (running >= m_cpu_number)
+        return;
+
+    long long now = now_us();
+    long long last = m_last_spawn_us.load(std::memory_order_relaxed);
+    if (now - last < m_spawn_interval_us || !m_last_spawn_us.compare_exchange_strong(last, now))
+        return;
+
+    spawn_worker();
+}
+
+template <typename T>
+void threadpool<T>::get_stats(pool_stats &st)
+{
+    st.threads = m_alive.load(std::memory_order_relaxed);
+    st.queued = m_workqueue.size();
+    st.requests = m_stat_requests.exchange(0, std::memory_order_relaxed);
+    long long wait = m_stat_wait_us.exchange(0, std::memory_order_relaxed);
+    long long service = m_stat_service_us.exchange(0, std::memory_order_relaxed);
+    st.max_wait_us = m_stat_max_wait.exchange(0, std::memory_order_relaxed);
+    st.avg_wait_us = st.requests ? wait / st.requests : 0;
+    st.avg_service_us = st.requests ? service / st.requests : 0;
+    st.shed = m_stat_shed.exchange(0, std::memory_order_relaxed);
 }
 
 template <typename T>
 bool threadpool<T>::append(T *request)
 {
-    m_queuelocker.lock(); // 操作工作队列时一定要加锁，因为它被所有线程共享
+    task t;
+    t.request = request;
+    t.enqueue_us = now_us();
 
-    if (m_workqueue.size() > m_max_requests) // 请求队列中的请求数超过了最大允许的数量
+    // 持续过载时按CoDel控制律拒绝请求，让已入队请求的排队时延保持在目标附近
+    if (m_codel.should_drop(t.enqueue_us))
     {
-        m_queuelocker.unlock();
+        m_stat_shed.fetch_add(1, std::memory_order_relaxed);
         return false;
     }
 
-    m_workqueue.push_back(request); // 将任务添加到请求队列中
+    // 工作队列是无锁的，不需要再加锁；请求数达到m_max_requests时入队失败
+    if (!m_workqueue.try_push(t))
+    {
+        m_stat_shed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
 
-    m_queuelocker.unlock(); // 解锁
-    m_queuestat.post();     // 信号量的值加1，表示有任务需要处理
+    if (m_max_thread_number > m_thread_number)
+        try_grow();
     return true;
 }
 
@@ -97,25 +231,57 @@ void threadpool<T>::run()
 {
     // 要明白工作线程池的工作模式
     // 每个线程都会执行下面的while循环，不断地从请求队列中取出任务并执行之
-    // 也就是说通过信号量竞争互斥来控制线程的执行，没有采用Round Robin的方式
+    // 也就是说通过无锁队列上的CAS竞争来获取任务，没有采用Round Robin的方式
     while (!m_stop)
     {
-        m_queuestat.wait();      // 等待信号量，当有任务需要处理时，将信号量减1，然后往下执行
-        m_queuelocker.lock();    // 加锁
-        if (m_workqueue.empty()) // 请求队列为空
+        task t;
+        if (!m_workqueue.pop(t, m_idle_timeout_ms)) // 阻塞等待，直到请求队列中有任务或者空闲超时
         {
-            m_queuelocker.unlock();
+            // 空闲超时，线程数多于常驻线程数时退出当前线程
+            m_exit_lock.lock();
+            bool quit = m_alive.load() > m_thread_number;
+            if (quit)
+            {
+                m_alive.fetch_sub(1);
+                m_exited.broadcast();
+            }
+            m_exit_lock.unlock();
+            if (quit)
+                return;
             continue;
         }
-        T *request = m_workqueue.front(); // 取出请求队列中的第一个任务
-        m_workqueue.pop_front();          // 删除第一个任务
-        m_queuelocker.unlock();           // 解锁
-        if (!request)                     // 任务为空
+        if (!t.request) // 任务为空
             continue;
 
-        connectionRAII mysqlcon(&request->mysql, m_connPool); // 从连接池中取出一个数据库连接(T任务类有mysql成员)
+        m_busy.fetch_add(1, std::memory_order_relaxed);
+        long long start = now_us();
+        long long cpu_start = now_us(CLOCK_THREAD_CPUTIME_ID);
+        long long wait = start - t.enqueue_us;
+        m_last_wait_us.store(wait, std::memory_order_relaxed);
+        m_codel.on_dequeue(wait, start);
 
-        request->process(); // 执行任务
+        // 数据库连接不再在这里统一获取，由真正需要查询数据库的处理函数按需获取、用完立即归还
+        t.request->process(); // 执行任务
+
+        // 统计本次任务的阻塞比例，按1/8的权重更新指数加权平均
+        long long wall = now_us() - start;
+        long long cpu = now_us(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+        int permille = wall > 0 && wall > cpu ? (int)((wall - cpu) * 1000 / wall) : 0;
+        int old = m_blocked_permille.load(std::memory_order_relaxed);
+        m_blocked_permille.store(old + (permille - old) / 8, std::memory_order_relaxed);
+
+        m_stat_requests.fetch_add(1, std::memory_order_relaxed);
+        m_stat_wait_us.fetch_add(wait, std::memory_order_relaxed);
+        m_stat_service_us.fetch_add(wall, std::memory_order_relaxed);
+        long long max_wait = m_stat_max_wait.load(std::memory_order_relaxed);
+        while (wait > max_wait && !m_stat_max_wait.compare_exchange_weak(max_wait, wait, std::memory_order_relaxed))
+            ;
+        m_busy.fetch_sub(1, std::memory_order_relaxed);
     }
+
+    m_exit_lock.lock();
+    m_alive.fetch_sub(1);
+    m_exited.broadcast();
+    m_exit_lock.unlock();
 }
 #endif
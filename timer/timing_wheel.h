@@ -0,0 +1,261 @@
+// 分层时间轮定时器
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <time.h>
+#include <netinet/in.h>
+#include "../log/log.h"
+#include "../lock/clock.h"
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+//// 升序链表定时器插入/调整定时器时要线性遍历链表，连接数一多，每次读写事件的adjust_timer都是O(n)   ////
+//// 分层时间轮把超时时间按刻度(tick)散列到5层、每层64个槽位上：                                     ////
+////   第0层每个槽位代表1个tick，第1层每个槽位代表64个tick，第L层每个槽位代表64^L个tick             ////
+////   插入：根据距离超时还有多少个tick选择层，再根据超时刻度选择槽位，O(1)                           ////
+////   删除/调整：定时器挂在槽位的双向循环链表上，直接摘下来再插入，O(1)                              ////
+////   推进：每走一个tick处理第0层的一个槽位；第0层转完一圈时把上一层对应槽位的定时器「降级」重新插入  ////
+//// 和Linux内核经典的timer wheel是同一个思路                                                     ////
+//// 惰性刷新：连接活跃时只记录最后活跃时间，定时器到期时再通过deadline_func算出真正的超时时间，     ////
+////           还没到就按新的超时时间重新挂回时间轮，所以保持连接的请求基本不会修改时间轮             ////
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+struct client_data; // 提前声明一下定时器结点中存放的用户数据
+
+// 时间轮上的定时器结点
+// 结点直接嵌在每个连接的client_data里，和连接槽位一起复用，建立/关闭连接都不需要new/delete
+class wheel_timer
+{
+public:
+    wheel_timer() : expire(0), cb_func(NULL), deadline_func(NULL), user_data(NULL), prev(NULL), next(NULL) {}
+
+public:
+    long long expire;                           // 定时器在时间轮上的触发时间（绝对时间，单位毫秒，见lock/clock.h的now_ms）
+    void (*cb_func)(client_data *);             // 任务回调函数
+    long long (*deadline_func)(client_data *);  // 惰性刷新：触发时用它重新计算真正的超时时间，为NULL时直接执行回调
+    client_data *user_data;                     // 回调函数处理的客户数据，由定时器执行者传递给回调函数
+    wheel_timer *prev;                          // 指向槽位链表中的前一个定时器，为NULL表示不在时间轮上
+    wheel_timer *next;                          // 指向槽位链表中的后一个定时器
+
+    bool pending() { return prev != NULL; } // 定时器是否挂在时间轮上
+};
+
+// 定时器结点中会存放用户数据的数据结构
+struct client_data
+{
+    sockaddr_in address;   // 客户端socket地址
+    int sockfd;            // socket文件描述符
+    long long last_active; // 最后一次有数据收发的时间，连接活跃时只更新它，不移动定时器
+    wheel_timer timer;     // 嵌在用户数据里的定时器结点
+};
+
+// 分层时间轮
+class timing_wheel
+{
+private:
+    static const int LEVELS = 5;                         // 层数
+    static const int SLOT_BITS = 6;                      // 每层槽位数的二进制位数
+    static const int SLOTS = 1 << SLOT_BITS;             // 每层的槽位数
+    static const int SLOT_MASK = SLOTS - 1;              // 取槽位下标用的掩码
+    static const long long MAX_TICKS = 1LL << (SLOT_BITS * LEVELS); // 时间轮能表示的最大tick跨度
+
+    wheel_timer m_slots[LEVELS][SLOTS]; // 每个槽位是一个带哨兵结点的双向循环链表
+    long long m_tick_ms;                // 一个tick代表多少毫秒
+    long long m_current;                // 时间轮当前走到的tick
+    int m_count;                        // 时间轮上的定时器个数
+
+    // 把定时器挂到槽位链表的尾部
+    static void link(wheel_timer *head, wheel_timer *timer)
+    {
+        timer->prev = head->prev;
+        timer->next = head;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+
+    // 把定时器从所在的槽位链表上摘下来
+    static void unlink(wheel_timer *timer)
+    {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = NULL;
+        timer->next = NULL;
+    }
+
+    // 根据超时刻度把定时器放到合适的层和槽位上
+    void place(wheel_timer *timer)
+    {
+        long long expire_tick = (timer->expire + m_tick_ms - 1) / m_tick_ms; // 向上取整，保证不会提前触发
+        long long delta = expire_tick - m_current;
+
+        if (delta < 0) // 已经超时的定时器放到当前槽位，下一个tick就处理
+        {
+            link(&m_slots[0][m_current & SLOT_MASK], timer);
+            return;
+        }
+        if (delta >= MAX_TICKS) // 超出时间轮范围的定时器放到最高层最远的位置
+        {
+            expire_tick = m_current + MAX_TICKS - 1;
+            delta = MAX_TICKS - 1;
+        }
+
+        int level = 0;
+        while (delta >= (1LL << (SLOT_BITS * (level + 1))))
+            ++level;
+        int index = (expire_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+        link(&m_slots[level][index], timer);
+    }
+
+    // 把第level层index槽位上的定时器全部取下来，按当前tick重新放置（降级到更低的层）
+    int cascade(int level, int index)
+    {
+        wheel_timer *head = &m_slots[level][index];
+        while (head->next != head)
+        {
+            wheel_timer *timer = head->next;
+            unlink(timer);
+            place(timer);
+        }
+        return index;
+    }
+
+public:
+    // tick_ms为时间轮的精度，定时器最多会比设定的超时时间晚一个tick触发
+    timing_wheel(long long tick_ms = 1000) : m_tick_ms(tick_ms > 0 ? tick_ms : 1), m_count(0)
+    {
+        for (int level = 0; level < LEVELS; ++level)
+        {
+            for (int i = 0; i < SLOTS; ++i)
+            {
+                m_slots[level][i].prev = &m_slots[level][i];
+                m_slots[level][i].next = &m_slots[level][i];
+            }
+        }
+        m_current = now_ms() / m_tick_ms;
+    }
+
+    // 析构函数把所有定时器从时间轮上摘下来，定时器结点的内存由使用者管理
+    ~timing_wheel()
+    {
+        clear();
+    }
+
+    // 把所有定时器从时间轮上摘下来，使用者释放定时器结点之前调用
+    void clear()
+    {
+        for (int level = 0; level < LEVELS; ++level)
+        {
+            for (int i = 0; i < SLOTS; ++i)
+            {
+                wheel_timer *head = &m_slots[level][i];
+                while (head->next != head)
+                    unlink(head->next);
+            }
+        }
+        m_count = 0;
+    }
+
+    // 将定时器加入到时间轮中，O(1)
+    void add_timer(wheel_timer *timer)
+    {
+        // 定时器为NULL或者已经在时间轮上说明有问题，直接返回
+        if (!timer || timer->pending())
+        {
+            return;
+        }
+        place(timer);
+        ++m_count;
+    }
+
+    // 定时器的超时时间发生变化后调整它在时间轮中的位置，延长和缩短都可以，O(1)
+    void adjust_timer(wheel_timer *timer)
+    {
+        if (!timer || !timer->prev)
+        {
+            return;
+        }
+        unlink(timer);
+        place(timer);
+    }
+
+    // 将目标定时器从时间轮中删除，O(1)；不在时间轮上的定时器直接忽略
+    void del_timer(wheel_timer *timer)
+    {
+        if (!timer || !timer->pending())
+        {
+            return;
+        }
+        unlink(timer);
+        --m_count;
+    }
+
+    int size()
+    {
+        return m_count;
+    }
+
+    // SIGALRM信号每次触发就在其信号处理函数中执行一次tick函数，把时间轮推进到当前时间，处理到期的任务
+    // 如果使用统一事件源，这个信号处理函数就是主函数
+    void tick()
+    {
+        if (m_count == 0)
+        {
+            m_current = now_ms() / m_tick_ms;
+            return;
+        }
+
+        // 每次执行tick()都写入日志
+        LOG_INFO("%s", "timer tick");
+
+        long long now = now_ms();
+        long long target = now / m_tick_ms;
+        while (m_current <= target)
+        {
+            int index = m_current & SLOT_MASK;
+
+            // 第0层转完一圈，依次把更高层对应槽位上的定时器降级
+            if (!index)
+            {
+                for (int level = 1; level < LEVELS; ++level)
+                {
+                    if (cascade(level, (m_current >> (SLOT_BITS * level)) & SLOT_MASK))
+                        break;
+                }
+            }
+            ++m_current;
+
+            // 处理第0层当前槽位上到期的定时器，先整体摘到临时链表上，重新挂回时间轮的定时器不会在本轮再被处理
+            wheel_timer expired;
+            wheel_timer *head = &m_slots[0][index];
+            if (head->next == head)
+                continue;
+            expired.next = head->next;
+            expired.prev = head->prev;
+            expired.next->prev = &expired;
+            expired.prev->next = &expired;
+            head->next = head->prev = head;
+
+            while (expired.next != &expired)
+            {
+                wheel_timer *timer = expired.next;
+                unlink(timer);
+
+                // 惰性刷新：连接在此期间活跃过，按最后活跃时间算出的新超时时间重新挂回时间轮
+                if (timer->deadline_func)
+                {
+                    long long deadline = timer->deadline_func(timer->user_data);
+                    if (deadline > now)
+                    {
+                        timer->expire = deadline;
+                        place(timer);
+                        continue;
+                    }
+                }
+
+                --m_count;
+                timer->cb_func(timer->user_data); // 调用定时器的回调函数，以执行定时任务
+            }
+        }
+    }
+};
+
+#endif